@@ -34,12 +34,22 @@
 #include <linux/input.h>
 
 #include "picmodule.h"
+#include "wqueue.h"
+
+/* Write queue classes, a later write replaces a queued one of its class */
+enum {
+	A125_WQ_BACKLIGHT = WQUEUE_BARRIER + 1,
+	A125_WQ_LINE0,
+	A125_WQ_LINE1,
+};
 
 static int serial;
+static struct wqueue *wqueue;
 static struct termios oldtio, newtio;
 static pthread_t a125_thread;
 static int a125_detected = 0;
 static unsigned int button_state = 0;
+static int lcd_button;			/* Lua function called for keys */
 
 static int serial_read(unsigned char *buf, int len)
 {
@@ -91,13 +101,9 @@ static int serial_read(unsigned char *buf, int len)
 	return got;
 }
 
-static int serial_write(unsigned char *buf, int len)
+static int serial_write(int class, unsigned char *buf, int len)
 {
-	int err;
-
-	err = write(serial, buf, len);
-
-	return err;
+	return wqueue_write(wqueue, class, buf, len);
 }
 
 static int a125_read_serial_events(void)
@@ -144,7 +150,7 @@ static int a125_read_serial_events(void)
 			/* newly released buttons */
 			up = button_state & ~state;
 
-			call_function("lcd_button", "%d%d%d", state, down, up);
+			call_handler(lcd_button, state, down, up);
 		}
 		button_state = state;
 		break;
@@ -178,8 +184,13 @@ static void *serial_poll(void *tmp UNUSED)
 	FD_ZERO(&rset);
 	FD_SET(serial, &rset);
 
+	/* serial_close() may cancel the thread in select(), never while
+	   it handles an event */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 		err = select(serial + 1, &rset, NULL, NULL, NULL);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 		if (err <= 0) {
 			FD_SET(serial, &rset);
 			continue;
@@ -238,8 +249,11 @@ static int serial_open(const char *device)
 	/* tell LCD to get the current button state.
 	   This also tests if there is a LCD, to avoid fighting with a serial
 	   console. */
+	wqueue = wqueue_new("a125", serial);
+	if (!wqueue)
+		return -1;
 	a125_detected = 0;
-	err = serial_write(buf, 2);
+	err = serial_write(WQUEUE_BARRIER, buf, 2);
 	if (err < 0) {
 		print_log(LOG_ERR, "Error sending commands to A125 LCD at %s: %s",
 				device, strerror(errno));
@@ -250,25 +264,27 @@ static int serial_open(const char *device)
 
 static void serial_close(void)
 {
+	pthread_cancel(a125_thread);
+	pthread_join(a125_thread, NULL);
+	wqueue_free(wqueue);
+	wqueue = NULL;
 	tcsetattr(serial, TCSANOW, &oldtio);
 	close(serial);
 }
 
-static int a125_backlight(int argc, const char **argv)
+static const struct picoption a125_backlight_options[] = {
+	{ "on",		0x01 },
+	{ "off",	0x00 },
+	{ NULL }
+};
+
+static int a125_backlight(const struct picoption *option)
 {
 	unsigned char code[3] = { 0x4D, 0x5E, 0x00 };
 
-	if (argc != 1)
-		return -1;
-
-	if (strcmp(argv[0], "on") == 0)
-		code[2] = 0x01;
-	else if (strcmp(argv[0], "off") == 0)
-		code[2] = 0x00;
-	else
-		return -1;
+	code[2] = option->code;
 
-	return serial_write(code, 3);
+	return serial_write(A125_WQ_BACKLIGHT, code, 3);
 }
 
 static int a125_line(int id, const char *line)
@@ -285,7 +301,7 @@ static int a125_line(int id, const char *line)
 		l = 16;
 	memcpy(code + 4, line, l);
 
-	return serial_write(code, 20);
+	return serial_write(id ? A125_WQ_LINE1 : A125_WQ_LINE0, code, 20);
 }
 
 
@@ -312,7 +328,7 @@ static int a125_reset(int argc, const char **argv UNUSED)
 	if (argc != 0)
 		return -1;
 
-	return serial_write(code, 2);
+	return serial_write(WQUEUE_BARRIER, code, 2);
 }
 
 static int a125_clear(int argc, const char **argv UNUSED)
@@ -322,7 +338,7 @@ static int a125_clear(int argc, const char **argv UNUSED)
 	if (argc != 0)
 		return -1;
 
-	return serial_write(code, 2);
+	return serial_write(WQUEUE_BARRIER, code, 2);
 }
 
 static int a125_init(int argc, const char **argv)
@@ -338,6 +354,9 @@ static int a125_init(int argc, const char **argv)
 		devicename = argv[0];
 	else
 		devicename = "/dev/ttyS0";
+	lcd_button = register_handler("lcd_button", "%d%d%d");
+	if (lcd_button < 0)
+		return -1;
 	err = serial_open(devicename);
 	if (err < 0)
 		return err;
@@ -346,11 +365,11 @@ static int a125_init(int argc, const char **argv)
 	                       "Reset the LCD",
 	                       "Reset the LCD\n",
 	                       a125_reset);
-	err = register_command("lcd-backlight",
-	                       "Set the LCD backlight",
-	                       "Set the LCD backlight, options are:\n"
-	                       "\ton\n\toff\n",
-	                       a125_backlight);
+	err = register_option_command("lcd-backlight",
+	                              "Set the LCD backlight",
+	                              "Set the LCD backlight",
+	                              a125_backlight_options,
+	                              a125_backlight);
 	err = register_command("lcd-clear",
 	                       "Clear the LCD",
 	                       "Clean the LCD\n",
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_BENCH_H
+#define BENCH_BENCH_H
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Helpers for the programs run by "make bench". Each prints one line per
+ * measurement: what was measured and its cost per operation.
+ */
+
+static inline double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Print the cost of each of n operations which took seconds in total */
+static inline void bench_report(const char *what, double seconds, long n)
+{
+	double per = seconds / n;
+
+	if (per >= 1e-3)
+		printf("%-40s %10.3f ms\n", what, per * 1e3);
+	else if (per >= 1e-6)
+		printf("%-40s %10.3f us\n", what, per * 1e6);
+	else
+		printf("%-40s %10.1f ns\n", what, per * 1e9);
+}
+
+#endif
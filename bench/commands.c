@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Command lookup by name with the hash index and with the scan it replaced,
+ * which find_command() still falls back to before index_commands(), for
+ * growing synthetic command sets.
+ */
+
+#define main qcontrol_main
+#include "qcontrol.c"
+#undef main
+
+#include "bench/bench.h"
+
+#define LOOKUPS	1000000
+
+static char **names;
+
+static int synthetic(int argc UNUSED, const char **argv UNUSED)
+{
+	return 0;
+}
+
+/* Grow the command set to n commands */
+static void add_commands(unsigned int n)
+{
+	char name[MAX_CMD_NAME + 1];
+
+	names = realloc(names, n * sizeof(*names));
+	if (!names)
+		exit(1);
+	while (commandcount < n) {
+		snprintf(name, sizeof(name), "cmd-%05u", commandcount);
+		names[commandcount] = strdup(name);
+		if (!names[commandcount] ||
+		    register_command(names[commandcount], "", "",
+		                     synthetic) < 0)
+			exit(1);
+	}
+}
+
+/* Scans get fewer lookups as the set grows, or they would take minutes */
+static void lookup(const char *what, unsigned int n, bool hit, long lookups)
+{
+	char label[64], miss[MAX_CMD_NAME + 1];
+	const char *cmd;
+	double start;
+	long i, found = 0;
+
+	snprintf(miss, sizeof(miss), "cmd-%05u", n);
+	start = bench_now();
+	for (i = 0; i < lookups; i++) {
+		/* Hits are spread over the whole set */
+		cmd = hit ? names[(i * 7919) % n] : miss;
+		found += find_command(cmd) >= 0;
+	}
+	snprintf(label, sizeof(label), "%s, %u commands, %s", what, n,
+	         hit ? "hit" : "miss");
+	bench_report(label, bench_now() - start, lookups);
+	if (found != (hit ? lookups : 0))
+		exit(1);
+}
+
+int main(void)
+{
+	static const unsigned int sizes[] = { 16, 64, 256, 1024, 4096 };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		add_commands(sizes[i]);
+		lookup("scan", sizes[i], true, LOOKUPS * 16 / sizes[i]);
+		lookup("scan", sizes[i], false, LOOKUPS * 16 / sizes[i]);
+		if (index_commands() < 0)
+			exit(1);
+		lookup("index", sizes[i], true, LOOKUPS);
+		lookup("index", sizes[i], false, LOOKUPS);
+	}
+
+	return 0;
+}
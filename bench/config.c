@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Loading the config files, here the configs in examples/ standing in for
+ * /etc/qcontrol.conf and its confdir: compiled from source each time, as
+ * without the cache, compiled and written to the cache because the files
+ * changed, and taken from the cache. Needs root for the tmpfs over
+ * /var/cache, see tests/daemon.h.
+ */
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "luacache.h"
+#include "bench/bench.h"
+#include "tests/daemon.h"
+
+#define DIR	"/run/qcontrol-bench"
+#define LOADS	200
+
+static const char *configs[] = {
+	"mv2120.lua", "synology.lua", "ts209.lua", "ts219.lua", "ts409.lua",
+	"ts41x.lua",
+};
+#define NCONFIGS (sizeof(configs) / sizeof(configs[0]))
+
+static char paths[NCONFIGS][64];
+
+int print_log(int priority UNUSED, const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vfprintf(stderr, format, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	return n;
+}
+
+/* Copy the examples to the tmpfs, so that they can be touched */
+static int copy_configs(void)
+{
+	char cmd[256];
+	unsigned int i;
+
+	snprintf(cmd, sizeof(cmd), "mkdir -p " DIR " && cp examples/*.lua "
+	         DIR);
+	if (system(cmd) != 0)
+		return -1;
+	for (i = 0; i < NCONFIGS; i++)
+		snprintf(paths[i], sizeof(paths[i]), DIR "/%s", configs[i]);
+	return 0;
+}
+
+/* Give every file a new mtime, which makes its cache entry stale */
+static void touch_configs(long n)
+{
+	struct timespec times[2] = { { n, 0 }, { n, 0 } };
+	unsigned int i;
+
+	for (i = 0; i < NCONFIGS; i++)
+		if (utimensat(AT_FDCWD, paths[i], times, 0) < 0)
+			exit(1);
+}
+
+static void load(const char *what, int (*loadfile)(lua_State *, const char *),
+                 bool stale)
+{
+	lua_State *L = luaL_newstate();
+	double start, spent = 0;
+	unsigned int i;
+	long n;
+
+	if (!L)
+		exit(1);
+	for (n = 0; n < LOADS; n++) {
+		if (stale)
+			touch_configs(n + 1);
+		start = bench_now();
+		for (i = 0; i < NCONFIGS; i++) {
+			if (loadfile(L, paths[i]) != 0) {
+				fprintf(stderr, "%s\n", lua_tostring(L, -1));
+				exit(1);
+			}
+			lua_pop(L, 1);
+		}
+		spent += bench_now() - start;
+	}
+	bench_report(what, spent, LOADS);
+	lua_close(L);
+}
+
+int main(void)
+{
+	if (test_sandbox() < 0)
+		return TEST_SKIP;
+	if (copy_configs() < 0)
+		return 1;
+
+	printf("%u files, per load of all of them\n", (unsigned int)NCONFIGS);
+	load("luaL_loadfile(), no cache", luaL_loadfile, false);
+	load("luacache, files changed", luacache_loadfile, true);
+	load("luacache, cached", luacache_loadfile, false);
+
+	return 0;
+}
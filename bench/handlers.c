@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cost of an event in the main loop, from call_handler() to the return of
+ * its Lua function: the temp() handler of examples/ts41x.lua, an empty one
+ * to show what dispatching alone costs, and an event the config has no
+ * function for. Handlers are called through the reference resolve_handlers()
+ * took and, as before it, looked up in the globals for each event. Two
+ * more handlers run a command with piccmd(), through the FFI when built
+ * with LUA=luajit and through the Lua C API. Build with either Lua to
+ * compare the interpreters.
+ */
+
+#define main qcontrol_main
+#include "qcontrol.c"
+#undef main
+
+#include "bench/bench.h"
+
+#define EVENTS	200000
+#define ROUNDS	5	/* Of EVENTS, the fastest is reported */
+
+/* As in examples/ts41x.lua */
+static const char config[] =
+	"last_temp_log = nil\n"
+	"last_temp_value = 0\n"
+	"function logtemp( temp )\n"
+	"	local now = os.time()\n"
+	"	local function should_log(  )\n"
+	"		local delta_temp = math.abs(temp - last_temp_value)\n"
+	"		local delta_time = os.difftime(now, last_temp_log)\n"
+	"		if ( not last_temp_log ) then\n"
+	"			return true\n"
+	"		end\n"
+	"		if ( delta_temp >= 5 ) then\n"
+	"			return true\n"
+	"		end\n"
+	"		if ( delta_time >= 300 ) then\n"
+	"			if ( delta_temp > 1 ) then\n"
+	"				return true\n"
+	"			else\n"
+	"				last_temp_log = now\n"
+	"				return false\n"
+	"			end\n"
+	"		end\n"
+	"		return false\n"
+	"	end\n"
+	"	if ( should_log() ) then\n"
+	"		logprint(string.format(\"ts41x: temperature %d\", temp))\n"
+	"		last_temp_log = now\n"
+	"		last_temp_value = temp\n"
+	"	end\n"
+	"end\n"
+	"function temp( temp )\n"
+	"	logtemp(temp)\n"
+	"end\n"
+	"function tick( n )\n"
+	"end\n"
+	"function led( n )\n"
+	"	piccmd(\"bench-led\", \"on\")\n"
+	"end\n"
+	"function led_c( n )\n"
+	"	piccmd_c(\"bench-led\", \"on\")\n"
+	"end\n";
+
+static int bench_led(int argc UNUSED, const char **argv UNUSED)
+{
+	return 0;
+}
+
+static void dispatch(const char *what, int handler)
+{
+	double start, t, best = 0;
+	long i;
+	int round;
+
+	for (round = 0; round < ROUNDS; round++) {
+		start = bench_now();
+		/* Within 5 degrees, so that temp() logs only once */
+		for (i = 0; i < EVENTS; i++)
+			call_handler(handler, 38 + i % 4);
+		t = bench_now() - start;
+		if (round == 0 || t < best)
+			best = t;
+	}
+	bench_report(what, best, EVENTS);
+}
+
+/* As above, but with the function looked up by name for each event */
+static void dispatch_global(const char *what, int handler)
+{
+	int ref = handlers[handler].ref;
+
+	handlers[handler].ref = LUA_NOREF;
+	dispatch(what, handler);
+	handlers[handler].ref = ref;
+}
+
+/* A missing function used to be found out by calling it, with an error
+   logged for each event; the log goes to /dev/null here */
+static void dispatch_missing(const char *what, int handler)
+{
+	int null, err;
+
+	fflush(stderr);
+	err = dup(STDERR_FILENO);
+	null = open("/dev/null", O_WRONLY);
+	if (err < 0 || null < 0 || dup2(null, STDERR_FILENO) < 0)
+		exit(1);
+	dispatch_global(what, handler);
+	fflush(stderr);
+	dup2(err, STDERR_FILENO);
+	close(err);
+	close(null);
+}
+
+int main(void)
+{
+	int temp, tick, missing, led, led_c;
+
+	if (!new_lua_state() || events_init() < 0 || state_init() < 0 ||
+	    register_command("bench-led", "", "", bench_led) < 0)
+		return 1;
+	lua_thread = pthread_self();
+	/* piccmd() itself goes through the FFI with LuaJIT */
+	lua_register(lua, "piccmd_c", run_command_lua);
+	temp = register_handler("temp", "%d");
+	tick = register_handler("tick", "%d");
+	missing = register_handler("fan_stop", "");
+	led = register_handler("led", "%d");
+	led_c = register_handler("led_c", "%d");
+	if (temp < 0 || tick < 0 || missing < 0 || led < 0 || led_c < 0 ||
+	    luaL_dostring(lua, config) != 0)
+		return 1;
+	config_loaded();
+
+	dispatch("temp(), resolved", temp);
+	dispatch_global("temp(), looked up by name", temp);
+	dispatch("empty handler, resolved", tick);
+	dispatch_global("empty handler, looked up by name", tick);
+	dispatch("no function, skipped in C", missing);
+	dispatch_missing("no function, looked up by name", missing);
+	dispatch("piccmd(), FFI with LuaJIT", led);
+	dispatch("piccmd(), C API", led_c);
+
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Latency of a command as the health daemons see it: through libqcontrol
+ * on a connection kept open, connecting for each command, and spawning the
+ * qcontrol client as they used to. The library is timed on the stream and
+ * the seqpacket socket. Runs the daemon built in the tree, see
+ * tests/daemon.h.
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libqcontrol.h"
+#include "bench/bench.h"
+#include "tests/daemon.h"
+
+#define LIBRARY_COMMANDS	20000
+#define CONNECT_COMMANDS	5000
+#define SPAWN_COMMANDS		500
+
+static const char config[] =
+	"register(\"system-status\")\n"
+	"function system_status(status)\n"
+	"end\n";
+
+static const char *argv_tick[] = { "system-status", "tick" };
+
+static int command(struct qcontrol *q)
+{
+	int result;
+
+	if (qcontrol_command(q, 2, argv_tick, &result, NULL) < 0 || result < 0)
+		return -1;
+	return 0;
+}
+
+static void library(const char *what, const char *path)
+{
+	struct qcontrol *q;
+	double start;
+	long i;
+
+	q = qcontrol_connect(path);
+	if (!q)
+		exit(1);
+	start = bench_now();
+	for (i = 0; i < LIBRARY_COMMANDS; i++)
+		if (command(q) < 0)
+			exit(1);
+	bench_report(what, bench_now() - start, i);
+	qcontrol_close(q);
+}
+
+static void library_connect(const char *what, const char *path)
+{
+	struct qcontrol *q;
+	double start;
+	long i;
+
+	start = bench_now();
+	for (i = 0; i < CONNECT_COMMANDS; i++) {
+		q = qcontrol_connect(path);
+		if (!q || command(q) < 0)
+			exit(1);
+		qcontrol_close(q);
+	}
+	bench_report(what, bench_now() - start, i);
+}
+
+static void spawn(void)
+{
+	double start;
+	pid_t pid;
+	long i;
+	int status, null;
+
+	start = bench_now();
+	for (i = 0; i < SPAWN_COMMANDS; i++) {
+		pid = fork();
+		if (pid == 0) {
+			null = open("/dev/null", O_WRONLY);
+			dup2(null, STDOUT_FILENO);
+			execl("./qcontrol", "qcontrol", argv_tick[0],
+			      argv_tick[1], (char *)NULL);
+			_exit(127);
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			exit(1);
+	}
+	bench_report("spawn ./qcontrol", bench_now() - start, i);
+}
+
+int main(void)
+{
+	pid_t pid;
+
+	if (test_sandbox() < 0)
+		return TEST_SKIP;
+	signal(SIGPIPE, SIG_IGN);
+	pid = test_daemon(config);
+	if (pid < 0)
+		return 1;
+
+	library("library, connection kept", QCONTROL_SOCKET);
+	library("  on the seqpacket socket", QCONTROL_SEQPACKET_SOCKET);
+	library_connect("library, connection per command", QCONTROL_SOCKET);
+	library_connect("  on the seqpacket socket",
+	                QCONTROL_SEQPACKET_SOCKET);
+	spawn();
+
+	return test_stop(pid) < 0 ? 1 : 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput of the request decoder: frames parsed from memory, and the
+ * same stream read with msgbuf_read() from a socket it arrives on in
+ * pieces which split frames anywhere.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "bench/bench.h"
+
+#define FRAMES	10000
+#define PASSES	100
+#define CHUNK	977	/* Odd, so that reads end mid-frame */
+
+struct stream {
+	struct outbuf out;
+	int fd;
+};
+
+static void throughput(const char *what, double seconds, long n,
+                       double bytes)
+{
+	bench_report(what, seconds, n);
+	printf("%-40s %10.1f MB/s\n", "  throughput", bytes / seconds / 1e6);
+}
+
+static void build(struct outbuf *o, int argc, const char **argv)
+{
+	uint32_t id;
+
+	outbuf_init(o, NULL, 0);
+	for (id = 1; id <= FRAMES; id++)
+		proto_put_request(o, &id, NULL, argc, argv);
+	if (o->error) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+}
+
+/* Parse every frame in buf, returning how many there were */
+static long parse_all(const char *buf, size_t len)
+{
+	const char *argv[QCONTROL_MAX_ARGS];
+	struct proto_frame f;
+	size_t off = 0;
+	uint32_t argc;
+	long n = 0;
+	int used;
+
+	while ((used = proto_parse_frame(buf + off, len - off, &f)) > 0) {
+		if (proto_parse_args(f.payload, f.len, &argc, argv,
+		                     QCONTROL_MAX_ARGS) <= 0)
+			return -1;
+		off += used;
+		n++;
+	}
+	return used < 0 ? -1 : n;
+}
+
+static void memory(const char *what, int argc, const char **argv)
+{
+	struct outbuf o;
+	double start;
+	long n = 0;
+	int i;
+
+	build(&o, argc, argv);
+	start = bench_now();
+	for (i = 0; i < PASSES; i++)
+		n += parse_all(o.data, o.len);
+	throughput(what, bench_now() - start, n, o.len * (double)PASSES);
+	outbuf_reset(&o);
+}
+
+static void *writer(void *arg)
+{
+	struct stream *s = arg;
+	size_t off, len;
+	int i;
+
+	for (i = 0; i < PASSES; i++) {
+		for (off = 0; off < s->out.len; off += len) {
+			len = s->out.len - off < CHUNK ? s->out.len - off :
+			      CHUNK;
+			if (write(s->fd, s->out.data + off, len) !=
+			    (ssize_t)len)
+				return NULL;
+		}
+	}
+	close(s->fd);
+	return NULL;
+}
+
+static void streamed(const char *what, int argc, const char **argv)
+{
+	const char *args[QCONTROL_MAX_ARGS];
+	char storage[1024];
+	struct proto_frame f;
+	struct stream s;
+	struct msgbuf in;
+	pthread_t thread;
+	uint32_t nargs;
+	double start;
+	long n = 0;
+	int fds[2], used;
+
+	build(&s.out, argc, argv);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		exit(1);
+	s.fd = fds[1];
+	msgbuf_init(&in, QCONTROL_MAX_MESSAGE, storage, sizeof(storage));
+
+	start = bench_now();
+	pthread_create(&thread, NULL, writer, &s);
+	while (msgbuf_read(&in, fds[0]) > 0) {
+		while ((used = proto_parse_frame(in.data + in.start,
+		                                 in.end - in.start, &f)) > 0) {
+			if (proto_parse_args(f.payload, f.len, &nargs, args,
+			                     QCONTROL_MAX_ARGS) <= 0)
+				exit(1);
+			in.start += used;
+			n++;
+		}
+		if (used < 0)
+			exit(1);
+	}
+	pthread_join(thread, NULL);
+	if (n != (long)FRAMES * PASSES) {
+		fprintf(stderr, "%s: got %ld frames\n", what, n);
+		exit(1);
+	}
+	throughput(what, bench_now() - start, n,
+	           s.out.len * (double)PASSES);
+	close(fds[0]);
+	msgbuf_free(&in);
+	outbuf_reset(&s.out);
+}
+
+int main(void)
+{
+	const char *small[] = { "statusled", "greenon" };
+	const char *large[QCONTROL_MAX_ARGS];
+	int i;
+
+	for (i = 0; i < QCONTROL_MAX_ARGS; i++)
+		large[i] = "argument-of-32-characters-long.";
+
+	memory("parse, 2 arguments", 2, small);
+	memory("parse, 64 arguments", QCONTROL_MAX_ARGS, large);
+	streamed("read and parse, 2 arguments", 2, small);
+	streamed("read and parse, 64 arguments", QCONTROL_MAX_ARGS, large);
+	return 0;
+}
@@ -24,7 +24,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/signal.h>
 #include <syslog.h>
 #include <termios.h>
 #include <unistd.h>
@@ -34,7 +33,7 @@
 
 struct event_listen {
 	int code;
-	char *command;
+	int handler;
 	time_t pressed;
 };
 static struct event_listen **events;
@@ -47,7 +46,10 @@ static int evdev_event(void)
 	char buf[100];
 	int err, i, down;
 
+	/* evdev_exit() stops the thread while it is blocked in read() */
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	err = read(event, buf, 100);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	if (err < 0)
 		return err;
 
@@ -59,7 +61,7 @@ static int evdev_event(void)
 				events[i]->pressed = time(NULL);
 			} else {
 				down = time(NULL) - events[i]->pressed;
-				call_function(events[i]->command, "%d", down);
+				call_handler(events[i]->handler, down);
 			}
 			break;
 		}
@@ -73,6 +75,7 @@ static int evdev_event(void)
 
 static void *evdev_poll(void *tmp UNUSED)
 {
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	for (;;)
 		evdev_event();
 
@@ -94,29 +97,34 @@ static int evdev_init(int argc, const char **argv)
 	for (i = 1; i < argc; i += 2) {
 		el = malloc(sizeof(struct event_listen));
 		el->code = atoi(argv[i]);
-		el->command = malloc(strlen(argv[i+1]) + 1);
-		strncpy(el->command, argv[i+1], strlen(argv[i+1]) + 1);
+		el->handler = register_handler(argv[i+1], "%d");
 		events[(i-1)/2] = el;
+		if (el->handler < 0)
+			goto err;
 	}
 
 	event = open(argv[0], 0);
 	if (event < 0) {
 		print_log(LOG_ERR, "evdev: Error opening %s: %s",
 		       argv[0], strerror(errno));
-		for (i = 0; events[i]; ++i)
-			free(events[i]);
-		free(events);
-		return -1;
+		goto err;
 	}
 
 	return pthread_create(&evdev_thread, NULL, evdev_poll, NULL);
+
+err:
+	for (i = 0; events[i]; ++i)
+		free(events[i]);
+	free(events);
+	return -1;
 }
 
 static void evdev_exit(void)
 {
 	int i;
 
-	pthread_kill(evdev_thread, SIGINT);
+	pthread_cancel(evdev_thread);
+	pthread_join(evdev_thread, NULL);
 	close(event);
 
 	for (i = 0; events[i]; ++i)
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "picmodule.h"
+#include "events.h"
+
+/*
+ * Subscribers are only touched by the main loop, which takes events off
+ * the queue before publishing them.
+ */
+static struct subscriber *subscribers;
+static int efd = -1;
+
+/*
+ * Bounded multi-producer queue after Dmitry Vyukov. A slot whose seq equals
+ * the position being posted is free, seq == position + 1 marks it filled.
+ * Producers claim a position by advancing head, only the main loop moves
+ * tail.
+ */
+static struct event_slot queue[EVENT_QUEUE];
+static unsigned int queue_head;
+static unsigned int queue_tail;
+static uint32_t queue_overflows;	/* Posts which found the queue full */
+
+int events_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < EVENT_QUEUE; ++i)
+		queue[i].seq = i;
+
+	efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (efd < 0) {
+		print_log(LOG_ERR, "Error creating event notifier: %s",
+		          strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * File descriptor which becomes readable when events have been posted or
+ * subscribers have new events.
+ */
+int events_fd(void)
+{
+	return efd;
+}
+
+/**
+ * Acknowledge a wakeup from events_fd().
+ */
+void events_clear(void)
+{
+	uint64_t count;
+
+	if (read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		print_log(LOG_ERR, "Error reading event notifier: %s",
+		          strerror(errno));
+}
+
+struct subscriber *events_subscribe(void)
+{
+	struct subscriber *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return NULL;
+
+	s->next = subscribers;
+	/* Published whole, so an unlocked check of the list never sees a
+	   half linked subscriber */
+	__atomic_store_n(&subscribers, s, __ATOMIC_RELEASE);
+
+	return s;
+}
+
+void events_unsubscribe(struct subscriber *s)
+{
+	struct subscriber **p;
+
+	for (p = &subscribers; *p; p = &(*p)->next) {
+		if (*p == s) {
+			__atomic_store_n(p, s->next, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+
+	free(s);
+}
+
+static void events_signal(void)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		print_log(LOG_ERR, "Error signalling event: %s",
+		          strerror(errno));
+}
+
+/**
+ * Fill rec from the arguments of a call_handler(). types holds a 'd' or 's'
+ * for each of them, at most EVENT_MAX_ARGS. Strings are truncated to
+ * EVENT_STR_LEN.
+ */
+void events_record(struct event_record *rec, const char *name,
+                   const char *types, va_list ap)
+{
+	unsigned int i;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->time = time(NULL);
+	snprintf(rec->name, sizeof(rec->name), "%s", name);
+	for (i = 0; types[i]; ++i) {
+		if (types[i] == 'd') {
+			rec->args[i].type = QCONTROL_EVENT_INT;
+			rec->args[i].i = va_arg(ap, int);
+		} else {
+			rec->args[i].type = QCONTROL_EVENT_STRING;
+			snprintf(rec->args[i].s, EVENT_STR_LEN, "%s",
+			         va_arg(ap, char *));
+		}
+	}
+	rec->nargs = i;
+}
+
+/**
+ * Give every subscriber a copy of rec. Main loop only.
+ */
+void events_publish(const struct event_record *rec)
+{
+	struct subscriber *s;
+
+	if (!__atomic_load_n(&subscribers, __ATOMIC_ACQUIRE))
+		return;
+
+	for (s = subscribers; s; s = s->next) {
+		if (s->head - s->tail == SUBSCRIBER_RING) {
+			s->dropped++;
+			continue;
+		}
+		s->ring[s->head++ & (SUBSCRIBER_RING - 1)] = *rec;
+	}
+
+	events_signal();
+}
+
+/**
+ * Queue rec for the main loop, which runs the given handler with it. Safe
+ * from any thread, never blocks. Returns -1 if the queue is full; the event
+ * is then lost.
+ */
+int events_post(int handler, const struct event_record *rec)
+{
+	unsigned int pos, seq;
+	struct event_slot *slot;
+
+	pos = __atomic_load_n(&queue_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &queue[pos & (EVENT_QUEUE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&queue_head, &pos,
+			                                pos + 1, true,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+				break;
+		} else if ((int)(seq - pos) < 0) {
+			/* Still holds the event from a lap ago */
+			__atomic_fetch_add(&queue_overflows, 1,
+			                   __ATOMIC_RELAXED);
+			return -1;
+		} else {
+			pos = __atomic_load_n(&queue_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->handler = handler;
+	slot->rec = *rec;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	events_signal();
+
+	return 0;
+}
+
+/**
+ * Take the oldest posted event. Main loop only. Returns 1 if an event was
+ * returned or 0 if there is none ready.
+ */
+int events_take(int *handler, struct event_record *rec)
+{
+	struct event_slot *slot = &queue[queue_tail & (EVENT_QUEUE - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != queue_tail + 1)
+		return 0;
+
+	*handler = slot->handler;
+	*rec = slot->rec;
+	__atomic_store_n(&slot->seq, queue_tail + EVENT_QUEUE,
+	                 __ATOMIC_RELEASE);
+	queue_tail++;
+
+	return 1;
+}
+
+/**
+ * Number of events lost to a full queue since the previous call.
+ */
+uint32_t events_overflows(void)
+{
+	return __atomic_exchange_n(&queue_overflows, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take the oldest event from a subscriber's ring. *dropped is set to the
+ * number of events lost since the previous one was taken. Returns 1 if an event was returned or 0
+ * if the ring is empty.
+ */
+int events_pop(struct subscriber *s, struct event_record *rec,
+               uint32_t *dropped)
+{
+	if (s->head == s->tail)
+		return 0;
+
+	*rec = s->ring[s->tail++ & (SUBSCRIBER_RING - 1)];
+	*dropped = s->dropped;
+	s->dropped = 0;
+
+	return 1;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "protocol.h"
+
+#define EVENT_NAME_LEN		32
+#define EVENT_STR_LEN		32
+#define EVENT_MAX_ARGS		QCONTROL_EVENT_MAX_ARGS
+#define SUBSCRIBER_RING		16	/* Must be a power of two */
+#define EVENT_QUEUE		64	/* Must be a power of two */
+
+/* An event as handed to a Lua handler, e.g. temp(45) */
+struct event_record {
+	time_t time;
+	char name[EVENT_NAME_LEN];
+	unsigned int nargs;
+	struct {
+		uint32_t type;
+		int32_t i;
+		char s[EVENT_STR_LEN];
+	} args[EVENT_MAX_ARGS];
+};
+
+/*
+ * A subscriber receives a copy of every event in a bounded ring. When the
+ * ring is full new events are dropped and counted rather than waiting for
+ * the subscriber to catch up.
+ */
+struct subscriber {
+	struct event_record ring[SUBSCRIBER_RING];
+	unsigned int head, tail;
+	uint32_t dropped;
+	struct subscriber *next;
+};
+
+/*
+ * Events raised by the serial and evdev threads wait in a bounded queue
+ * for the thread which owns the Lua state. Any number of threads may post
+ * without locking; a post to a full queue fails and is counted.
+ */
+struct event_slot {
+	unsigned int seq;
+	int handler;
+	struct event_record rec;
+};
+
+int events_init(void);
+int events_fd(void);
+void events_clear(void);
+struct subscriber *events_subscribe(void);
+void events_unsubscribe(struct subscriber *s);
+void events_record(struct event_record *rec, const char *name,
+                   const char *types, va_list ap);
+void events_publish(const struct event_record *rec);
+int events_post(int handler, const struct event_record *rec);
+int events_take(int *handler, struct event_record *rec);
+uint32_t events_overflows(void);
+int events_pop(struct subscriber *s, struct event_record *rec,
+               uint32_t *dropped);
+
+#endif
@@ -61,8 +61,19 @@ function restart_button( time )
 	os.execute("reboot")
 end
 
+usbled_timer = nil
+
+-- Blink the usbled for a minute. settimer( ms, fn ) runs fn once,
+-- setinterval( ms, fn ) every ms and canceltimer( id ) stops either.
 function media_button( time )
 	piccmd("usbled", "8hz")
+	if usbled_timer then
+		canceltimer(usbled_timer)
+	end
+	usbled_timer = settimer(60000, function()
+		piccmd("usbled", "off")
+		usbled_timer = nil
+	end)
 end
 
 function lcd_button( state, down, up )
@@ -192,52 +203,23 @@ function logtemp( temp )
 	end
 end
 
-last_fan_setting = nil
-
-function setfan( temp, speed )
-	if ( ( not last_fan_setting ) or
-	     ( last_fan_setting ~= speed ) ) then
-		logprint(string.format("ts41x: temperature %d setting fan to \"%s\"", temp, speed))
-	end
-	piccmd("fanspeed", speed)
-	last_fan_setting = speed
-end
-
 -- hysteresis implementation:
 --    - - > 35 > - - - > 40 > - - - > 50 > - - - > 65 > - - -
 --  silence --    low    --  medium   --   high    -- full  |
 --    - - < 32 < - - - < 35 < - - - < 45 < - - - < 55 < - - -
+-- The fan speed is set by qcontrol itself, fan_level() is only called when
+-- it changes. Without a fancurve temp( temp ) is called for each reading.
+piccmd("fancurve", "silence", "32:35", "low", "35:40", "medium",
+       "45:50", "high", "55:65", "full")
+
+-- Without a fancurve only the temperature is logged
 function temp( temp )
 	logtemp(temp)
-	if last_fan_setting == "full" then
-		if temp < 55 then
-			setfan(temp, "high")
-		end
-	elseif last_fan_setting == "high" then
-		if temp > 65 then
-			setfan(temp, "full")
-		elseif temp < 45 then
-			setfan(temp, "medium")
-		end
-	elseif last_fan_setting == "medium" then
-		if temp > 50 then
-			setfan(temp, "high")
-		elseif temp < 35 then
-			setfan(temp, "low")
-		end
-	elseif last_fan_setting == "low" then
-		if temp > 40 then
-			setfan(temp, "medium")
-		elseif temp < 32 then
-			setfan(temp, "silence")
-		end
-	elseif last_fan_setting == "silence" then
-		if temp > 35 then
-			setfan(temp, "low")
-		end
-	else
-		setfan(temp, "high")
-	end
+end
+
+function fan_level( temp, speed )
+	logtemp(temp)
+	logprint(string.format("ts41x: temperature %d setting fan to \"%s\"", temp, speed))
 end
 
 confdir("/etc/qcontrol.d")
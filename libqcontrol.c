@@ -0,0 +1,825 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "libqcontrol.h"
+#include "protocol.h"
+
+#define QCONTROL_BUF_SIZE	512
+
+/* A request which has not been answered yet */
+struct qcontrol_pending {
+	uint32_t id;
+	bool call;			/* Sent as a CALL */
+	qcontrol_result_cb cb;
+	void *data;
+};
+
+struct qcontrol {
+	int fd;
+	bool hello;			/* The server's hello has arrived */
+	uint32_t version;		/* Protocol version, once hello is set */
+	bool seqpacket;			/* Connected to a SOCK_SEQPACKET socket */
+	uint32_t instance;		/* The daemon's, from a version 4 hello */
+	char *table;			/* COMMANDS payload, kept for saving */
+	size_t table_len;
+	uint32_t table_version;		/* Version of the table's format */
+	uint32_t table_instance;
+	struct proto_command *cmds;	/* Point into table */
+	unsigned int ncmds;
+	unsigned int stale;		/* Times the table turned out stale */
+	int timeout;			/* Milliseconds, 0 to wait forever */
+	uint32_t next_id;
+	struct msgbuf in;
+	struct outbuf out;
+	size_t sent;			/* Bytes of out already sent */
+	struct qcontrol_pending *pending;
+	unsigned int npending, pending_size;
+	qcontrol_event_cb event_cb;
+	void *event_data;
+	uint32_t event_id;
+	char in_storage[QCONTROL_BUF_SIZE];
+	char out_storage[QCONTROL_BUF_SIZE];
+};
+
+/* State of a qcontrol_command() or qcontrol_subscribe() waiting for its
+   result */
+struct qcontrol_sync {
+	bool done;
+	int result;
+	char **message;
+};
+
+/**
+ * Return the CLOCK_MONOTONIC time timeout milliseconds from now.
+ */
+static struct timespec qcontrol_deadline(int timeout)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (long)(timeout % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	return ts;
+}
+
+/**
+ * Milliseconds left until deadline, rounded up, or 0 if it has passed.
+ */
+static int qcontrol_remaining(const struct timespec *deadline)
+{
+	struct timespec now;
+	long long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (long long)(deadline->tv_sec - now.tv_sec) * 1000 +
+	     (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+
+	return ms > 0 ? ms : 0;
+}
+
+/**
+ * Wait until *done is set, for at most the connection's timeout.
+ */
+static int qcontrol_wait_for(struct qcontrol *q, const bool *done)
+{
+	struct timespec deadline = qcontrol_deadline(q->timeout);
+	int err;
+
+	while (!*done) {
+		err = q->timeout ?
+		      qcontrol_wait_timeout(q, qcontrol_remaining(&deadline)) :
+		      qcontrol_wait(q);
+		if (err < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Connect q->fd to path. A blocking AF_UNIX connect() waits for at most the
+ * send timeout for room in the daemon's backlog, while a non-blocking one
+ * would fail straight away.
+ */
+static int qcontrol_open(struct qcontrol *q, const char *path, int type)
+{
+	struct sockaddr_un remote;
+	struct timeval tv;
+	int err;
+
+	if (strlen(path) >= sizeof(remote.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	q->fd = socket(AF_UNIX, type|SOCK_CLOEXEC, 0);
+	if (q->fd < 0)
+		return -1;
+
+	if (q->timeout) {
+		tv.tv_sec = q->timeout / 1000;
+		tv.tv_usec = (q->timeout % 1000) * 1000;
+		if (setsockopt(q->fd, SOL_SOCKET, SO_SNDTIMEO,
+		               &tv, sizeof(tv)) < 0)
+			return -1;
+	}
+
+	remote.sun_family = AF_UNIX;
+	strcpy(remote.sun_path, path);
+	err = connect(q->fd, (struct sockaddr *)&remote, sizeof(remote));
+	if (err < 0 && errno == EAGAIN && q->timeout)
+		errno = ETIMEDOUT;
+	if (err == 0)
+		err = fcntl(q->fd, F_SETFL,
+		            fcntl(q->fd, F_GETFL, 0) | O_NONBLOCK);
+
+	return err;
+}
+
+/**
+ * Connect to the daemon listening on path, or on QCONTROL_SOCKET if path is
+ * NULL. The path may also be a SOCK_SEQPACKET socket such as
+ * QCONTROL_SEQPACKET_SOCKET. Returns NULL on failure.
+ */
+struct qcontrol *qcontrol_connect(const char *path)
+{
+	return qcontrol_connect_timeout(path, 0);
+}
+
+/**
+ * As qcontrol_connect(), but give up with ETIMEDOUT if the daemon has not
+ * answered the hello within timeout milliseconds. The timeout then also
+ * applies to the calls which wait, see qcontrol_set_timeout().
+ */
+struct qcontrol *qcontrol_connect_timeout(const char *path, int timeout)
+{
+	struct qcontrol *q;
+	int err;
+
+	if (!path)
+		path = QCONTROL_SOCKET;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+	msgbuf_init(&q->in, QCONTROL_MAX_MESSAGE, q->in_storage,
+	            sizeof(q->in_storage));
+	outbuf_init(&q->out, q->out_storage, sizeof(q->out_storage));
+	q->fd = -1;
+	q->next_id = 1;
+	q->timeout = timeout > 0 ? timeout : 0;
+
+	err = qcontrol_open(q, path, SOCK_STREAM);
+	if (err < 0 && errno == EPROTOTYPE) {
+		close(q->fd);
+		q->seqpacket = true;
+		err = qcontrol_open(q, path, SOCK_SEQPACKET);
+	}
+	if (err < 0)
+		goto err;
+
+	outbuf_put_u32(&q->out, QCONTROL_PROTO_MAGIC);
+	outbuf_put_u32(&q->out, QCONTROL_PROTO_VERSION);
+
+	/* Wait for the hello, both to know the daemon is alive and whether
+	   it understands deadlines */
+	if (q->timeout && qcontrol_wait_for(q, &q->hello) < 0)
+		goto err;
+
+	return q;
+
+err:
+	err = errno;
+	qcontrol_close(q);
+	errno = err;
+	return NULL;
+}
+
+void qcontrol_close(struct qcontrol *q)
+{
+	if (!q)
+		return;
+	if (q->fd >= 0)
+		close(q->fd);
+	msgbuf_free(&q->in);
+	outbuf_reset(&q->out);
+	free(q->pending);
+	free(q->cmds);
+	free(q->table);
+	free(q);
+}
+
+/**
+ * Set the timeout in milliseconds of qcontrol_command() and
+ * qcontrol_subscribe(), 0 to wait forever. Commands submitted with a
+ * timeout carry a deadline, the daemon answers those it could not start
+ * in time with -ETIMEDOUT instead of running them.
+ */
+void qcontrol_set_timeout(struct qcontrol *q, int timeout)
+{
+	q->timeout = timeout > 0 ? timeout : 0;
+}
+
+int qcontrol_fd(struct qcontrol *q)
+{
+	return q->fd;
+}
+
+/**
+ * The poll() events to wait for before calling qcontrol_process().
+ */
+short qcontrol_poll_events(struct qcontrol *q)
+{
+	return q->sent < q->out.len ? POLLIN|POLLOUT : POLLIN;
+}
+
+static int qcontrol_flush(struct qcontrol *q)
+{
+	size_t len;
+	ssize_t n;
+
+	if (q->out.error) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	while (q->sent < q->out.len) {
+		len = q->out.len - q->sent;
+		if (q->seqpacket)
+			len = proto_packet_len(q->out.data + q->sent, len,
+			                       2 * sizeof(uint32_t));
+		n = send(q->fd, q->out.data + q->sent, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n < 0)
+			return -1;
+		q->sent += n;
+	}
+
+	/* Everything went, drop back to the fixed storage */
+	outbuf_reset(&q->out);
+	q->sent = 0;
+
+	return 0;
+}
+
+static int qcontrol_add_pending(struct qcontrol *q, uint32_t id, bool call,
+                                qcontrol_result_cb cb, void *data)
+{
+	struct qcontrol_pending *p;
+	unsigned int size;
+
+	if (q->npending == q->pending_size) {
+		size = q->pending_size ? q->pending_size * 2 : 8;
+		p = realloc(q->pending, size * sizeof(*p));
+		if (!p)
+			return -1;
+		q->pending = p;
+		q->pending_size = size;
+	}
+
+	p = &q->pending[q->npending++];
+	p->id = id;
+	p->call = call;
+	p->cb = cb;
+	p->data = data;
+
+	return 0;
+}
+
+static void qcontrol_drop_table(struct qcontrol *q)
+{
+	free(q->cmds);
+	free(q->table);
+	q->cmds = NULL;
+	q->table = NULL;
+	q->ncmds = 0;
+}
+
+/**
+ * Install a copy of a COMMANDS payload as the command table. version is
+ * that of the connection it was received on.
+ */
+static int qcontrol_set_table(struct qcontrol *q, const char *buf, size_t len,
+                              uint32_t version)
+{
+	struct proto_command *cmds;
+	unsigned int count;
+	uint32_t instance;
+	char *table;
+
+	table = malloc(len);
+	if (!table)
+		return -1;
+	memcpy(table, buf, len);
+	if (proto_parse_commands(table, len, version >= 5, &instance, &cmds,
+	                         &count) < 0) {
+		free(table);
+		errno = EPROTO;
+		return -1;
+	}
+
+	qcontrol_drop_table(q);
+	q->table = table;
+	q->table_len = len;
+	q->table_version = version;
+	q->table_instance = instance;
+	q->cmds = cmds;
+	q->ncmds = count;
+
+	return 0;
+}
+
+/**
+ * Whether commands can be sent as CALLs using the table
+ */
+static bool qcontrol_table_current(struct qcontrol *q)
+{
+	return q->cmds && q->hello && q->version >= 4 &&
+	       q->table_instance == q->instance;
+}
+
+static int qcontrol_find_command(struct qcontrol *q, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < q->ncmds; ++i)
+		if (strcmp(q->cmds[i].name, name) == 0)
+			return i;
+
+	return -1;
+}
+
+/**
+ * Forget the callback of a request which is no longer waited for, its
+ * result is dropped when it arrives.
+ */
+static void qcontrol_abandon(struct qcontrol *q, uint32_t id)
+{
+	unsigned int i;
+
+	for (i = 0; i < q->npending; ++i)
+		if (q->pending[i].id == id)
+			q->pending[i].cb = NULL;
+}
+
+/**
+ * Send a command without waiting for the result, which is passed to cb
+ * (if not NULL) from qcontrol_process(). Returns the id of the request.
+ */
+int qcontrol_submit(struct qcontrol *q, int argc, const char **argv,
+                    qcontrol_result_cb cb, void *data)
+{
+	struct timespec deadline, *dl = NULL;
+	uint32_t id = q->next_id++;
+	int cmd = -1, option = -1;
+
+	if (q->next_id > INT32_MAX)
+		q->next_id = 1;
+	if (argc <= 0 || argc > QCONTROL_MAX_ARGS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (qcontrol_table_current(q))
+		cmd = qcontrol_find_command(q, argv[0]);
+	/* Option commands can do without strings altogether */
+	if (cmd >= 0 && argc == 2 && q->cmds[cmd].noptions)
+		option = proto_find_option(&q->cmds[cmd], argv[1]);
+	if (qcontrol_add_pending(q, id, cmd >= 0, cb, data) < 0)
+		return -1;
+
+	/* Older daemons drop the connection on a deadline */
+	if (q->timeout && q->hello && q->version >= 3) {
+		deadline = qcontrol_deadline(q->timeout);
+		dl = &deadline;
+	}
+	if (option >= 0)
+		proto_put_call_option(&q->out, id, dl, q->instance,
+		                      q->cmds[cmd].id, option);
+	else if (cmd >= 0)
+		proto_put_call(&q->out, id, dl, q->instance, q->cmds[cmd].id,
+		               argc - 1, argv + 1);
+	else
+		proto_put_request(&q->out, &id, dl, argc, argv);
+	if (qcontrol_flush(q) < 0)
+		return -1;
+
+	return id;
+}
+
+static void qcontrol_sync_cb(void *data, int result, const char *message)
+{
+	struct qcontrol_sync *s = data;
+
+	s->done = true;
+	s->result = result;
+	if (s->message)
+		*s->message = message ? strdup(message) : NULL;
+}
+
+/**
+ * Wait for the result of request id, for at most the connection's timeout.
+ */
+static int qcontrol_sync_wait(struct qcontrol *q, struct qcontrol_sync *s,
+                              uint32_t id)
+{
+	if (qcontrol_wait_for(q, &s->done) < 0) {
+		/* s is about to go away */
+		qcontrol_abandon(q, id);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Run a command and wait for the result. If message is not NULL it is set
+ * to a copy of the output or help text, or NULL if there is none; the
+ * caller must free it. Returns 0 once the result is known.
+ */
+int qcontrol_command(struct qcontrol *q, int argc, const char **argv,
+                     int *result, char **message)
+{
+	struct qcontrol_sync s = { .message = message };
+	unsigned int stale = q->stale;
+	int id;
+
+	if (message)
+		*message = NULL;
+	id = qcontrol_submit(q, argc, argv, qcontrol_sync_cb, &s);
+	if (id < 0 || qcontrol_sync_wait(q, &s, id) < 0)
+		return -1;
+
+	/* The table was dropped, try again by name */
+	if (s.result == -ESTALE && q->stale != stale) {
+		s.done = false;
+		id = qcontrol_submit(q, argc, argv, qcontrol_sync_cb, &s);
+		if (id < 0 || qcontrol_sync_wait(q, &s, id) < 0)
+			return -1;
+	}
+	*result = s.result;
+
+	return 0;
+}
+
+/**
+ * Ask for every event in the daemon to be passed to cb, from
+ * qcontrol_process(). Waits for the daemon to accept.
+ */
+int qcontrol_subscribe(struct qcontrol *q, qcontrol_event_cb cb, void *data)
+{
+	struct qcontrol_sync s = { .message = NULL };
+	uint32_t id = q->next_id++;
+	size_t start;
+
+	if (q->next_id > INT32_MAX)
+		q->next_id = 1;
+	if (q->event_cb) {
+		errno = EALREADY;
+		return -1;
+	}
+	if (qcontrol_add_pending(q, id, false, qcontrol_sync_cb, &s) < 0)
+		return -1;
+
+	/* Events may arrive straight after the response, in the same read */
+	q->event_cb = cb;
+	q->event_data = data;
+	q->event_id = id;
+
+	start = proto_frame_begin(&q->out, id, QCONTROL_MSG_SUBSCRIBE);
+	proto_frame_end(&q->out, start);
+	if (qcontrol_flush(q) < 0 || qcontrol_sync_wait(q, &s, id) < 0)
+		goto err;
+	if (s.result < 0) {
+		errno = EPERM;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	q->event_cb = NULL;
+	return -1;
+}
+
+/**
+ * Remove the request answered by f from the pending ones.
+ */
+static int qcontrol_answered(struct qcontrol *q, struct proto_frame *f,
+                             struct qcontrol_pending *p)
+{
+	unsigned int i;
+
+	for (i = 0; i < q->npending; ++i) {
+		if (q->pending[i].id == f->id) {
+			*p = q->pending[i];
+			q->pending[i] = q->pending[--q->npending];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int qcontrol_response(struct qcontrol *q, struct proto_frame *f)
+{
+	struct qcontrol_pending p;
+	const char *message;
+	int32_t result;
+
+	if (proto_parse_result(f->payload, f->len, &result, &message) < 0 ||
+	    qcontrol_answered(q, f, &p) < 0)
+		return -1;
+
+	/* The daemon's commands have changed since the table was fetched */
+	if (p.call && result == -ESTALE && q->cmds) {
+		qcontrol_drop_table(q);
+		q->stale++;
+	}
+	if (p.cb)
+		p.cb(p.data, result, message);
+
+	return 0;
+}
+
+static int qcontrol_commands(struct qcontrol *q, struct proto_frame *f)
+{
+	struct qcontrol_pending p;
+
+	if (qcontrol_answered(q, f, &p) < 0 ||
+	    qcontrol_set_table(q, f->payload, f->len, q->version) < 0)
+		return -1;
+	if (p.cb)
+		p.cb(p.data, 0, NULL);
+
+	return 0;
+}
+
+/**
+ * Make sure the command table matches the daemon, fetching it if needed,
+ * so that commands are sent as compact CALLs. Returns 1 if the table was
+ * fetched, 0 if it was already current.
+ */
+int qcontrol_sync_commands(struct qcontrol *q)
+{
+	struct qcontrol_sync s = { .message = NULL };
+	uint32_t id;
+	size_t start;
+
+	if (qcontrol_flush(q) < 0 || qcontrol_wait_for(q, &q->hello) < 0)
+		return -1;
+	if (qcontrol_table_current(q))
+		return 0;
+	if (q->version < 4) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	id = q->next_id++;
+	if (q->next_id > INT32_MAX)
+		q->next_id = 1;
+	if (qcontrol_add_pending(q, id, false, qcontrol_sync_cb, &s) < 0)
+		return -1;
+	start = proto_frame_begin(&q->out, id, QCONTROL_MSG_COMMANDS);
+	proto_frame_end(&q->out, start);
+	if (qcontrol_flush(q) < 0 || qcontrol_sync_wait(q, &s, id) < 0)
+		return -1;
+
+	return 1;
+}
+
+/**
+ * Use the command table saved by qcontrol_save_commands(). It is only used
+ * if it is still current once the daemon's hello has arrived.
+ */
+int qcontrol_load_commands(struct qcontrol *q, const char *path)
+{
+	const size_t size = sizeof(uint32_t) + QCONTROL_MAX_MESSAGE;
+	uint32_t version;
+	size_t len;
+	char *buf;
+	FILE *f;
+	int err = -1;
+
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+	buf = malloc(size);
+	if (buf) {
+		len = fread(buf, 1, size, f);
+		/* The table is saved after the version of its format */
+		version = len >= sizeof(uint32_t) ? proto_get_u32(buf) : 0;
+		if (ferror(f))
+			;
+		else if (version < 4 || version > QCONTROL_PROTO_VERSION)
+			errno = EPROTO;
+		else
+			err = qcontrol_set_table(q, buf + sizeof(uint32_t),
+			                         len - sizeof(uint32_t), version);
+		free(buf);
+	}
+	fclose(f);
+
+	return err;
+}
+
+/**
+ * Save the command table for later connections to the same daemon.
+ */
+int qcontrol_save_commands(struct qcontrol *q, const char *path)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+	int err;
+
+	if (!q->table) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid())
+	    >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	/* Readers only ever see a complete table */
+	f = fopen(tmp, "we");
+	if (!f)
+		return -1;
+	err = fwrite(&q->table_version, sizeof(q->table_version), 1, f) == 1 &&
+	      fwrite(q->table, 1, q->table_len, f) == q->table_len ? 0 : -1;
+	if (fclose(f) != 0)
+		err = -1;
+	if (err == 0)
+		err = rename(tmp, path);
+	if (err < 0)
+		unlink(tmp);
+
+	return err;
+}
+
+/**
+ * Decode and dispatch everything which has been received. Returns -1 if
+ * the daemon sent something malformed.
+ */
+static int qcontrol_dispatch(struct qcontrol *q)
+{
+	struct qcontrol_event ev;
+	struct proto_frame frame;
+	const char *p;
+	size_t avail;
+	int used;
+
+	for (;;) {
+		p = q->in.data + q->in.start;
+		avail = q->in.end - q->in.start;
+
+		if (!q->hello) {
+			if (avail < 2 * sizeof(uint32_t))
+				return 0;
+			q->version = proto_get_u32(p + sizeof(uint32_t));
+			if (proto_get_u32(p) != QCONTROL_PROTO_MAGIC ||
+			    q->version < 2)
+				return -1;
+			used = 2 * sizeof(uint32_t);
+			if (q->version >= 4) {
+				if (avail < 3 * sizeof(uint32_t))
+					return 0;
+				q->instance = proto_get_u32(p + used);
+				used += sizeof(uint32_t);
+			}
+			q->in.start += used;
+			q->hello = true;
+			continue;
+		}
+
+		used = proto_parse_frame(p, avail, &frame);
+		if (used == 0)
+			return 0;
+		if (used < 0)
+			return -1;
+
+		switch (frame.type) {
+		case QCONTROL_MSG_RESPONSE:
+			if (qcontrol_response(q, &frame) < 0)
+				return -1;
+			break;
+		case QCONTROL_MSG_COMMANDS:
+			if (qcontrol_commands(q, &frame) < 0)
+				return -1;
+			break;
+		case QCONTROL_MSG_EVENT:
+			if (!q->event_cb || frame.id != q->event_id ||
+			    proto_parse_event(frame.payload, frame.len,
+			                      &ev) < 0)
+				return -1;
+			q->event_cb(q->event_data, &ev);
+			break;
+		default:
+			return -1;
+		}
+		q->in.start += used;
+	}
+}
+
+/**
+ * Send and receive whatever can be without blocking, calling the callbacks
+ * of any results and events which arrived.
+ */
+int qcontrol_process(struct qcontrol *q)
+{
+	ssize_t n;
+
+	if (qcontrol_flush(q) < 0)
+		return -1;
+
+	for (;;) {
+		if (q->seqpacket)
+			n = msgbuf_recv(&q->in, q->fd);
+		else
+			n = msgbuf_read(&q->in, q->fd);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+
+		errno = EPROTO;
+		if (qcontrol_dispatch(q) < 0)
+			return -1;
+		/* Messages never span packets */
+		if (q->seqpacket && q->in.start != q->in.end)
+			return -1;
+	}
+}
+
+/**
+ * Block until the connection is ready and then call qcontrol_process().
+ */
+int qcontrol_wait(struct qcontrol *q)
+{
+	return qcontrol_wait_timeout(q, -1);
+}
+
+/**
+ * As qcontrol_wait(), but fail with ETIMEDOUT if the connection does not
+ * become ready within timeout milliseconds (-1 for no limit).
+ */
+int qcontrol_wait_timeout(struct qcontrol *q, int timeout)
+{
+	struct pollfd pfd = {
+		.fd = q->fd,
+		.events = qcontrol_poll_events(q),
+	};
+	int n;
+
+	n = poll(&pfd, 1, timeout);
+	if (n < 0 && errno != EINTR)
+		return -1;
+	if (n == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return qcontrol_process(q);
+}
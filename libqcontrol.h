@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBQCONTROL_H
+#define LIBQCONTROL_H
+
+/*
+ * Client library for the qcontrol daemon.
+ *
+ * A connection is opened once and can then carry any number of commands.
+ * qcontrol_command() runs a command and waits for its result. Programs
+ * with their own event loop instead use qcontrol_submit() and poll
+ * qcontrol_fd() for qcontrol_poll_events(), calling qcontrol_process()
+ * whenever it is ready; results are passed to the callback given to
+ * qcontrol_submit().
+ *
+ * Callbacks may submit further commands but must not wait, that is call
+ * qcontrol_command(), qcontrol_subscribe() or qcontrol_wait(), nor close
+ * the connection.
+ *
+ * A connection opened with qcontrol_connect_timeout() (or given a timeout
+ * with qcontrol_set_timeout()) gives up waiting after the timeout with
+ * ETIMEDOUT, so a wedged daemon cannot hang the caller. Each command then
+ * also carries a deadline; the daemon answers a command it only gets to
+ * after its deadline with the result -ETIMEDOUT instead of running it.
+ *
+ * Commands are sent by name unless the connection has the daemon's command
+ * table, from qcontrol_sync_commands() or a copy saved earlier with
+ * qcontrol_save_commands() and loaded again with qcontrol_load_commands().
+ * They are then sent as the compact number the daemon dispatches on, and
+ * the argument of a command with a fixed set of options as the number of
+ * the option. A table from another daemon instance is simply not used.
+ *
+ * Functions returning int return -1 and set errno on failure. EPROTO means
+ * the daemon sent something which could not be understood, ECONNRESET
+ * that it closed the connection. The connection should be closed after
+ * either.
+ */
+
+#include <stdint.h>
+
+#define QCONTROL_SOCKET		"/var/run/qcontrol.sock"
+#define QCONTROL_SEQPACKET_SOCKET	"/var/run/qcontrol-seqpacket.sock"
+
+/* Event argument types */
+enum {
+	QCONTROL_EVENT_INT	= 1,
+	QCONTROL_EVENT_STRING	= 2,
+};
+#define QCONTROL_EVENT_MAX_ARGS	4
+
+/* A call of a Lua handler in the daemon, e.g. temp(45) */
+struct qcontrol_event {
+	uint32_t dropped;	/* Events lost before this one */
+	uint32_t time;		/* Seconds since the epoch */
+	const char *name;
+	unsigned int nargs;
+	struct {
+		uint32_t type;
+		int32_t i;
+		const char *s;
+	} args[QCONTROL_EVENT_MAX_ARGS];
+};
+
+struct qcontrol;
+
+/*
+ * Called with the result of a command. message is the output of the
+ * command, or its help if it failed, and is only valid during the call.
+ */
+typedef void (*qcontrol_result_cb)(void *data, int result,
+                                   const char *message);
+typedef void (*qcontrol_event_cb)(void *data,
+                                  const struct qcontrol_event *ev);
+
+struct qcontrol *qcontrol_connect(const char *path);
+struct qcontrol *qcontrol_connect_timeout(const char *path, int timeout);
+void qcontrol_set_timeout(struct qcontrol *q, int timeout);
+void qcontrol_close(struct qcontrol *q);
+
+int qcontrol_command(struct qcontrol *q, int argc, const char **argv,
+                     int *result, char **message);
+int qcontrol_submit(struct qcontrol *q, int argc, const char **argv,
+                    qcontrol_result_cb cb, void *data);
+int qcontrol_subscribe(struct qcontrol *q, qcontrol_event_cb cb, void *data);
+
+int qcontrol_sync_commands(struct qcontrol *q);
+int qcontrol_load_commands(struct qcontrol *q, const char *path);
+int qcontrol_save_commands(struct qcontrol *q, const char *path);
+
+int qcontrol_fd(struct qcontrol *q);
+short qcontrol_poll_events(struct qcontrol *q);
+int qcontrol_process(struct qcontrol *q);
+int qcontrol_wait(struct qcontrol *q);
+int qcontrol_wait_timeout(struct qcontrol *q, int timeout);
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "picmodule.h"
+#include "loop.h"
+
+#define LOOP_MAX_EVENTS	16
+
+static int epfd = -1;
+static bool running;
+static bool (*idle)(void);
+static bool idle_work;		/* idle has not yet returned false */
+
+/* Events returned by the current epoll_wait() which are yet to be handled */
+static struct epoll_event pending[LOOP_MAX_EVENTS];
+static int npending;
+
+int loop_init(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		print_log(LOG_ERR, "Error creating event loop: %s",
+		          strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int loop_add(struct loop_watch *w)
+{
+	struct epoll_event ev = {
+		.events = w->events,
+		.data.ptr = w,
+	};
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0) {
+		print_log(LOG_ERR, "Error adding fd %d to event loop: %s",
+		          w->fd, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int loop_modify(struct loop_watch *w, uint32_t events)
+{
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = w,
+	};
+
+	if (w->events == events)
+		return 0;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, w->fd, &ev) < 0) {
+		print_log(LOG_ERR, "Error modifying fd %d in event loop: %s",
+		          w->fd, strerror(errno));
+		return -1;
+	}
+	w->events = events;
+
+	return 0;
+}
+
+/**
+ * Stop watching a file descriptor. The watch may be freed as soon as this
+ * returns, even from within a callback.
+ */
+void loop_del(struct loop_watch *w)
+{
+	int i;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+
+	/* Forget any events for this watch which are still to be handled */
+	for (i = 0; i < npending; ++i)
+		if (pending[i].data.ptr == w)
+			pending[i].data.ptr = NULL;
+}
+
+/**
+ * Call cb whenever there are no events to handle, until it returns false
+ * to say it has nothing more to do. It is called again after the next
+ * events have been handled.
+ */
+void loop_idle(bool (*cb)(void))
+{
+	idle = cb;
+	idle_work = cb != NULL;
+}
+
+int loop_run(void)
+{
+	struct loop_watch *w;
+	int i;
+
+	running = true;
+	while (running) {
+		npending = epoll_wait(epfd, pending, LOOP_MAX_EVENTS,
+		                      idle_work ? 0 : -1);
+		if (npending < 0) {
+			npending = 0;
+			if (errno == EINTR)
+				continue;
+			print_log(LOG_ERR, "Error waiting for events: %s",
+			          strerror(errno));
+			return -1;
+		}
+		if (npending == 0 && idle_work) {
+			idle_work = idle();
+			continue;
+		}
+
+		for (i = 0; i < npending; ++i) {
+			w = pending[i].data.ptr;
+			if (w)
+				w->cb(w, pending[i].events);
+		}
+		npending = 0;
+		idle_work = idle != NULL;
+	}
+
+	return 0;
+}
+
+void loop_exit(void)
+{
+	running = false;
+}
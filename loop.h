@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/*
+ * A file descriptor watched by the daemon's event loop. The callback is
+ * invoked from the loop with the epoll events which fired.
+ */
+struct loop_watch {
+	int fd;
+	uint32_t events;
+	void (*cb)(struct loop_watch *w, uint32_t revents);
+};
+
+int loop_init(void);
+int loop_add(struct loop_watch *w);
+int loop_modify(struct loop_watch *w, uint32_t events);
+void loop_del(struct loop_watch *w);
+void loop_idle(bool (*cb)(void));
+int loop_run(void);
+void loop_exit(void);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <lauxlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "picmodule.h"
+#include "luacache.h"
+
+/*
+ * Cache of compiled config files. LUACACHE_DIR holds a file for each
+ * config file, named after its path with '/' replaced by '!'. It starts
+ * with a header identifying the source by device, inode, size and mtime,
+ * followed by the source's path and the chunk written by lua_dump(). An
+ * entry which doesn't match its source, or which Lua refuses, is rebuilt
+ * from the source.
+ *
+ * Lua runs precompiled chunks without checking them, so entries are only
+ * used when they belong to us and nobody else can write them.
+ */
+
+#ifdef HAVE_LUAJIT
+#define CACHE_MAGIC	"qcLJ\x01\0\0"
+#else
+#define CACHE_MAGIC	"qcL51\x01\0"
+#endif
+
+struct cache_header {
+	char magic[8];
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t path_len;	/* Including the NUL */
+	uint32_t chunk_len;
+};
+
+struct cache_writer {
+	int fd;
+	uint32_t len;
+};
+
+static bool cache_disabled;
+
+static char *cache_name(const char *path)
+{
+	char *name = malloc(sizeof(LUACACHE_DIR "/") + strlen(path));
+	char *p;
+
+	if (!name)
+		return NULL;
+	p = name + sprintf(name, "%s/", LUACACHE_DIR);
+	for (; *path; path++)
+		*p++ = *path == '/' ? '!' : *path;
+	*p = '\0';
+	return name;
+}
+
+/* Pushes the cached chunk, returns false if there is none or it's stale */
+static bool cache_load(lua_State *L, const char *name, const char *path,
+		       const struct cache_header *want)
+{
+	const struct cache_header *h;
+	const char *map;
+	struct stat st;
+	bool ok = false;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+	    (size_t)st.st_size < sizeof(*h) + want->path_len) {
+		close(fd);
+		return false;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	h = (const struct cache_header *)map;
+	if (!memcmp(h, want, offsetof(struct cache_header, chunk_len)) &&
+	    h->chunk_len == st.st_size - sizeof(*h) - want->path_len &&
+	    !memcmp(map + sizeof(*h), path, want->path_len)) {
+		ok = luaL_loadbuffer(L, map + sizeof(*h) + want->path_len,
+				     h->chunk_len, path) == 0;
+		if (!ok)
+			lua_pop(L, 1);
+	}
+	munmap((void *)map, st.st_size);
+	return ok;
+}
+
+static int cache_write(lua_State *L UNUSED, const void *p, size_t sz,
+		       void *ud)
+{
+	struct cache_writer *w = ud;
+
+	if (write(w->fd, p, sz) != (ssize_t)sz)
+		return 1;
+	w->len += sz;
+	return 0;
+}
+
+/* Writes the chunk on top of the stack to the cache, the entry is replaced
+   in one go so a reader never sees half of it */
+static int cache_store(lua_State *L, const char *name, const char *path,
+		       struct cache_header *h)
+{
+	struct cache_writer w = { -1, 0 };
+	char *tmp;
+	int err;
+
+	if (mkdir(LUACACHE_DIR, 0700) < 0 && errno != EEXIST)
+		return -1;
+	tmp = malloc(strlen(name) + sizeof(".XXXXXX"));
+	if (!tmp)
+		return -1;
+	sprintf(tmp, "%s.XXXXXX", name);
+	w.fd = mkstemp(tmp);
+	if (w.fd < 0) {
+		free(tmp);
+		return -1;
+	}
+
+	if (write(w.fd, h, sizeof(*h)) != sizeof(*h) ||
+	    write(w.fd, path, h->path_len) != (ssize_t)h->path_len ||
+	    lua_dump(L, cache_write, &w) != 0)
+		goto err;
+	h->chunk_len = w.len;
+	if (pwrite(w.fd, h, sizeof(*h), 0) != sizeof(*h))
+		goto err;
+	if (close(w.fd) < 0) {
+		w.fd = -1;
+		goto err;
+	}
+	w.fd = -1;
+	if (rename(tmp, name) < 0)
+		goto err;
+	free(tmp);
+	return 0;
+
+err:
+	err = errno;
+	if (w.fd >= 0)
+		close(w.fd);
+	unlink(tmp);
+	free(tmp);
+	errno = err;
+	return -1;
+}
+
+int luacache_loadfile(lua_State *L, const char *path)
+{
+	struct cache_header h;
+	struct stat st;
+	char *name;
+	int err;
+
+	if (cache_disabled || stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		return luaL_loadfile(L, path);
+	name = cache_name(path);
+	if (!name)
+		return luaL_loadfile(L, path);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+	h.dev = st.st_dev;
+	h.ino = st.st_ino;
+	h.size = st.st_size;
+	h.mtime_sec = st.st_mtim.tv_sec;
+	h.mtime_nsec = st.st_mtim.tv_nsec;
+	h.path_len = strlen(path) + 1;
+
+	if (cache_load(L, name, path, &h)) {
+		free(name);
+		return 0;
+	}
+
+	err = luaL_loadfile(L, path);
+	if (err == 0 && cache_store(L, name, path, &h) < 0) {
+		/* Not being allowed to cache is fine, e.g. for --direct as a
+		   user, don't try again for every file */
+		if (errno != EACCES && errno != EPERM && errno != EROFS)
+			print_log(LOG_WARNING, "Can't cache %s in %s: %s",
+				  path, LUACACHE_DIR, strerror(errno));
+		cache_disabled = true;
+	}
+	free(name);
+	return err;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LUACACHE_H
+#define LUACACHE_H
+
+#include <lua.h>
+
+#define LUACACHE_DIR	"/var/cache/qcontrol"
+
+/* As luaL_loadfile(), but takes the compiled chunk from LUACACHE_DIR when
+   the file hasn't changed since it was cached, and caches it otherwise */
+int luacache_loadfile(lua_State *L, const char *path);
+
+#define luacache_dofile(L, path) \
+	(luacache_loadfile(L, path) || lua_pcall(L, 0, LUA_MULTRET, 0))
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "picmodule.h"
+#include "luamem.h"
+
+#define NCLASSES	(LUAMEM_SMALL_MAX / LUAMEM_CLASS)
+
+/*
+ * Allocator for the daemon's Lua state. Lua churns through strings,
+ * tables and closures of a few dozen bytes, so blocks of up to
+ * LUAMEM_SMALL_MAX bytes are rounded up to a multiple of LUAMEM_CLASS and
+ * kept on a free list per size once Lua is done with them. Pool memory is
+ * carved from chunks and never returned to malloc(). Lua tells the
+ * allocator the size of every block it frees or resizes, so blocks need no
+ * header.
+ *
+ * Only the thread owning the Lua state allocates, so nothing is locked.
+ */
+
+struct block {
+	struct block *next;
+};
+
+static struct block *pools[NCLASSES];
+static char *chunk;
+static size_t chunk_left;
+static struct luamem_stats stats;
+
+static bool is_small(size_t size)
+{
+	return size <= LUAMEM_SMALL_MAX;
+}
+
+static unsigned int size_class(size_t size)
+{
+	return (size - 1) / LUAMEM_CLASS;
+}
+
+static void pool_put(unsigned int c, void *p)
+{
+	struct block *b = p;
+
+	b->next = pools[c];
+	pools[c] = b;
+}
+
+static void *pool_get(unsigned int c)
+{
+	size_t size = (c + 1) * LUAMEM_CLASS;
+	struct block *b = pools[c];
+
+	if (b) {
+		pools[c] = b->next;
+		return b;
+	}
+
+	if (chunk_left < size) {
+		/* Hand what is left of the chunk to a smaller size */
+		if (chunk_left)
+			pool_put(size_class(chunk_left), chunk);
+		chunk = malloc(LUAMEM_CHUNK);
+		chunk_left = chunk ? LUAMEM_CHUNK : 0;
+		if (!chunk)
+			return NULL;
+		stats.pooled += LUAMEM_CHUNK;
+	}
+	b = (struct block *)chunk;
+	chunk += size;
+	chunk_left -= size;
+
+	return b;
+}
+
+static void *block_alloc(size_t size)
+{
+	if (!is_small(size))
+		return malloc(size);
+
+	stats.pool_allocs++;
+	return pool_get(size_class(size));
+}
+
+static void block_free(void *p, size_t size)
+{
+	if (is_small(size))
+		pool_put(size_class(size), p);
+	else
+		free(p);
+}
+
+/**
+ * lua_Alloc for lua_newstate().
+ */
+void *luamem_alloc(void *ud UNUSED, void *ptr, size_t osize, size_t nsize)
+{
+	void *p;
+
+	/* Lua 5.2 and later pass the type of a new object in osize */
+	if (!ptr)
+		osize = 0;
+
+	if (nsize == 0) {
+		if (ptr) {
+			block_free(ptr, osize);
+			stats.frees++;
+		}
+		stats.bytes -= osize;
+		return NULL;
+	}
+
+	if (ptr && is_small(osize) && is_small(nsize) &&
+	    size_class(osize) == size_class(nsize)) {
+		p = ptr;
+	} else if (ptr && !is_small(osize) && !is_small(nsize)) {
+		p = realloc(ptr, nsize);
+	} else {
+		p = block_alloc(nsize);
+		if (p)
+			stats.allocs++;
+		if (p && ptr) {
+			memcpy(p, ptr, osize < nsize ? osize : nsize);
+			block_free(ptr, osize);
+			stats.frees++;
+		}
+	}
+
+	if (!p) {
+		/* Lua relies on shrinking never failing. The old block is
+		   at least as large as any block of the new size, so it can
+		   be pooled as one once it is freed */
+		if (ptr && nsize <= osize)
+			p = ptr;
+		else
+			return NULL;
+	}
+
+	stats.bytes += nsize - osize;
+	if (stats.bytes > stats.peak)
+		stats.peak = stats.bytes;
+
+	return p;
+}
+
+void luamem_stats(struct luamem_stats *dst)
+{
+	*dst = stats;
+}
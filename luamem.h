@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LUAMEM_H
+#define LUAMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LUAMEM_CLASS		16	/* Granularity of the pooled sizes */
+#define LUAMEM_SMALL_MAX	256	/* Larger blocks come from malloc() */
+#define LUAMEM_CHUNK		16384	/* Pools grow by this much at a time */
+
+struct luamem_stats {
+	size_t bytes;		/* In use by Lua */
+	size_t peak;		/* Highest value of bytes */
+	size_t pooled;		/* Taken from malloc() for the pools */
+	uint64_t allocs;	/* Blocks handed out, a move counts as one */
+	uint64_t frees;		/* Blocks given back */
+	uint64_t pool_allocs;	/* Of allocs, those of pooled sizes */
+};
+
+void *luamem_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+void luamem_stats(struct luamem_stats *stats);
+
+#endif
@@ -24,6 +24,13 @@ struct picmodule {
 	void (*exit)(void);
 };
 
+/* One value a command takes and the code the device knows it by. Tables
+   of options end with an entry whose name is NULL */
+struct picoption {
+	const char *name;
+	unsigned char code;
+};
+
 int print_log(int priority, const char *format, ...)
 #ifdef __GNUC__
 __attribute__ ((format (printf, 2, 3)))
@@ -32,7 +39,22 @@ __attribute__ ((format (printf, 2, 3)))
 int get_args(int *argc, const char ***argv);
 int register_command(const char *cmd, const char *shorthelp, const char *help,
                      int (*call)(int argc, const char **argv));
-int call_function(const char *fname, const char *fmt, ...);
+int register_local_command(const char *cmd, const char *shorthelp,
+                           const char *help,
+                           int (*call)(int argc, const char **argv));
+int register_option_command(const char *cmd, const char *shorthelp,
+                            const char *help,
+                            const struct picoption *options,
+                            int (*call)(const struct picoption *option));
+int register_handler(const char *fname, const char *fmt);
+int call_handler(int handler, ...);
+int record_handler(int handler, ...);
+int queue_command(const char *cmd, int argc, const char **argv);
+int command_printf(const char *format, ...)
+#ifdef __GNUC__
+__attribute__ ((format (printf, 1, 2)))
+#endif
+;
 
 #ifdef __GNUC__
 #define UNUSED __attribute__ ((unused))
@@ -0,0 +1,650 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+#define MSGBUF_MIN_READ	256
+
+/**
+ * Initialise a receive buffer. If storage is given it is used until a
+ * message larger than it arrives, after which the buffer moves to the heap
+ * until it next empties.
+ */
+void msgbuf_init(struct msgbuf *b, size_t limit, char *storage, size_t size)
+{
+	memset(b, 0, sizeof(*b));
+	b->limit = limit;
+	b->storage = storage;
+	b->storage_size = size;
+	b->data = storage;
+	b->size = size;
+}
+
+void msgbuf_free(struct msgbuf *b)
+{
+	if (b->data != b->storage)
+		free(b->data);
+	b->data = b->storage;
+	b->size = b->storage_size;
+	b->start = b->end = 0;
+}
+
+/**
+ * Make room for at least want more bytes (or whatever is left before the
+ * limit), first by moving unconsumed data to the front and then by growing
+ * the buffer. Returns the free space at the end.
+ */
+static size_t msgbuf_make_room(struct msgbuf *b, size_t want)
+{
+	size_t held = b->end - b->start, size;
+	char *data;
+
+	/* Drop back to the fixed storage once a large message is consumed */
+	if (held == 0 && b->data != b->storage && b->storage)
+		msgbuf_free(b);
+
+	if (b->size - b->end >= want)
+		return b->size - b->end;
+
+	if (b->start > 0) {
+		memmove(b->data, b->data + b->start, held);
+		b->start = 0;
+		b->end = held;
+		if (b->size - b->end >= want)
+			return b->size - b->end;
+	}
+
+	if (b->size >= b->limit)
+		return b->size - b->end;
+
+	size = b->size ? b->size * 2 : MSGBUF_MIN_READ;
+	while (size - held < want && size < b->limit)
+		size *= 2;
+	if (size > b->limit)
+		size = b->limit;
+	if (b->data == b->storage) {
+		data = malloc(size);
+		if (data && held)
+			memcpy(data, b->data, held);
+	} else {
+		data = realloc(b->data, size);
+	}
+	if (!data)
+		return b->size - b->end;
+	b->data = data;
+	b->size = size;
+
+	return b->size - b->end;
+}
+
+/**
+ * Read whatever is available from fd into the buffer. Returns the number of
+ * bytes read, 0 at end of file or -1 on error. errno is set to EMSGSIZE if
+ * the buffer is full, that is a message is larger than the limit.
+ */
+ssize_t msgbuf_read(struct msgbuf *b, int fd)
+{
+	size_t room = msgbuf_make_room(b, MSGBUF_MIN_READ);
+	ssize_t n;
+
+	if (room == 0) {
+		errno = b->size < b->limit ? ENOMEM : EMSGSIZE;
+		return -1;
+	}
+
+	do {
+		n = read(fd, b->data + b->end, room);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0)
+		b->end += n;
+
+	return n;
+}
+
+/**
+ * Receive one packet from a SOCK_SEQPACKET socket into the buffer, growing
+ * it first if the packet does not fit. Returns as msgbuf_read(); an empty
+ * packet is taken as end of file.
+ */
+ssize_t msgbuf_recv(struct msgbuf *b, int fd)
+{
+	struct iovec iov;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	ssize_t len, n;
+
+	/* Find the size of the next packet without copying it */
+	do {
+		len = recv(fd, NULL, 0, MSG_PEEK|MSG_TRUNC);
+	} while (len < 0 && errno == EINTR);
+	if (len <= 0)
+		return len;
+
+	if (msgbuf_make_room(b, len) < (size_t)len) {
+		errno = b->size < b->limit ? ENOMEM : EMSGSIZE;
+		return -1;
+	}
+
+	iov.iov_base = b->data + b->end;
+	iov.iov_len = b->size - b->end;
+	do {
+		n = recvmsg(fd, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0 && (msg.msg_flags & MSG_TRUNC)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (n > 0)
+		b->end += n;
+
+	return n;
+}
+
+/**
+ * Parse $argc and $argv[] from buf. The strings are not copied, argv points
+ * into buf. Returns the number of bytes used, 0 if more data is needed or -1
+ * if the request is malformed or has more than maxargs arguments.
+ */
+int proto_parse_args(const char *buf, size_t len, uint32_t *argc,
+                     const char **argv, unsigned int maxargs)
+{
+	uint32_t i, slen;
+	size_t off;
+
+	if (len < sizeof(uint32_t))
+		return 0;
+	*argc = proto_get_u32(buf);
+	if (*argc == 0 || *argc > maxargs)
+		return -1;
+	off = sizeof(uint32_t);
+
+	for (i = 0; i < *argc; ++i) {
+		if (len - off < sizeof(uint32_t))
+			return 0;
+		slen = proto_get_u32(buf + off);
+		off += sizeof(uint32_t);
+		if (slen == 0 || slen > QCONTROL_MAX_MESSAGE)
+			return -1;
+		if (len - off < slen)
+			return 0;
+		if (buf[off + slen - 1] != '\0')
+			return -1;
+		argv[i] = buf + off;
+		off += slen;
+	}
+
+	return off;
+}
+
+/**
+ * Parse a version 2 frame from buf. Returns the total size of the frame,
+ * 0 if more data is needed or -1 if the frame is malformed.
+ */
+int proto_parse_frame(const char *buf, size_t len, struct proto_frame *f)
+{
+	uint32_t framelen;
+
+	if (len < sizeof(uint32_t))
+		return 0;
+	framelen = proto_get_u32(buf);
+	/* The limit covers the whole frame, length included, as that is
+	   what has to fit in the receive buffer */
+	if (framelen < QCONTROL_FRAME_HEADER - sizeof(uint32_t) ||
+	    framelen > QCONTROL_MAX_MESSAGE - sizeof(uint32_t))
+		return -1;
+	if (len - sizeof(uint32_t) < framelen)
+		return 0;
+
+	f->id = proto_get_u32(buf + sizeof(uint32_t));
+	f->type = proto_get_u32(buf + 2 * sizeof(uint32_t));
+	f->payload = buf + QCONTROL_FRAME_HEADER;
+	f->len = framelen + sizeof(uint32_t) - QCONTROL_FRAME_HEADER;
+
+	return framelen + sizeof(uint32_t);
+}
+
+/**
+ * Parse the deadline at the start of a REQUEST_DEADLINE payload. Returns
+ * the number of bytes used or -1 if malformed.
+ */
+int proto_parse_deadline(const char *buf, size_t len,
+                         struct timespec *deadline)
+{
+	if (len < 2 * sizeof(uint32_t))
+		return -1;
+	deadline->tv_sec = proto_get_u32(buf);
+	deadline->tv_nsec = proto_get_u32(buf + sizeof(uint32_t));
+	if (deadline->tv_nsec >= 1000000000)
+		return -1;
+
+	return 2 * sizeof(uint32_t);
+}
+
+/**
+ * Parse the header of a CALL payload, which is followed by the arguments
+ * as $argc and $argv[]; $argc may be 0. deadline is zero if the client
+ * gave none. Returns the number of bytes used or -1 if malformed.
+ */
+int proto_parse_call(const char *buf, size_t len, struct timespec *deadline,
+                     uint32_t *instance, uint32_t *cmd)
+{
+	if (len < 4 * sizeof(uint32_t) ||
+	    proto_parse_deadline(buf + 2 * sizeof(uint32_t),
+	                         len - 2 * sizeof(uint32_t), deadline) < 0)
+		return -1;
+	*instance = proto_get_u32(buf);
+	*cmd = proto_get_u32(buf + sizeof(uint32_t));
+
+	return 4 * sizeof(uint32_t);
+}
+
+/**
+ * Parse a CALL_OPTION payload. Returns 0 on success or -1 if malformed.
+ */
+int proto_parse_call_option(const char *buf, size_t len,
+                            struct timespec *deadline, uint32_t *instance,
+                            uint32_t *cmd, uint32_t *option)
+{
+	if (len != 5 * sizeof(uint32_t) ||
+	    proto_parse_call(buf, len, deadline, instance, cmd) < 0)
+		return -1;
+	*option = proto_get_u32(buf + 4 * sizeof(uint32_t));
+
+	return 0;
+}
+
+/**
+ * Parse a $result and optional STRING $message, which must fill buf
+ * exactly. Returns 0 on success or -1 if malformed.
+ */
+int proto_parse_result(const char *buf, size_t len, int32_t *result,
+                       const char **message)
+{
+	uint32_t slen;
+
+	if (len < sizeof(uint32_t))
+		return -1;
+	*result = (int32_t)proto_get_u32(buf);
+	*message = NULL;
+	if (len == sizeof(uint32_t))
+		return 0;
+
+	if (len < 2 * sizeof(uint32_t))
+		return -1;
+	slen = proto_get_u32(buf + sizeof(uint32_t));
+	if (slen == 0 || slen != len - 2 * sizeof(uint32_t) ||
+	    buf[len - 1] != '\0')
+		return -1;
+	*message = buf + 2 * sizeof(uint32_t);
+
+	return 0;
+}
+
+/**
+ * Parse a STRING at *off, advancing *off past it. Returns NULL if malformed.
+ */
+static const char *proto_get_string(const char *buf, size_t len, size_t *off)
+{
+	const char *str;
+	uint32_t slen;
+
+	if (len - *off < sizeof(uint32_t))
+		return NULL;
+	slen = proto_get_u32(buf + *off);
+	*off += sizeof(uint32_t);
+	if (slen == 0 || len - *off < slen || buf[*off + slen - 1] != '\0')
+		return NULL;
+	str = buf + *off;
+	*off += slen;
+
+	return str;
+}
+
+/**
+ * Parse the payload of a COMMANDS response into a newly allocated array,
+ * whose names point into buf. options says whether the entries carry the
+ * options of version 5. Returns 0 on success or -1 if malformed or out of
+ * memory.
+ */
+int proto_parse_commands(const char *buf, size_t len, bool options,
+                         uint32_t *instance, struct proto_command **cmds,
+                         unsigned int *count)
+{
+	size_t off = 2 * sizeof(uint32_t);
+	unsigned int i, j;
+
+	*cmds = NULL;
+	if (len < off)
+		return -1;
+	*instance = proto_get_u32(buf);
+	*count = proto_get_u32(buf + sizeof(uint32_t));
+	/* Each entry takes at least 13 bytes */
+	if (*count > len / 13)
+		return -1;
+	*cmds = calloc(*count + 1, sizeof(**cmds));
+	if (!*cmds)
+		return -1;
+
+	for (i = 0; i < *count; ++i) {
+		if (len - off < 2 * sizeof(uint32_t))
+			break;
+		(*cmds)[i].id = proto_get_u32(buf + off);
+		(*cmds)[i].help_hash = proto_get_u32(buf + off +
+		                                     sizeof(uint32_t));
+		off += 2 * sizeof(uint32_t);
+		(*cmds)[i].name = proto_get_string(buf, len, &off);
+		if (!(*cmds)[i].name)
+			break;
+		if (!options)
+			continue;
+
+		if (len - off < sizeof(uint32_t))
+			break;
+		(*cmds)[i].noptions = proto_get_u32(buf + off);
+		off += sizeof(uint32_t);
+		(*cmds)[i].options = buf + off;
+		for (j = 0; j < (*cmds)[i].noptions; ++j)
+			if (!proto_get_string(buf, len, &off))
+				break;
+		if (j < (*cmds)[i].noptions)
+			break;
+	}
+	if (i == *count && off == len)
+		return 0;
+
+	free(*cmds);
+	*cmds = NULL;
+	return -1;
+}
+
+/**
+ * Return the number of the option called name of c, -1 if it has none
+ * such. The table must have been checked by proto_parse_commands().
+ */
+int proto_find_option(const struct proto_command *c, const char *name)
+{
+	const char *p = c->options;
+	uint32_t i, slen;
+
+	for (i = 0; i < c->noptions; ++i) {
+		slen = proto_get_u32(p);
+		p += sizeof(uint32_t);
+		if (strcmp(p, name) == 0)
+			return i;
+		p += slen;
+	}
+
+	return -1;
+}
+
+/**
+ * Parse the payload of an event frame. Returns 0 on success or -1 if
+ * malformed.
+ */
+int proto_parse_event(const char *buf, size_t len, struct qcontrol_event *ev)
+{
+	size_t off = 2 * sizeof(uint32_t);
+	unsigned int i;
+
+	if (len < off)
+		return -1;
+	ev->dropped = proto_get_u32(buf);
+	ev->time = proto_get_u32(buf + sizeof(uint32_t));
+	ev->name = proto_get_string(buf, len, &off);
+	if (!ev->name)
+		return -1;
+
+	if (len - off < sizeof(uint32_t))
+		return -1;
+	ev->nargs = proto_get_u32(buf + off);
+	off += sizeof(uint32_t);
+	if (ev->nargs > QCONTROL_EVENT_MAX_ARGS)
+		return -1;
+
+	for (i = 0; i < ev->nargs; ++i) {
+		if (len - off < 2 * sizeof(uint32_t))
+			return -1;
+		ev->args[i].type = proto_get_u32(buf + off);
+		off += sizeof(uint32_t);
+		switch (ev->args[i].type) {
+		case QCONTROL_EVENT_INT:
+			ev->args[i].i = (int32_t)proto_get_u32(buf + off);
+			off += sizeof(uint32_t);
+			break;
+		case QCONTROL_EVENT_STRING:
+			ev->args[i].s = proto_get_string(buf, len, &off);
+			if (!ev->args[i].s)
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return off == len ? 0 : -1;
+}
+
+/**
+ * Initialise a transmit buffer, see msgbuf_init().
+ */
+void outbuf_init(struct outbuf *o, char *storage, size_t size)
+{
+	memset(o, 0, sizeof(*o));
+	o->storage = storage;
+	o->storage_size = size;
+	o->data = storage;
+	o->size = size;
+}
+
+/**
+ * Discard the contents of the buffer, returning to the fixed storage.
+ */
+void outbuf_reset(struct outbuf *o)
+{
+	if (o->data != o->storage)
+		free(o->data);
+	o->data = o->storage;
+	o->size = o->storage_size;
+	o->len = 0;
+	o->error = false;
+}
+
+/**
+ * Return a pointer to len bytes of space at the end of the buffer, which
+ * the caller must fill and then commit by adding len to o->len. Returns
+ * NULL and sets o->error if the space could not be allocated.
+ */
+char *outbuf_reserve(struct outbuf *o, size_t len)
+{
+	size_t size = o->size ? o->size : 256;
+	char *data;
+
+	if (o->error)
+		return NULL;
+	if (o->size - o->len >= len)
+		return o->data + o->len;
+
+	while (size - o->len < len)
+		size *= 2;
+	if (o->data == o->storage) {
+		data = malloc(size);
+		if (data && o->len)
+			memcpy(data, o->data, o->len);
+	} else {
+		data = realloc(o->data, size);
+	}
+	if (!data) {
+		o->error = true;
+		return NULL;
+	}
+	o->data = data;
+	o->size = size;
+
+	return o->data + o->len;
+}
+
+void outbuf_put(struct outbuf *o, const void *p, size_t len)
+{
+	char *dst = outbuf_reserve(o, len);
+
+	if (!dst)
+		return;
+	memcpy(dst, p, len);
+	o->len += len;
+}
+
+void outbuf_put_u32(struct outbuf *o, uint32_t i)
+{
+	outbuf_put(o, &i, sizeof(i));
+}
+
+void outbuf_put_string(struct outbuf *o, const char *str)
+{
+	uint32_t slen = strlen(str) + 1;
+
+	outbuf_put_u32(o, slen);
+	outbuf_put(o, str, slen);
+}
+
+/**
+ * Start a version 2 frame. Returns the offset to pass to proto_frame_end()
+ * once the payload has been added.
+ */
+size_t proto_frame_begin(struct outbuf *o, uint32_t id, uint32_t type)
+{
+	size_t start = o->len;
+
+	outbuf_put_u32(o, 0);
+	outbuf_put_u32(o, id);
+	outbuf_put_u32(o, type);
+
+	return start;
+}
+
+void proto_frame_end(struct outbuf *o, size_t start)
+{
+	uint32_t framelen;
+
+	if (o->error)
+		return;
+	framelen = o->len - start - sizeof(uint32_t);
+	memcpy(o->data + start, &framelen, sizeof(framelen));
+}
+
+/**
+ * Return the length of the version 2 message starting with the INTEGER
+ * first: a frame, or the hello of the given length.
+ */
+size_t proto_message_len(uint32_t first, size_t hello)
+{
+	/* No frame length can be the hello's magic */
+	if (first == QCONTROL_PROTO_MAGIC)
+		return hello;
+	return first + sizeof(uint32_t);
+}
+
+/**
+ * Return how many bytes from the start of buf, which holds complete
+ * version 2 messages, to send as one SOCK_SEQPACKET packet: as many
+ * messages as fit in QCONTROL_MAX_MESSAGE, but at least one. hello is the
+ * length of the hello this side sends, which is longer from the daemon
+ * once it carries the instance.
+ */
+size_t proto_packet_len(const char *buf, size_t len, size_t hello)
+{
+	size_t off = 0, msglen;
+
+	while (len - off >= sizeof(uint32_t)) {
+		msglen = proto_message_len(proto_get_u32(buf + off), hello);
+		if (msglen > len - off || (off && off + msglen >
+		                           QCONTROL_MAX_MESSAGE))
+			break;
+		off += msglen;
+	}
+
+	return off ? off : len;
+}
+
+/**
+ * Encode a version 4 CALL of command number cmd of the given daemon
+ * instance. argv holds only the arguments, not the command name.
+ */
+void proto_put_call(struct outbuf *o, uint32_t id,
+                    const struct timespec *deadline, uint32_t instance,
+                    uint32_t cmd, int argc, const char **argv)
+{
+	size_t start = proto_frame_begin(o, id, QCONTROL_MSG_CALL);
+	int i;
+
+	outbuf_put_u32(o, instance);
+	outbuf_put_u32(o, cmd);
+	outbuf_put_u32(o, deadline ? deadline->tv_sec : 0);
+	outbuf_put_u32(o, deadline ? deadline->tv_nsec : 0);
+	outbuf_put_u32(o, argc);
+	for (i = 0; i < argc; ++i)
+		outbuf_put_string(o, argv[i]);
+	proto_frame_end(o, start);
+}
+
+/**
+ * Encode a version 5 CALL_OPTION, running command number cmd with its
+ * option number option.
+ */
+void proto_put_call_option(struct outbuf *o, uint32_t id,
+                           const struct timespec *deadline,
+                           uint32_t instance, uint32_t cmd, uint32_t option)
+{
+	size_t start = proto_frame_begin(o, id, QCONTROL_MSG_CALL_OPTION);
+
+	outbuf_put_u32(o, instance);
+	outbuf_put_u32(o, cmd);
+	outbuf_put_u32(o, deadline ? deadline->tv_sec : 0);
+	outbuf_put_u32(o, deadline ? deadline->tv_nsec : 0);
+	outbuf_put_u32(o, option);
+	proto_frame_end(o, start);
+}
+
+/**
+ * Encode a request, as a version 2 frame if id is non-NULL. A deadline
+ * (CLOCK_MONOTONIC) turns it into a version 3 REQUEST_DEADLINE frame.
+ */
+void proto_put_request(struct outbuf *o, const uint32_t *id,
+                       const struct timespec *deadline,
+                       int argc, const char **argv)
+{
+	size_t start = 0;
+	int i;
+
+	if (id && deadline) {
+		start = proto_frame_begin(o, *id,
+		                          QCONTROL_MSG_REQUEST_DEADLINE);
+		outbuf_put_u32(o, deadline->tv_sec);
+		outbuf_put_u32(o, deadline->tv_nsec);
+	} else if (id) {
+		start = proto_frame_begin(o, *id, QCONTROL_MSG_REQUEST);
+	}
+	outbuf_put_u32(o, argc);
+	for (i = 0; i < argc; ++i)
+		outbuf_put_string(o, argv[i]);
+	if (id)
+		proto_frame_end(o, start);
+}
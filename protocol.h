@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "libqcontrol.h"
+
+/*
+ * Constants for the remote protocol spoken over the control socket. See
+ * HACKING for a description of the messages.
+ */
+#define QCONTROL_PROTO_MAGIC	0x7163746cU	/* "qctl" */
+#define QCONTROL_PROTO_VERSION	5
+
+/* Version 2 frame types, version 3 adds REQUEST_DEADLINE, version 4
+   COMMANDS and CALL and version 5 CALL_OPTION */
+enum {
+	QCONTROL_MSG_REQUEST	= 1,
+	QCONTROL_MSG_RESPONSE	= 2,
+	QCONTROL_MSG_SUBSCRIBE	= 3,
+	QCONTROL_MSG_EVENT	= 4,
+	QCONTROL_MSG_REQUEST_DEADLINE = 5,
+	QCONTROL_MSG_COMMANDS	= 6,
+	QCONTROL_MSG_CALL	= 7,
+	QCONTROL_MSG_CALL_OPTION = 8,
+};
+
+/* Length, id and type of a version 2 frame */
+#define QCONTROL_FRAME_HEADER	(3 * sizeof(uint32_t))
+
+/* Largest message either side will accept */
+#define QCONTROL_MAX_MESSAGE	65536
+#define QCONTROL_MAX_ARGS	64
+
+/*
+ * Receive buffer for a stream connection. Data is read in at end and
+ * consumed from start; the buffer grows as needed up to limit.
+ */
+struct msgbuf {
+	char *data;
+	size_t size, start, end;
+	size_t limit;
+	char *storage;		/* Optional fixed storage, see msgbuf_init() */
+	size_t storage_size;
+};
+
+/* Transmit buffer, with the same optional fixed storage as struct msgbuf */
+struct outbuf {
+	char *data;
+	size_t size, len;
+	bool error;		/* An allocation failed, contents are invalid */
+	char *storage;
+	size_t storage_size;
+};
+
+/* An entry of the command table sent in reply to COMMANDS */
+struct proto_command {
+	uint32_t id;
+	uint32_t help_hash;
+	const char *name;
+	uint32_t noptions;	/* From version 5, 0 for other commands */
+	const char *options;	/* The first of noptions STRINGs */
+};
+
+struct proto_frame {
+	uint32_t id;
+	uint32_t type;
+	const char *payload;
+	size_t len;
+};
+
+static inline uint32_t proto_get_u32(const char *p)
+{
+	uint32_t i;
+
+	memcpy(&i, p, sizeof(i));
+	return i;
+}
+
+/* 32-bit FNV-1a */
+static inline uint32_t proto_hash(const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	return h;
+}
+
+void msgbuf_init(struct msgbuf *b, size_t limit, char *storage, size_t size);
+void msgbuf_free(struct msgbuf *b);
+ssize_t msgbuf_read(struct msgbuf *b, int fd);
+ssize_t msgbuf_recv(struct msgbuf *b, int fd);
+
+void outbuf_init(struct outbuf *o, char *storage, size_t size);
+void outbuf_reset(struct outbuf *o);
+char *outbuf_reserve(struct outbuf *o, size_t len);
+void outbuf_put(struct outbuf *o, const void *p, size_t len);
+void outbuf_put_u32(struct outbuf *o, uint32_t i);
+void outbuf_put_string(struct outbuf *o, const char *str);
+size_t proto_frame_begin(struct outbuf *o, uint32_t id, uint32_t type);
+void proto_frame_end(struct outbuf *o, size_t start);
+size_t proto_message_len(uint32_t first, size_t hello);
+size_t proto_packet_len(const char *buf, size_t len, size_t hello);
+void proto_put_call(struct outbuf *o, uint32_t id,
+                    const struct timespec *deadline, uint32_t instance,
+                    uint32_t cmd, int argc, const char **argv);
+void proto_put_call_option(struct outbuf *o, uint32_t id,
+                           const struct timespec *deadline,
+                           uint32_t instance, uint32_t cmd, uint32_t option);
+void proto_put_request(struct outbuf *o, const uint32_t *id,
+                       const struct timespec *deadline,
+                       int argc, const char **argv);
+
+int proto_parse_args(const char *buf, size_t len, uint32_t *argc,
+                     const char **argv, unsigned int maxargs);
+int proto_parse_frame(const char *buf, size_t len, struct proto_frame *f);
+int proto_parse_deadline(const char *buf, size_t len,
+                         struct timespec *deadline);
+int proto_parse_call(const char *buf, size_t len, struct timespec *deadline,
+                     uint32_t *instance, uint32_t *cmd);
+int proto_parse_call_option(const char *buf, size_t len,
+                            struct timespec *deadline, uint32_t *instance,
+                            uint32_t *cmd, uint32_t *option);
+int proto_parse_commands(const char *buf, size_t len, bool options,
+                         uint32_t *instance, struct proto_command **cmds,
+                         unsigned int *count);
+int proto_find_option(const struct proto_command *c, const char *name);
+int proto_parse_result(const char *buf, size_t len, int32_t *result,
+                       const char **message);
+/* The strings of the event point into buf */
+int proto_parse_event(const char *buf, size_t len, struct qcontrol_event *ev);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Print the status page published by the qcontrol daemon. This only reads
+ * shared memory, the daemon is not involved.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "statuspage.h"
+
+static const char *kind_names[] = {
+	[STATUS_KIND_COMMAND] = "command",
+	[STATUS_KIND_EVENT]   = "event",
+};
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : STATUS_PAGE_PATH;
+	const struct status_page *page;
+	struct status_page snap;
+	const struct status_page_header *h = &snap.header;
+	const struct status_page_entry *e;
+	struct stat st;
+	uint32_t i, len;
+	int fd, ret;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: qcontrol-status [PATH]\n");
+		return 1;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Error opening %s: %s\n", path,
+		        strerror(errno));
+		return 1;
+	}
+	if ((size_t)st.st_size < sizeof(struct status_page_header)) {
+		fprintf(stderr, "%s is not a status page\n", path);
+		return 1;
+	}
+	page = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		fprintf(stderr, "Error mapping %s: %s\n", path,
+		        strerror(errno));
+		return 1;
+	}
+
+	/* Never copy more than the file has, whatever the header says */
+	if (page->header.magic != STATUS_PAGE_MAGIC ||
+	    page->header.size > st.st_size) {
+		fprintf(stderr, "%s is not a status page\n", path);
+		return 1;
+	}
+	ret = status_page_read(page, &snap, (size_t)st.st_size < sizeof(snap) ?
+	                       (uint32_t)st.st_size : sizeof(snap));
+	if (ret < 0) {
+		fprintf(stderr, "Error reading %s: %s\n", path,
+		        strerror(errno));
+		return 1;
+	}
+	len = ret;
+	if (h->magic != STATUS_PAGE_MAGIC || len < sizeof(*h)) {
+		fprintf(stderr, "%s is not a status page\n", path);
+		return 1;
+	}
+
+	printf("pid %u\n", h->pid);
+	printf("commands %u\nevents %u\nerrors %u\n",
+	       h->commands, h->events, h->errors);
+	if (h->version >= 2)
+		printf("unhandled %u\n", h->unhandled);
+	if (h->errors)
+		printf("last-error %lld %s\n", (long long)h->error_time,
+		       h->last_error);
+
+	/* Newer versions may have larger entries or a longer header */
+	for (i = 0; i < h->nentries && i < h->max_entries; ++i) {
+		if (h->entry_offset + (i + 1) * h->entry_size > len ||
+		    h->entry_size < sizeof(*e))
+			break;
+		e = (const void *)((const char *)&snap + h->entry_offset +
+		                   i * h->entry_size);
+		printf("%s %.*s %lld %u %.*s\n",
+		       e->kind <= STATUS_KIND_EVENT ? kind_names[e->kind] : "?",
+		       (int)sizeof(e->name), e->name, (long long)e->time,
+		       e->count, (int)sizeof(e->value), e->value);
+	}
+
+	return 0;
+}
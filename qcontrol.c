@@ -16,24 +16,35 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
+#include <limits.h>
+#include <pthread.h>
 #include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <glob.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #ifdef HAVE_SYSTEMD
@@ -41,35 +52,198 @@
 #endif
 
 #include "picmodule.h"
-
-#define PIC_SOCKET	"/var/run/qcontrol.sock"
-#define MAX_NET_BUF	1000
-#define MALLOC_SIZE	100
+#include "events.h"
+#include "libqcontrol.h"
+#include "loop.h"
+#include "luacache.h"
+#include "luamem.h"
+#include "protocol.h"
+#include "state.h"
+#include "timers.h"
+#include "wqueue.h"
+
+#define PIC_SOCKET	QCONTROL_SOCKET
+#define PIC_SEQPACKET_SOCKET	QCONTROL_SEQPACKET_SOCKET
 #define MAX_CMD_NAME	16
+#define MAX_CONNECTIONS	64
+#define CONN_TIMEOUT	10	/* Seconds before a stalled client is dropped */
+#define MAX_PENDING_OUT	4096	/* Stop reading while this much is unsent */
+#define CONN_BUF_SIZE	1024
+#define CONN_REFS	16	/* Prepared responses pending per connection */
+#define CONN_POOL_SIZE	8	/* Closed connections kept for reuse */
+#define BATCH_SEPARATOR	";"
+#define CLIENT_TIMEOUT	10	/* Default seconds before the client gives up */
+#define COMMAND_CACHE	"qcontrol.commands"
+#define MAX_HANDLERS	32	/* At most the bits of registration.handlers */
+#define HANDLER_NO_LUA	0x10000	/* Posted by record_handler() */
+#define HANDLER_COMMAND	0x20000	/* Posted by queue_command() */
+#define GC_STEP		8	/* Size of an idle collection step, in KB */
 
 struct piccommand {
 	const char *name;
+	uint32_t hash;			/* proto_hash() of name */
 	const char *shorthelp;
 	const char *help;
 	int (*call)(int argc, const char **argv);
+	/* Commands taking one of a table of options instead */
+	int (*call_option)(const struct picoption *option);
+	const struct picoption *options;
+	unsigned char *option_index;	/* As command_index, for options */
+	unsigned int option_mask;
+	size_t help_off, help_len;	/* The help as a STRING in responses */
+	struct registration *owner;	/* NULL for the daemon's own commands */
+	bool local;			/* Changes nothing outside the daemon */
+};
+
+/* A module started by register(), with copies of its arguments so that a
+   reload can tell whether the new config starts it the same way */
+struct registration {
+	struct picmodule *module;
+	int argc;
+	char **argv;
+	bool old;		/* Registered by the config being replaced */
+	bool kept;		/* And again by the one replacing it */
+	uint32_t handlers;	/* Bit i if its init() registered handlers[i] */
+	struct registration *next;
+};
+
+/* A Lua function called for events, see register_handler() */
+struct handler {
+	char name[EVENT_NAME_LEN];
+	char types[EVENT_MAX_ARGS + 1];	/* 'd' or 's' for each argument */
+	int ref;		/* LUA_NOREF until resolved, LUA_REFNIL if none */
+};
+
+/* One command of a batch given to the client */
+struct batch_cmd {
+	int argc;
+	const char **argv;
+	bool done;
+	int result;
+};
+
+/*
+ * Responses which only depend on the commands, serialized once by
+ * build_responses(). A set is replaced when the commands change but only
+ * freed once no connection has any of it left to send.
+ */
+struct prepared {
+	unsigned int users;	/* The daemon while current, and out_refs */
+	struct outbuf out;
+};
+
+/* len bytes of a prepared response, sent before byte at of a connection's
+   out */
+struct out_ref {
+	size_t at;
+	struct prepared *from;
+	size_t off, len;
+};
+
+/*
+ * A client connection to the daemon. A protocol version 1 connection reads a
+ * single request, writes the response and is then closed. A version 2
+ * connection stays open and may have many requests in flight. Connections
+ * on the SOCK_SEQPACKET socket carry the same messages, but the kernel
+ * keeps their boundaries: each packet holds whole messages.
+ *
+ * Requests are decoded in place in in_storage and responses built in
+ * out_storage, so serving a request needs no heap allocation unless a
+ * message is too large for them. Prepared responses are not copied into
+ * out but sent from where they were built, see put_response(). Closed
+ * connections are kept for reuse.
+ */
+struct connection {
+	struct loop_watch watch;	/* Must be first */
+	unsigned int proto;		/* 0 until the first request arrives */
+	bool seqpacket;			/* Messages never span packets */
+	bool closing;			/* Close once out has been sent */
+	time_t last_active;
+	struct msgbuf in;
+	struct outbuf out;
+	size_t sent;			/* Bytes of output already sent */
+	unsigned int nrefs;
+	size_t ref_len;			/* Bytes of output in refs[] */
+	struct subscriber *sub;		/* Set once the client subscribes */
+	uint32_t sub_id;
+	struct connection *prev, *next;
+	char in_storage[CONN_BUF_SIZE];
+	char out_storage[CONN_BUF_SIZE];
+	struct out_ref refs[CONN_REFS];	/* In the order of their at */
 };
 
 bool g_use_syslog = false;
 char *version = "qcontrol " QCONTROL_VERSION "\n";
 char *usage = "Usage: qcontrol [OPTION...] [command] [args...]\n"
+              "       qcontrol [OPTION...] command [args...] \\; command [args...]...\n"
               "PIC Controller\n\n"
               "  -d, --daemon               Run the server as a daemon\n"
               "  -f, --foreground           Run the server in the foreground\n"
               "      --direct               Run commands directly\n"
+              "  -b, --batch                Read commands from standard input,\n"
+              "                             one per line\n"
               "  -c, --config=PATH          Use PATH as config file\n"
+              "  -t, --timeout=SECONDS      Give up on the server after SECONDS,\n"
+              "                             0 to wait forever (default 10)\n"
+              "      --idle-exit=SECONDS    Exit a socket activated server\n"
+              "                             after SECONDS without activity\n"
+              "      --events               Print events from the server as\n"
+              "                             they happen\n"
               "      --help                 Give this help list\n"
               "  -V, --version              Print program version\n\n"
               "Mandatory or optional arguments to long options are also "
               "mandatory or optional\nfor any corresponding short options.\n";
 static const char *configfilename = "/etc/qcontrol.conf";
 static lua_State *lua = NULL;
+static pthread_t lua_thread;		/* The only thread which may use lua */
+/* Not reallocated, device threads read the entries of their handlers */
+static struct handler handlers[MAX_HANDLERS];
+static unsigned int handlercount;
+static bool lua_pooled;			/* lua uses luamem_alloc() */
+static int gc_live;			/* KB in use after the last collection */
+static bool gc_cycle;			/* An idle collection is under way */
+static unsigned int gc_cycles;
 unsigned int commandcount = 0;
+static unsigned int commandsize;
 struct piccommand **commands;
+/* Open addressing hash of commands[] by name, built by index_commands()
+   once the config is loaded. Slots hold an index + 1, 0 is empty */
+static unsigned int *command_index;
+static unsigned int command_index_mask;
+static struct loop_watch listen_watch;
+static struct loop_watch seqpacket_watch;
+static struct loop_watch sweep_watch;
+static struct loop_watch events_watch;
+static struct loop_watch idle_watch;
+static struct loop_watch reload_watch;
+static struct loop_watch timer_watch;
+static unsigned int idle_exit;		/* Seconds, 0 to never exit */
+static bool idle_exited;
+static time_t last_activity;		/* Monotonic, for idle_exit */
+static struct timespec start_time;	/* For the time to first response */
+static bool socket_activated;
+static bool restoring;			/* Loading the config after a restore */
+static bool reloading;			/* Loading the config with SIGHUP */
+static struct registration *registrations;
+static struct registration *registering;	/* Module whose init() runs */
+static struct registration *pending;	/* Started once a reload succeeds */
+static uint32_t instance;		/* Identifies this daemon's command table */
+/* The current prepared responses: "Command not found\n" and the list of
+   commands as STRINGs, the payload of a COMMANDS frame for versions 4 and
+   5 and every command's help */
+static struct prepared *responses;
+static bool responses_valid;
+static size_t notfound_len, shorthelp_off, shorthelp_len, table_off, table_len;
+static size_t options_table_off, options_table_len;
+static int client_timeout = CLIENT_TIMEOUT;	/* Seconds, 0 to wait forever */
+static struct connection *connections;
+static unsigned int conncount;
+static struct connection *conn_pool;
+static unsigned int conn_pool_count;
+/* Where the output of the running command goes, stdout if NULL */
+static struct outbuf *command_out;
+static struct outbuf reply;
+static char reply_storage[CONN_BUF_SIZE];
 
 extern struct picmodule system_module;
 extern struct picmodule ts209_module;
@@ -115,44 +289,348 @@ int print_log(int priority, const char *format, ...)
 	return err;
 }
 
+static time_t monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static long long monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
 /**
- * Calls a function in the lua config file
+ * Collect Lua garbage a step at a time while the loop has nothing else to
+ * do, rather than in the middle of handlers. Like Lua's default pacing a
+ * cycle starts once the heap has doubled since the last one. Returns
+ * whether there is more to collect.
  */
-int call_function(const char *fname, const char *fmt, ...)
+static bool collect_idle(void)
 {
-	int i;
-	va_list s;
+	/* pcall_handler() may have let Lua collect by itself */
+	lua_gc(lua, LUA_GCSTOP, 0);
+	if (!gc_cycle && lua_gc(lua, LUA_GCCOUNT, 0) < 2 * gc_live)
+		return false;
+
+	gc_cycle = !lua_gc(lua, LUA_GCSTEP, GC_STEP);
+	/* Stepping lets Lua resume collecting by itself */
+	lua_gc(lua, LUA_GCSTOP, 0);
+	if (!gc_cycle) {
+		gc_live = lua_gc(lua, LUA_GCCOUNT, 0);
+		gc_cycles++;
+	}
+
+	return gc_cycle;
+}
+
+static int pcall_handler(const char *fname, int nargs)
+{
+	int err = 0;
+
+	if (lua_pcall(lua, nargs, 0, 0) == LUA_ERRRUN) {
+		print_log(LOG_ERR, "Error calling lua function %s: %s",
+		          fname, lua_tostring(lua, -1));
+		lua_pop(lua, 1);
+		err = -1;
+	}
+
+	/* If the loop never gets idle let Lua collect during handlers
+	   before the heap grows without bound */
+	if (lua_gc(lua, LUA_GCCOUNT, 0) > 4 * gc_live)
+		lua_gc(lua, LUA_GCRESTART, 0);
 
-	lua_getglobal(lua, fname);
+	return err;
+}
 
-	va_start(s, fmt);
-	for (i = 0; fmt[i]; ) {
-		if (fmt[i++] != '%')
+/**
+ * Declare a Lua function a module calls for events, with its arguments
+ * given as a string of %d and %s. Returns the number to pass to
+ * call_handler(), or -1.
+ */
+int register_handler(const char *fname, const char *fmt)
+{
+	char types[EVENT_MAX_ARGS + 1];
+	struct handler *h;
+	unsigned int i, n = 0;
+
+	for (i = 0; fmt[i]; i += 2) {
+		if (fmt[i] != '%' || (fmt[i + 1] != 'd' && fmt[i + 1] != 's') ||
+		    n == EVENT_MAX_ARGS) {
+			print_log(LOG_ERR, "Unrecognised format for %s", fname);
 			return -1;
-		switch (fmt[i]) {
-		case 'd':
-			lua_pushinteger(lua, va_arg(s, int));
-			break;
-		case 's':
-			lua_pushstring(lua, va_arg(s, char*));
+		}
+		types[n++] = fmt[i + 1];
+	}
+	types[n] = '\0';
+	if (strlen(fname) >= EVENT_NAME_LEN) {
+		print_log(LOG_ERR, "Handler name %s is too long", fname);
+		return -1;
+	}
+
+	/* The modules of a board family share their handlers */
+	for (i = 0; i < handlercount; ++i)
+		if (handlers[i].name[0] && strcmp(handlers[i].name, fname) == 0 &&
+		    strcmp(handlers[i].types, types) == 0)
+			goto out;
+	/* Reuse the slot of a module a reload stopped */
+	for (i = 0; i < handlercount; ++i)
+		if (!handlers[i].name[0])
 			break;
-		default:
-			print_log(LOG_WARNING, "Unrecognised format");
-			return -1;
+	if (i == MAX_HANDLERS) {
+		print_log(LOG_ERR, "Too many event handlers");
+		return -1;
+	}
+
+	h = &handlers[i];
+	strcpy(h->name, fname);
+	strcpy(h->types, types);
+	h->ref = LUA_NOREF;
+	if (i == handlercount)
+		handlercount++;
+out:
+	if (registering)
+		registering->handlers |= 1U << i;
+	return i;
+}
+
+/**
+ * Free the handlers only the registrations just stopped declared, their
+ * numbers are then taken by the next ones declared.
+ */
+static void drop_handlers(uint32_t dropped)
+{
+	struct registration *r;
+	unsigned int i;
+
+	for (r = registrations; r; r = r->next)
+		dropped &= ~r->handlers;
+	for (i = 0; i < handlercount; ++i) {
+		if (!(dropped & 1U << i))
+			continue;
+		luaL_unref(lua, LUA_REGISTRYINDEX, handlers[i].ref);
+		memset(&handlers[i], 0, sizeof(handlers[i]));
+		handlers[i].ref = LUA_NOREF;
+	}
+}
+
+/**
+ * Look up the Lua function of every handler once the config is loaded, so
+ * that events neither search the globals nor enter Lua when there is no
+ * function for them.
+ */
+static void resolve_handlers(void)
+{
+	struct handler *h;
+	unsigned int i;
+
+	for (i = 0; i < handlercount; ++i) {
+		h = &handlers[i];
+		if (!h->name[0])
+			continue;
+		luaL_unref(lua, LUA_REGISTRYINDEX, h->ref);
+		lua_getglobal(lua, h->name);
+		if (lua_isfunction(lua, -1)) {
+			h->ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+		} else {
+			lua_pop(lua, 1);
+			h->ref = LUA_REFNIL;
+			print_log(LOG_INFO, "No function for %s, ignoring it",
+			          h->name);
 		}
-		++i;
 	}
-	va_end(s);
+}
 
-	if (lua_pcall(lua, i / 2, 0, 0) == LUA_ERRRUN) {
-		print_log(LOG_ERR, "Error calling lua function %s: %s",
-		          fname, lua_tostring(lua, -1));
+/**
+ * Push the Lua function of h. Returns -1, counting the event as unhandled,
+ * if the config does not define one.
+ */
+static int push_handler(struct handler *h)
+{
+	if (h->ref == LUA_REFNIL) {
+		state_unhandled();
+		return -1;
+	}
+
+	/* Not resolved while the config is still being loaded */
+	if (h->ref == LUA_NOREF)
+		lua_getglobal(lua, h->name);
+	else
+		lua_rawgeti(lua, LUA_REGISTRYINDEX, h->ref);
+
+	return 0;
+}
+
+/**
+ * Calls a function in the lua config file, declared with register_handler().
+ * From any thread but the one owning the Lua state the call is queued for
+ * the main loop, and fails if the queue is full.
+ */
+int call_handler(int handler, ...)
+{
+	struct event_record rec;
+	struct handler *h;
+	unsigned int i;
+	va_list ap;
+
+	if (handler < 0 || handler >= MAX_HANDLERS)
 		return -1;
+	h = &handlers[handler];
+
+	__atomic_store_n(&last_activity, monotonic_now(), __ATOMIC_RELAXED);
+
+	va_start(ap, handler);
+	events_record(&rec, h->name, h->types, ap);
+	va_end(ap);
+
+	if (!pthread_equal(pthread_self(), lua_thread))
+		return events_post(handler, &rec);
+
+	state_event(&rec);
+	events_publish(&rec);
+	if (push_handler(h) < 0)
+		return 0;
+
+	/* Lua gets the caller's strings, not the truncated copies */
+	va_start(ap, handler);
+	for (i = 0; h->types[i]; ++i) {
+		if (h->types[i] == 'd')
+			lua_pushinteger(lua, va_arg(ap, int));
+		else
+			lua_pushstring(lua, va_arg(ap, char*));
 	}
+	va_end(ap);
+
+	return pcall_handler(h->name, i);
+}
+
+/**
+ * As call_handler(), but the event only goes to the status page and the
+ * subscribers, the Lua function is not called.
+ */
+int record_handler(int handler, ...)
+{
+	struct event_record rec;
+	va_list ap;
 
+	if (handler < 0 || handler >= MAX_HANDLERS)
+		return -1;
+
+	__atomic_store_n(&last_activity, monotonic_now(), __ATOMIC_RELAXED);
+
+	va_start(ap, handler);
+	events_record(&rec, handlers[handler].name, handlers[handler].types,
+	              ap);
+	va_end(ap);
+
+	if (!pthread_equal(pthread_self(), lua_thread))
+		return events_post(handler | HANDLER_NO_LUA, &rec);
+
+	state_event(&rec);
+	events_publish(&rec);
 	return 0;
 }
 
+static int run_command(const char *cmd, int argc, const char **argv);
+
+/**
+ * Run a command queued by queue_command(), its arguments are the strings
+ * of rec.
+ */
+static void run_posted_command(const struct event_record *rec)
+{
+	const char *argv[EVENT_MAX_ARGS];
+	unsigned int i;
+
+	for (i = 0; i < rec->nargs; ++i)
+		argv[i] = rec->args[i].s;
+	if (run_command(rec->name, rec->nargs, argv) < 0)
+		print_log(LOG_ERR, "Queued command %s failed", rec->name);
+}
+
+/**
+ * Run the Lua handler for an event queued by a device thread.
+ */
+static void run_posted(int handler, const struct event_record *rec)
+{
+	struct handler *h = &handlers[handler & ~HANDLER_NO_LUA];
+	unsigned int i;
+
+	if (handler == HANDLER_COMMAND) {
+		run_posted_command(rec);
+		return;
+	}
+	state_event(rec);
+	events_publish(rec);
+	/* Posted by a module a reload has since stopped */
+	if (strcmp(h->name, rec->name) != 0)
+		return;
+	if (handler & HANDLER_NO_LUA || push_handler(h) < 0)
+		return;
+
+	for (i = 0; i < rec->nargs; ++i) {
+		if (rec->args[i].type == QCONTROL_EVENT_INT)
+			lua_pushinteger(lua, rec->args[i].i);
+		else
+			lua_pushstring(lua, rec->args[i].s);
+	}
+	pcall_handler(h->name, rec->nargs);
+}
+
+/**
+ * Run the handlers of events posted by device threads. Anything posted
+ * meanwhile has signalled again, so stopping after a queue's worth leaves
+ * time for clients.
+ */
+static void run_queued(void)
+{
+	struct event_record rec;
+	unsigned int n;
+	uint32_t lost;
+	int handler;
+
+	for (n = 0; n < EVENT_QUEUE && events_take(&handler, &rec); ++n)
+		run_posted(handler, &rec);
+	lost = events_overflows();
+	if (lost)
+		print_log(LOG_WARNING, "%u events lost, Lua is not keeping up",
+		          lost);
+}
+
+/**
+ * Add text to the response of the command being run
+ */
+int command_printf(const char *format, ...)
+{
+	va_list ap;
+	char *dst;
+	int len;
+
+	va_start(ap, format);
+	if (!command_out) {
+		len = vprintf(format, ap);
+		va_end(ap);
+		return len;
+	}
+	len = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+
+	dst = outbuf_reserve(command_out, len + 1);
+	if (!dst)
+		return -1;
+	va_start(ap, format);
+	vsnprintf(dst, len + 1, format, ap);
+	va_end(ap);
+	command_out->len += len;
+
+	return len;
+}
+
 /**
  * Return an error to lua
  */
@@ -226,7 +704,7 @@ static int confdir(lua_State *L UNUSED)
 		}
 		print_log(LOG_ERR, "confdir: including %s", path);
 
-		rc = luaL_dofile(lua, path);
+		rc = luacache_dofile(lua, path);
 		if (rc != 0) {
 			print_log(LOG_ERR, "%s", lua_tostring(lua, -1));
 			lua_pop(lua, 1);
@@ -255,408 +733,2362 @@ int get_args(int *argc, const char ***argv)
 	return 0;
 }
 
-static int register_module(lua_State *L UNUSED)
+static void free_registration(struct registration *r)
 {
-	int i, argc, err;
-	const char **argv;
-
-	err = get_args(&argc, &argv);
-	if (err < 0) {
-		print_log(LOG_ERR, "register() - Error getting arguments");
-		return err;
-	}
+	int i;
 
-	for (i = 0; modules[i]; ++i) {
-		if (strcmp(argv[0], modules[i]->name) != 0)
-			continue;
-		err = modules[i]->init(argc - 1, argv + 1);
-		break;
-	}
-	if (err < 0)
-		return_error("register() - Error loading module");
-	return err;
+	for (i = 0; i < r->argc; ++i)
+		free(r->argv[i]);
+	free(r->argv);
+	free(r);
 }
 
-int register_command(const char *cmd, const char *shorthelp, const char *help,
-                     int (*call)(int argc, const char **argv))
+static struct registration *new_registration(struct picmodule *m, int argc,
+                                             const char **argv)
 {
-	struct piccommand *c = malloc(sizeof(struct piccommand));
+	struct registration *r;
+	int i;
 
-	if (!c || strlen(cmd) > MAX_CMD_NAME) {
-		free(c);
-		return -1;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->module = m;
+	r->argv = calloc(argc, sizeof(char *));
+	if (argc > 0 && !r->argv)
+		goto err;
+	for (i = 0; i < argc; ++i) {
+		r->argv[i] = strdup(argv[i]);
+		if (!r->argv[i])
+			goto err;
+		r->argc++;
 	}
-	c->name = cmd;
-	c->shorthelp = shorthelp;
-	c->help = help;
-	c->call = call;
-
-	if (commandcount == 0)
-		commands = malloc(++commandcount * sizeof(struct piccommand*));
-	else
-		commands = realloc(commands,
-		                   ++commandcount * sizeof(struct piccommand*));
 
-	commands[commandcount - 1] = c;
+	return r;
 
-	return 0;
+err:
+	free_registration(r);
+	return NULL;
 }
 
-static int shorthelp_fmt(char *buf, size_t size, struct piccommand *c)
+/**
+ * Find the module the config being replaced registered with the same
+ * arguments, NULL if there is none.
+ */
+static struct registration *find_registration(struct picmodule *m, int argc,
+                                              const char **argv)
 {
-	return snprintf(buf, size, "%-16s %s\n", c->name, c->shorthelp);
+	struct registration *r;
+	int i;
+
+	for (r = registrations; r; r = r->next) {
+		if (!r->old || r->kept || r->module != m || r->argc != argc)
+			continue;
+		for (i = 0; i < argc; ++i)
+			if (strcmp(r->argv[i], argv[i]) != 0)
+				break;
+		if (i == argc)
+			return r;
+	}
+
+	return NULL;
 }
 
-static void shorthelp_commands(char **buf, int *len)
+/**
+ * Remove the commands registered by the module of r.
+ */
+static void drop_commands(struct registration *r)
 {
-	unsigned int i, off=0;
+	struct piccommand *c;
+	unsigned int i, n = 0;
 
-	*len = sizeof(int) + 1; /* Length field + NUL terminator */
-	for (i = 0; i < commandcount; ++i)
-		*len += shorthelp_fmt(NULL, 0, commands[i]);
+	for (i = 0; i < commandcount; ++i) {
+		c = commands[i];
+		if (c->owner != r) {
+			commands[n++] = c;
+			continue;
+		}
+		if (c->options) {
+			free((char *)c->help);
+			free(c->option_index);
+		}
+		free(c);
+	}
+	if (n == commandcount)
+		return;
 
-	*buf = malloc(*len);
-	memset(*buf, 0, sizeof(int));
-	off += sizeof(int); /* Skip length */
-	for (i = 0; i < commandcount; ++i)
-		off += shorthelp_fmt(*buf+off, *len-off, commands[i]);
+	commandcount = n;
+	free(command_index);
+	command_index = NULL;
+	responses_valid = false;
 }
 
-static void shorthelp_commands_direct(void)
+/**
+ * Stop the modules of the config being replaced which the new one has not
+ * registered again.
+ */
+static void stop_registrations(void)
 {
-	char *buf = NULL;
-	int offs = 0;
+	struct registration *r, **p = &registrations;
+	uint32_t dropped = 0;
 
-	shorthelp_commands(&buf, &offs);
-	printf("\nAvailable commands are:\n%s", buf+sizeof(int));
-	free(buf);
+	while ((r = *p)) {
+		if (!r->old || r->kept) {
+			p = &r->next;
+			continue;
+		}
+		*p = r->next;
+		print_log(LOG_INFO, "Stopping module %s", r->module->name);
+		if (r->module->exit)
+			r->module->exit();
+		drop_commands(r);
+		dropped |= r->handlers;
+		free_registration(r);
+	}
+	drop_handlers(dropped);
 }
 
-static int run_command(const char *cmd, int argc, const char **argv)
+/**
+ * Run the init() of the module of r and add it to the registrations, r is
+ * freed if that fails.
+ */
+static int start_registration(struct registration *r)
 {
-	unsigned int i;
+	struct registration **p;
+	int err;
 
-	for (i = 0; i < commandcount; ++i)
-		if (strcmp(cmd, commands[i]->name) == 0)
-			return commands[i]->call(argc, argv);
+	registering = r;
+	err = r->module->init(r->argc, (const char **)r->argv);
+	registering = NULL;
+	if (err < 0) {
+		drop_commands(r);
+		free_registration(r);
+		return err;
+	}
 
-	return -1;
+	for (p = &registrations; *p; p = &(*p)->next)
+		;
+	*p = r;
+	return 0;
 }
 
-static int run_command_lua(lua_State *L UNUSED)
+static int register_module(lua_State *L UNUSED)
 {
-	int argc, err;
+	struct registration *r, **p;
+	struct picmodule *m = NULL;
+	int i, argc, err;
 	const char **argv;
 
 	err = get_args(&argc, &argv);
 	if (err < 0) {
-		return_error("piccmd() - Error getting arguments");
-		return -1;
+		print_log(LOG_ERR, "register() - Error getting arguments");
+		return err;
 	}
 
-	return run_command(argv[0], argc-1, argv+1);
-}
+	for (i = 0; modules[i]; ++i) {
+		if (strcmp(argv[0], modules[i]->name) == 0) {
+			m = modules[i];
+			break;
+		}
+	}
+	if (!m)
+		return 0;
 
-static int run_command_direct(const char *cmd, int argc, const char **argv)
-{
-	int err = run_command(cmd, argc, argv);
+	if (reloading) {
+		/* Its devices stay open and its threads keep running */
+		r = find_registration(m, argc - 1, argv + 1);
+		if (r) {
+			r->kept = true;
+			return 0;
+		}
+	}
 
-	if (err < 0)
-		return -1;
+	r = new_registration(m, argc - 1, argv + 1);
+	if (!r)
+		return_error("register() - Out of memory");
+	if (reloading) {
+		/* Modules drive one device, the old one stops first and only
+		   once the new config has run */
+		for (p = &pending; *p; p = &(*p)->next)
+			;
+		*p = r;
+		return 0;
+	}
 
+	if (start_registration(r) < 0)
+		return_error("register() - Error loading module");
 	return 0;
 }
 
-static int script_print(lua_State *L UNUSED)
+static int add_command(struct piccommand *c)
 {
-	int argc, err;
-	const char **argv;
+	struct piccommand **n;
 
-	err = get_args(&argc, &argv);
-	if (err < 0 || argc != 1) {
-		return_error("logprint() - Error getting arguments");
-		return -1;
+	if (commandcount == commandsize) {
+		commandsize = commandsize ? commandsize * 2 : 16;
+		n = realloc(commands, commandsize * sizeof(struct piccommand*));
+		if (!n)
+			return -1;
+		commands = n;
 	}
+	c->owner = registering;
+	commands[commandcount++] = c;
 
-	print_log(LOG_NOTICE, "%s", argv[0]);
+	/* Lookups fall back to a scan until the index is rebuilt */
+	free(command_index);
+	command_index = NULL;
+	responses_valid = false;
 
 	return 0;
 }
 
-static const char *help_command(const char *cmd)
+static struct piccommand *new_command(const char *cmd, const char *shorthelp,
+                                      const char *help)
+{
+	struct piccommand *c;
+
+	if (strlen(cmd) > MAX_CMD_NAME)
+		return NULL;
+	c = calloc(1, sizeof(struct piccommand));
+	if (!c)
+		return NULL;
+	c->name = cmd;
+	c->hash = proto_hash(cmd);
+	c->shorthelp = shorthelp;
+	c->help = help;
+
+	return c;
+}
+
+int register_command(const char *cmd, const char *shorthelp, const char *help,
+                     int (*call)(int argc, const char **argv))
+{
+	struct piccommand *c = new_command(cmd, shorthelp, help);
+
+	if (!c)
+		return -1;
+	c->call = call;
+	if (add_command(c) < 0) {
+		free(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Register a command whose effect lives only in the daemon, so a restarted
+ * daemon has to run it again even though the device state says it ran.
+ */
+int register_local_command(const char *cmd, const char *shorthelp,
+                           const char *help,
+                           int (*call)(int argc, const char **argv))
+{
+	struct piccommand *c = new_command(cmd, shorthelp, help);
+
+	if (!c)
+		return -1;
+	c->call = call;
+	c->local = true;
+	if (add_command(c) < 0) {
+		free(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Build the help of an option command, help followed by the options.
+ */
+static char *option_help(const char *help, const struct picoption *options)
+{
+	struct outbuf out;
+	unsigned int i;
+
+	outbuf_init(&out, NULL, 0);
+	outbuf_put(&out, help, strlen(help));
+	outbuf_put(&out, ", options are:\n", 15);
+	for (i = 0; options[i].name; ++i) {
+		outbuf_put(&out, "\t", 1);
+		outbuf_put(&out, options[i].name, strlen(options[i].name));
+		outbuf_put(&out, "\n", 1);
+	}
+	outbuf_put(&out, "", 1);
+	if (out.error) {
+		outbuf_reset(&out);
+		return NULL;
+	}
+
+	return out.data;
+}
+
+/**
+ * Register a command which takes exactly one argument, one of the names in
+ * options; call is passed the matching entry. The help lists the options
+ * after help.
+ */
+int register_option_command(const char *cmd, const char *shorthelp,
+                            const char *help,
+                            const struct picoption *options,
+                            int (*call)(const struct picoption *option))
+{
+	unsigned int i, n, slot, size = 8;
+	struct piccommand *c;
+	uint32_t hash;
+
+	for (n = 0; options[n].name; ++n)
+		;
+	if (n > UCHAR_MAX)
+		return -1;
+	while (size < 2 * n)
+		size *= 2;
+
+	c = new_command(cmd, shorthelp, NULL);
+	if (!c)
+		return -1;
+	c->call_option = call;
+	c->options = options;
+	c->option_index = calloc(size, 1);
+	c->option_mask = size - 1;
+	c->help = option_help(help, options);
+	if (!c->option_index || !c->help)
+		goto err;
+
+	for (i = 0; i < n; ++i) {
+		hash = proto_hash(options[i].name);
+		for (slot = hash & c->option_mask; c->option_index[slot];
+		     slot = (slot + 1) & c->option_mask)
+			;
+		c->option_index[slot] = i + 1;
+	}
+
+	if (add_command(c) == 0)
+		return 0;
+
+err:
+	free((char *)c->help);
+	free(c->option_index);
+	free(c);
+	return -1;
+}
+
+/**
+ * Look arg up in the options of c, NULL if it is not one of them.
+ */
+static const struct picoption *find_option(struct piccommand *c,
+                                           const char *arg)
+{
+	const struct picoption *o;
+	uint32_t hash = proto_hash(arg);
+	unsigned int slot;
+
+	for (slot = hash & c->option_mask; c->option_index[slot];
+	     slot = (slot + 1) & c->option_mask) {
+		o = &c->options[c->option_index[slot] - 1];
+		if (strcmp(o->name, arg) == 0)
+			return o;
+	}
+
+	return NULL;
+}
+
+/**
+ * Build the hash index of commands[]. Of several commands with the same
+ * name the first registered wins, as with a scan.
+ */
+static int index_commands(void)
+{
+	unsigned int i, slot, size = 16, *index;
+
+	while (size < 2 * commandcount)
+		size *= 2;
+	index = calloc(size, sizeof(*index));
+	if (!index)
+		return -1;
+
+	for (i = 0; i < commandcount; ++i) {
+		slot = commands[i]->hash & (size - 1);
+		while (index[slot] && strcmp(commands[index[slot] - 1]->name,
+		                             commands[i]->name) != 0)
+			slot = (slot + 1) & (size - 1);
+		if (!index[slot])
+			index[slot] = i + 1;
+	}
+
+	free(command_index);
+	command_index = index;
+	command_index_mask = size - 1;
+
+	return 0;
+}
+
+static int shorthelp_fmt(char *buf, size_t size, struct piccommand *c)
+{
+	return snprintf(buf, size, "%-16s %s\n", c->name, c->shorthelp);
+}
+
+/**
+ * Append the NUL terminated list of commands to out. Returns its length.
+ */
+static size_t shorthelp_commands(struct outbuf *out)
+{
+	unsigned int i;
+	size_t len = 1, off = 0;
+	char *buf;
+
+	for (i = 0; i < commandcount; ++i)
+		len += shorthelp_fmt(NULL, 0, commands[i]);
+
+	buf = outbuf_reserve(out, len);
+	if (!buf)
+		return 0;
+	buf[0] = '\0';
+	for (i = 0; i < commandcount; ++i)
+		off += shorthelp_fmt(buf+off, len-off, commands[i]);
+	out->len += len;
+
+	return len;
+}
+
+static void prepared_put(struct prepared *p)
+{
+	if (p && --p->users == 0) {
+		outbuf_reset(&p->out);
+		free(p);
+	}
+}
+
+/**
+ * Serialize the responses which only change with the commands, so that
+ * requests just refer to them.
+ */
+static int build_responses(void)
+{
+	struct prepared *p;
+	struct outbuf *out;
+	unsigned int i, j, n;
+	uint32_t len;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return -1;
+	out = &p->out;
+	outbuf_init(out, NULL, 0);
+	outbuf_put_string(out, "Command not found\n");
+	notfound_len = out->len;
+
+	shorthelp_off = out->len;
+	outbuf_put_u32(out, 0);
+	len = shorthelp_commands(out);
+	if (!out->error)
+		memcpy(out->data + shorthelp_off, &len, sizeof(len));
+	shorthelp_len = out->len - shorthelp_off;
+
+	table_off = out->len;
+	outbuf_put_u32(out, instance);
+	outbuf_put_u32(out, commandcount);
+	for (i = 0; i < commandcount; ++i) {
+		outbuf_put_u32(out, i);
+		outbuf_put_u32(out, proto_hash(commands[i]->help));
+		outbuf_put_string(out, commands[i]->name);
+	}
+	table_len = out->len - table_off;
+
+	/* Version 5 adds the options, numbered as in the command's table */
+	options_table_off = out->len;
+	outbuf_put_u32(out, instance);
+	outbuf_put_u32(out, commandcount);
+	for (i = 0; i < commandcount; ++i) {
+		outbuf_put_u32(out, i);
+		outbuf_put_u32(out, proto_hash(commands[i]->help));
+		outbuf_put_string(out, commands[i]->name);
+		for (n = 0; commands[i]->options &&
+		            commands[i]->options[n].name; ++n)
+			;
+		outbuf_put_u32(out, n);
+		for (j = 0; j < n; ++j)
+			outbuf_put_string(out, commands[i]->options[j].name);
+	}
+	options_table_len = out->len - options_table_off;
+
+	for (i = 0; i < commandcount; ++i) {
+		commands[i]->help_off = out->len;
+		outbuf_put_string(out, commands[i]->help);
+		commands[i]->help_len = out->len - commands[i]->help_off;
+	}
+
+	if (out->error) {
+		outbuf_reset(out);
+		free(p);
+		return -1;
+	}
+	p->users = 1;
+	prepared_put(responses);
+	responses = p;
+	responses_valid = true;
+
+	return 0;
+}
+
+/**
+ * Add len bytes of the prepared responses from off to the output of conn,
+ * building them first if the commands have changed. They are sent from the
+ * prepared responses, only copied if conn already refers to too many.
+ */
+static void put_response(struct connection *conn, size_t off, size_t len)
+{
+	struct out_ref *r;
+
+	if (!responses_valid && build_responses() < 0) {
+		/* Fails the connection like any other allocation failure */
+		conn->out.error = true;
+		return;
+	}
+	if (conn->nrefs == CONN_REFS) {
+		outbuf_put(&conn->out, responses->out.data + off, len);
+		return;
+	}
+
+	r = &conn->refs[conn->nrefs++];
+	r->at = conn->out.len;
+	r->from = responses;
+	r->off = off;
+	r->len = len;
+	responses->users++;
+	conn->ref_len += len;
+}
+
+/**
+ * As proto_frame_end(), counting the prepared responses added to the frame.
+ */
+static void conn_frame_end(struct connection *conn, size_t start)
+{
+	uint32_t framelen;
+	unsigned int i;
+
+	proto_frame_end(&conn->out, start);
+	if (conn->out.error)
+		return;
+	memcpy(&framelen, conn->out.data + start, sizeof(framelen));
+	for (i = conn->nrefs; i > 0 && conn->refs[i - 1].at > start; --i)
+		framelen += conn->refs[i - 1].len;
+	memcpy(conn->out.data + start, &framelen, sizeof(framelen));
+}
+
+static void shorthelp_commands_direct(void)
+{
+	struct outbuf out;
+
+	outbuf_init(&out, NULL, 0);
+	if (shorthelp_commands(&out) > 0)
+		printf("\nAvailable commands are:\n%s", out.data);
+	outbuf_reset(&out);
+}
+
+/**
+ * Return the index of cmd in commands[], or -1 if there is no such command.
+ */
+static int find_command(const char *cmd)
+{
+	struct piccommand *c;
+	unsigned int i, slot;
+	uint32_t hash;
+
+	if (!command_index) {
+		for (i = 0; i < commandcount; ++i)
+			if (strcmp(cmd, commands[i]->name) == 0)
+				return i;
+		return -1;
+	}
+
+	hash = proto_hash(cmd);
+	for (slot = hash & command_index_mask; command_index[slot];
+	     slot = (slot + 1) & command_index_mask) {
+		c = commands[command_index[slot] - 1];
+		if (c->hash == hash && strcmp(c->name, cmd) == 0)
+			return command_index[slot] - 1;
+	}
+
+	return -1;
+}
+
+/**
+ * Run commands[i]. o is the option already looked up by the caller, if it
+ * is an option command, or NULL to look argv[0] up.
+ */
+static int call_command(unsigned int i, const struct picoption *o,
+                        int argc, const char **argv)
+{
+	const char *cmd = commands[i]->name;
+	int err;
+
+	/* The device is still as the previous daemon left it */
+	if (restoring && !commands[i]->local &&
+	    state_is_current(cmd, argc, argv))
+		return 0;
+	if (commands[i]->options) {
+		if (!o && argc == 1)
+			o = find_option(commands[i], argv[0]);
+		err = o ? commands[i]->call_option(o) : -1;
+	} else {
+		err = commands[i]->call(argc, argv);
+	}
+	if (err >= 0)
+		state_command(cmd, argc, argv);
+	else
+		state_error(cmd, argc, argv);
+	return err;
+}
+
+static int run_command(const char *cmd, int argc, const char **argv)
+{
+	int i = find_command(cmd);
+
+	if (i < 0)
+		return -1;
+	return call_command(i, NULL, argc, argv);
+}
+
+/**
+ * Run a command for a device thread as piccmd() would, so that it goes
+ * through the state cache like any other. The command is queued for the
+ * main loop, which logs it if it fails. Returns -1 if it could not be
+ * queued.
+ */
+int queue_command(const char *cmd, int argc, const char **argv)
+{
+	struct event_record rec;
+	int i;
+
+	if (pthread_equal(pthread_self(), lua_thread))
+		return run_command(cmd, argc, argv);
+	if (argc > EVENT_MAX_ARGS || strlen(cmd) >= EVENT_NAME_LEN)
+		return -1;
+
+	memset(&rec, 0, sizeof(rec));
+	strcpy(rec.name, cmd);
+	for (i = 0; i < argc; ++i) {
+		if (strlen(argv[i]) >= EVENT_STR_LEN)
+			return -1;
+		rec.args[i].type = QCONTROL_EVENT_STRING;
+		strcpy(rec.args[i].s, argv[i]);
+	}
+	rec.nargs = argc;
+
+	return events_post(HANDLER_COMMAND, &rec);
+}
+
+static int run_command_lua(lua_State *L UNUSED)
+{
+	int argc, err;
+	const char **argv;
+
+	err = get_args(&argc, &argv);
+	if (err < 0) {
+		return_error("piccmd() - Error getting arguments");
+		return -1;
+	}
+
+	return run_command(argv[0], argc-1, argv+1);
+}
+
+/* piccmd() for LuaJIT's FFI, which passes the arguments straight from the
+   handler instead of through get_args() */
+int qcontrol_piccmd(const char *cmd, int argc, const char **argv)
+{
+	return run_command(cmd, argc, argv);
+}
+
+#ifdef HAVE_LUAJIT
+#define STR(x)	#x
+#define XSTR(x)	STR(x)
+
+/* Replaces piccmd() with a call through the FFI, unless the symbol can't be
+   found as in a static build. Arguments which aren't strings still take the
+   Lua C API for lua_tostring()'s conversion. The argument arrays are kept
+   for reuse, one for each level a command may run a handler calling
+   piccmd() again */
+static const char ffi_piccmd[] =
+	"local ffi = require('ffi')\n"
+	"ffi.cdef[[int qcontrol_piccmd(const char *cmd, int argc,\n"
+	"                               const char **argv);]]\n"
+	"local ok, call = pcall(function() return ffi.C.qcontrol_piccmd end)\n"
+	"if not ok then return end\n"
+	"local argv = ffi.typeof('const char *[" XSTR(QCONTROL_MAX_ARGS) "]')\n"
+	"local bufs, depth = {}, 0\n"
+	"local slow = piccmd\n"
+	"function piccmd(cmd, ...)\n"
+	"	local n = select('#', ...)\n"
+	"	if n > " XSTR(QCONTROL_MAX_ARGS) " then\n"
+	"		return slow(cmd, ...)\n"
+	"	end\n"
+	"	depth = depth + 1\n"
+	"	local buf = bufs[depth] or argv()\n"
+	"	bufs[depth] = buf\n"
+	"	for i = 1, n do\n"
+	"		local arg = select(i, ...)\n"
+	"		if type(arg) ~= 'string' then\n"
+	"			depth = depth - 1\n"
+	"			return slow(cmd, ...)\n"
+	"		end\n"
+	"		buf[i - 1] = arg\n"
+	"	end\n"
+	"	call(cmd, n, buf)\n"
+	"	depth = depth - 1\n"
+	"end\n";
+#endif
+
+static int run_command_direct(const char *cmd, int argc, const char **argv)
+{
+	int err = run_command(cmd, argc, argv);
+
+	/* No loop runs the handlers of events raised meanwhile */
+	run_queued();
+	if (err < 0)
+		return -1;
+
+	return 0;
+}
+
+static void run_timer(int ref, bool last)
+{
+	lua_rawgeti(lua, LUA_REGISTRYINDEX, ref);
+	pcall_handler("timer", 0);
+	if (last)
+		luaL_unref(lua, LUA_REGISTRYINDEX, ref);
+}
+
+static int add_timer(bool repeat, const char *usage)
+{
+	lua_Integer ms;
+	int ref, id;
+
+	if (lua_gettop(lua) != 2 || !lua_isnumber(lua, 1) ||
+	    !lua_isfunction(lua, 2))
+		return_error(usage);
+	ms = lua_tointeger(lua, 1);
+	if (ms < (repeat ? 1 : 0) || ms > INT_MAX)
+		return_error(usage);
+
+	lua_pushvalue(lua, 2);
+	ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+	id = timer_add(ms, repeat, ref);
+	if (id < 0) {
+		luaL_unref(lua, LUA_REGISTRYINDEX, ref);
+		return_error("Too many timers");
+	}
+
+	lua_pushinteger(lua, id);
+	return 1;
+}
+
+/**
+ * settimer(ms, fn) calls fn once after ms milliseconds, returning the
+ * timer's id for canceltimer()
+ */
+static int settimer_lua(lua_State *L UNUSED)
+{
+	return add_timer(false, "settimer() - Expected milliseconds and "
+	                        "a function");
+}
+
+/**
+ * setinterval(ms, fn) calls fn every ms milliseconds
+ */
+static int setinterval_lua(lua_State *L UNUSED)
+{
+	return add_timer(true, "setinterval() - Expected milliseconds > 0 "
+	                       "and a function");
+}
+
+/**
+ * canceltimer(id) stops a timer, returning false if it had already run
+ */
+static int canceltimer_lua(lua_State *L UNUSED)
+{
+	int ref;
+
+	if (!lua_isnumber(lua, 1))
+		return_error("canceltimer() - Expected a timer id");
+	if (timer_cancel(lua_tointeger(lua, 1), &ref) == 0) {
+		luaL_unref(lua, LUA_REGISTRYINDEX, ref);
+		lua_pushboolean(lua, 1);
+	} else {
+		lua_pushboolean(lua, 0);
+	}
+
+	return 1;
+}
+
+static int script_print(lua_State *L UNUSED)
+{
+	int argc, err;
+	const char **argv;
+
+	err = get_args(&argc, &argv);
+	if (err < 0 || argc != 1) {
+		return_error("logprint() - Error getting arguments");
+		return -1;
+	}
+
+	print_log(LOG_NOTICE, "%s", argv[0]);
+
+	return 0;
+}
+
+static const char *help_command(const char *cmd)
+{
+	int i = find_command(cmd);
+
+	return i < 0 ? "Command not found\n" : commands[i]->help;
+}
+
+static int lua_memory(int argc, const char **argv UNUSED)
+{
+	struct luamem_stats st;
+
+	if (argc != 0)
+		return -1;
+
+	command_printf("bytes %d\n", lua_gc(lua, LUA_GCCOUNT, 0) * 1024 +
+	                              lua_gc(lua, LUA_GCCOUNTB, 0));
+	command_printf("gc-cycles %u\n", gc_cycles);
+	if (!lua_pooled)
+		return 0;
+
+	luamem_stats(&st);
+	command_printf("peak %zu\n", st.peak);
+	command_printf("pooled %zu\n", st.pooled);
+	command_printf("allocations %llu\n", (unsigned long long)st.allocs);
+	command_printf("frees %llu\n", (unsigned long long)st.frees);
+	command_printf("pooled-allocations %llu\n",
+	               (unsigned long long)st.pool_allocs);
+
+	return 0;
+}
+
+static void pic_lua_close(void)
+{
+	lua_close(lua);
+}
+
+/**
+ * Create a Lua state with qcontrol's functions for the config, which is
+ * made current.
+ */
+static lua_State *new_lua_state(void)
+{
+	lua_State *L;
+	bool pooled;
+
+	L = lua_newstate(luamem_alloc, NULL);
+	pooled = L != NULL;
+	if (!L) {
+		/* LuaJIT on 64-bit only works with its own allocator */
+		print_log(LOG_INFO, "Using Lua's allocator");
+		L = lua_open();
+		if (!L)
+			return NULL;
+	}
+	lua = L;
+	lua_pooled = pooled;
+	luaL_openlibs(lua);
+
+	lua_register(lua, "register", register_module);
+	lua_register(lua, "piccmd", run_command_lua);
+	lua_register(lua, "logprint", script_print);
+	lua_register(lua, "confdir", confdir);
+	lua_register(lua, "settimer", settimer_lua);
+	lua_register(lua, "setinterval", setinterval_lua);
+	lua_register(lua, "canceltimer", canceltimer_lua);
+#ifdef HAVE_LUAJIT
+	if (luaL_dostring(lua, ffi_piccmd) != 0) {
+		print_log(LOG_WARNING, "FFI piccmd(): %s", lua_tostring(lua, -1));
+		lua_pop(lua, 1);
+	}
+#endif
+
+	return L;
+}
+
+/**
+ * Prepare for events once the config has been run.
+ */
+static void config_loaded(void)
+{
+	/* Commands and handlers are only registered by the config */
+	resolve_handlers();
+	if (index_commands() < 0)
+		print_log(LOG_WARNING, "Out of memory for the command index");
+
+	/* From now on garbage is collected by collect_idle() */
+	lua_gc(lua, LUA_GCCOLLECT, 0);
+	lua_gc(lua, LUA_GCSTOP, 0);
+	gc_live = lua_gc(lua, LUA_GCCOUNT, 0);
+	gc_cycle = false;
+}
+
+static int pic_lua_setup(lua_State **L UNUSED)
+{
+	int err;
+
+	if (!new_lua_state())
+		return -1;
+	lua_thread = pthread_self();
+	atexit(pic_lua_close);
+
+	err = state_init();
+	if (err < 0)
+		return err;
+	/* Before register() starts device threads which post to it */
+	err = events_init();
+	if (err < 0)
+		return err;
+	err = timers_init();
+	if (err < 0) {
+		print_log(LOG_ERR, "Error creating timer: %s", strerror(errno));
+		return err;
+	}
+	err = register_command("lua-memory", "Show the memory used by Lua",
+	                       "Show the memory used by Lua, one value per "
+	                       "line:\n\tNAME VALUE\n", lua_memory);
+	if (err < 0)
+		return err;
+
+	err = luacache_dofile(lua, configfilename);
+	if (err != 0) {
+		print_log(LOG_ERR, "%s", lua_tostring(lua, -1));
+		lua_pop(lua, 1);
+	}
+	restoring = false;
+	config_loaded();
+
+	return err;
+}
+
+/**
+ * Give clients a new instance, so that they fetch the command table again.
+ */
+static void new_instance(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	instance = now.tv_sec ^ now.tv_nsec ^ ((uint32_t)getpid() << 16);
+	responses_valid = false;
+	if (build_responses() < 0)
+		print_log(LOG_WARNING, "Out of memory for the prepared responses");
+}
+
+/**
+ * Run the config again in a new Lua state, which replaces the old one and
+ * its handlers once the config has run. Modules registered with the same
+ * arguments as before keep their devices and threads, the others are
+ * stopped or started after that. A config which does not compile or fails
+ * while running changes nothing.
+ */
+static void reload_config(void)
+{
+	lua_State *old = lua;
+	bool old_pooled = lua_pooled;
+	int refs[MAX_HANDLERS];
+	struct registration *r;
+	struct picmodule *m;
+	unsigned int i, n;
+	bool failed;
+
+	print_log(LOG_INFO, "Reloading %s", configfilename);
+	if (!new_lua_state()) {
+		print_log(LOG_ERR, "Out of memory for reloading the config");
+		return;
+	}
+	if (luacache_loadfile(lua, configfilename) != 0) {
+		print_log(LOG_ERR, "%s, keeping the old config",
+		          lua_tostring(lua, -1));
+		lua_close(lua);
+		lua = old;
+		lua_pooled = old_pooled;
+		return;
+	}
+
+	for (r = registrations; r; r = r->next) {
+		r->old = true;
+		r->kept = false;
+	}
+	/* The old state's references mean nothing to the new one */
+	n = handlercount;
+	for (i = 0; i < n; ++i) {
+		refs[i] = handlers[i].ref;
+		handlers[i].ref = LUA_NOREF;
+	}
+	timers_suspend();
+
+	reloading = true;
+	failed = lua_pcall(lua, 0, LUA_MULTRET, 0) != 0;
+	reloading = false;
+
+	if (failed) {
+		print_log(LOG_ERR, "%s, keeping the old config",
+		          lua_tostring(lua, -1));
+		lua_close(lua);
+		lua = old;
+		lua_pooled = old_pooled;
+		old = NULL;
+		for (i = 0; i < n; ++i)
+			handlers[i].ref = refs[i];
+		timers_resume();
+		while ((r = pending)) {
+			pending = r->next;
+			free_registration(r);
+		}
+	} else {
+		stop_registrations();
+	}
+	for (r = registrations; r; r = r->next)
+		r->old = false;
+	while ((r = pending)) {
+		pending = r->next;
+		r->next = NULL;
+		m = r->module;
+		if (start_registration(r) < 0)
+			print_log(LOG_ERR, "Error loading module %s", m->name);
+	}
+	config_loaded();
+	if (old)
+		lua_close(old);
+	new_instance();
+}
+
+static void timer_event(struct loop_watch *w UNUSED, uint32_t revents UNUSED)
+{
+	timers_expire(run_timer);
+}
+
+static void reload_event(struct loop_watch *w, uint32_t revents UNUSED)
+{
+	struct signalfd_siginfo si;
+	bool reload = false;
+
+	/* Several signals before we get here make one reload */
+	while (read(w->fd, &si, sizeof(si)) == sizeof(si))
+		reload = true;
+	if (reload)
+		reload_config();
+}
+
+static struct qcontrol *network_connect(void)
+{
+	struct qcontrol *q;
+
+	q = qcontrol_connect_timeout(PIC_SOCKET, client_timeout * 1000);
+	if (!q)
+		print_log(LOG_ERR, "Error connecting to socket: %s",
+		          strerror(errno));
+
+	return q;
+}
+
+/**
+ * Where the client keeps the daemon's command table between runs: in /run
+ * for root, otherwise in the user's runtime directory if there is one.
+ */
+static const char *command_cache(char *buf, size_t size)
+{
+	const char *dir = geteuid() == 0 ? "/run" : getenv("XDG_RUNTIME_DIR");
+
+	if (!dir || snprintf(buf, size, "%s/" COMMAND_CACHE, dir) >= (int)size)
+		return NULL;
+	return buf;
+}
+
+/**
+ * Make sure commands are sent by number, reusing the command table from
+ * the cache while the same daemon is running. Only fails if the daemon
+ * does not answer.
+ */
+static int network_commands(struct qcontrol *q)
+{
+	char buf[PATH_MAX];
+	const char *path = command_cache(buf, sizeof(buf));
+	int err;
+
+	if (path)
+		qcontrol_load_commands(q, path);
+	err = qcontrol_sync_commands(q);
+	if (err > 0 && path)
+		qcontrol_save_commands(q, path);
+	if (err < 0 && errno != EOPNOTSUPP && errno != EPROTO) {
+		print_log(LOG_ERR, "Error talking to server: %s",
+		          strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Exit status for a failed connection, timeouts are told apart so that
+ * scripts can retry them.
+ */
+static int network_error(void)
+{
+	return errno == ETIMEDOUT ? -ETIMEDOUT : -1;
+}
+
+static int network_send(int argc, const char **argv)
+{
+	struct qcontrol *q;
+	char *message;
+	int err, result;
+
+	q = network_connect();
+	if (!q)
+		return network_error();
+	if (network_commands(q) < 0) {
+		err = network_error();
+		qcontrol_close(q);
+		return err;
+	}
+
+	err = qcontrol_command(q, argc, argv, &result, &message);
+	if (err < 0) {
+		print_log(LOG_ERR, "Error talking to server: %s",
+		          strerror(errno));
+		err = network_error();
+	} else if (result == -ETIMEDOUT) {
+		print_log(LOG_ERR, "Server timed out before running %s",
+		          argv[0]);
+		err = result;
+	} else if (result < 0) {
+		print_log(LOG_ERR, "%s", message ? message : "");
+		err = result;
+	} else if (strcmp(argv[0], "--help") == 0 ||
+	           strcmp(argv[0], "-h") == 0) {
+		print_log(LOG_ERR, "\nAvailable commands are:\n%s",
+		          message ? message : "");
+		err = 1;
+	} else if (message) {
+		printf("%s", message);
+	}
+
+	free(message);
+	qcontrol_close(q);
+	return err;
+}
+
+/**
+ * Split a command line into commands at each BATCH_SEPARATOR argument.
+ * Returns the number of commands found.
+ */
+static int batch_split(int argc, const char **argv, struct batch_cmd **cmds)
+{
+	int i, start = 0, ncmds = 0;
+
+	*cmds = calloc(argc + 1, sizeof(struct batch_cmd));
+	if (!*cmds)
+		return -1;
+
+	for (i = 0; i <= argc; ++i) {
+		if (i < argc && strcmp(argv[i], BATCH_SEPARATOR) != 0)
+			continue;
+		if (i > start) {
+			(*cmds)[ncmds].argc = i - start;
+			(*cmds)[ncmds].argv = argv + start;
+			ncmds++;
+		}
+		start = i + 1;
+	}
+
+	return ncmds;
+}
+
+/**
+ * Split a line of a batch script into words, in place. Words are separated
+ * by whitespace unless enclosed in double quotes.
+ */
+static int batch_tokenize(char *line, const char ***argv)
+{
+	int argc = 0, size = 0;
+	char *p = line, *word;
+
+	*argv = NULL;
+	for (;;) {
+		while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+			p++;
+		if (*p == '\0' || *p == '#')
+			break;
+
+		if (*p == '"') {
+			word = ++p;
+			while (*p && *p != '"')
+				p++;
+		} else {
+			word = p;
+			while (*p && *p != ' ' && *p != '\t' &&
+			       *p != '\n' && *p != '\r')
+				p++;
+		}
+		if (*p)
+			*p++ = '\0';
+
+		if (argc == size) {
+			size += 4;
+			*argv = realloc(*argv, size * sizeof(char*));
+			if (!*argv)
+				return -1;
+		}
+		(*argv)[argc++] = word;
+	}
+
+	return argc;
+}
+
+/**
+ * Read a batch script, one command per line, from f. Blank lines and
+ * lines starting with '#' are ignored.
+ */
+static int batch_read(FILE *f, struct batch_cmd **cmds)
+{
+	int ncmds = 0, size = 0, argc;
+	const char **argv;
+	char *line = NULL;
+	size_t linesize = 0;
+
+	*cmds = NULL;
+	while (getline(&line, &linesize, f) >= 0) {
+		argc = batch_tokenize(line, &argv);
+		if (argc < 0)
+			return -1;
+		if (argc == 0)
+			continue;
+
+		if (ncmds == size) {
+			size += 8;
+			*cmds = realloc(*cmds, size * sizeof(struct batch_cmd));
+			if (!*cmds)
+				return -1;
+		}
+		(*cmds)[ncmds].argc = argc;
+		(*cmds)[ncmds].argv = argv;
+		ncmds++;
+
+		/* The words point into line, keep it */
+		line = NULL;
+		linesize = 0;
+	}
+	free(line);
+
+	return ncmds;
+}
+
+static void batch_report(struct batch_cmd *cmd, int err, const char *message)
+{
+	char desc[256];
+	int i, off = 0;
+
+	for (i = 0; i < cmd->argc && off < (int)sizeof(desc); ++i)
+		off += snprintf(desc + off, sizeof(desc) - off, "%s%s",
+		                i ? " " : "", cmd->argv[i]);
+
+	if (err == -ETIMEDOUT)
+		print_log(LOG_ERR, "%s: timed out", desc);
+	else if (err < 0)
+		print_log(LOG_ERR, "%s: failed\n%s", desc,
+		          message ? message : "");
+	else if (message)
+		print_log(LOG_INFO, "%s: ok\n%s", desc, message);
+	else
+		print_log(LOG_INFO, "%s: ok", desc);
+}
+
+static void batch_result(void *data, int result, const char *message)
+{
+	struct batch_cmd *cmd = data;
+
+	cmd->done = true;
+	cmd->result = result;
+	batch_report(cmd, result, message);
+}
+
+/**
+ * Send all commands over a single connection and report the result of
+ * each. Returns 0 if every command succeeded.
+ */
+static int network_send_batch(int ncmds, struct batch_cmd *cmds)
+{
+	int i, err = 0, failed = 0, answered = 0;
+	struct qcontrol *q;
+	long long deadline, left;
+
+	q = network_connect();
+	if (!q)
+		return network_error();
+	if (network_commands(q) < 0) {
+		err = network_error();
+		qcontrol_close(q);
+		return err;
+	}
+
+	for (i = 0; i < ncmds; ++i)
+		if (qcontrol_submit(q, cmds[i].argc, cmds[i].argv,
+		                    batch_result, &cmds[i]) < 0)
+			goto out;
+
+	/* Results may arrive in any order. The whole batch shares one
+	   timeout, as every command was sent with the same deadline */
+	deadline = monotonic_ms() + client_timeout * 1000LL;
+	while (answered < ncmds) {
+		left = deadline - monotonic_ms();
+		if (client_timeout > 0)
+			err = qcontrol_wait_timeout(q, left > 0 ? left : 0);
+		else
+			err = qcontrol_wait(q);
+		if (err < 0)
+			goto out;
+		while (answered < ncmds && cmds[answered].done)
+			answered++;
+	}
+
+out:
+	if (answered < ncmds) {
+		print_log(LOG_ERR, "Error talking to server: %s",
+		          strerror(errno));
+		err = network_error();
+	}
+	qcontrol_close(q);
+
+	for (answered = 0, i = 0; i < ncmds; ++i) {
+		if (!cmds[i].done)
+			continue;
+		answered++;
+		if (cmds[i].result < 0)
+			failed++;
+	}
+	if (answered < ncmds) {
+		print_log(LOG_ERR, "%d of %d commands were not answered",
+		          ncmds - answered, ncmds);
+		return err;
+	}
+	return failed ? 1 : 0;
+}
+
+static void print_event(void *data UNUSED, const struct qcontrol_event *ev)
+{
+	unsigned int i;
+
+	if (ev->dropped)
+		printf("(%u events dropped)\n", ev->dropped);
+	printf("%u %s", ev->time, ev->name);
+	for (i = 0; i < ev->nargs; ++i) {
+		if (ev->args[i].type == QCONTROL_EVENT_INT)
+			printf(" %d", ev->args[i].i);
+		else
+			printf(" %s", ev->args[i].s);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+/**
+ * Print one line for every event the server sees until it goes away.
+ */
+static int network_events(void)
+{
+	struct qcontrol *q;
+
+	q = network_connect();
+	if (!q)
+		return network_error();
+
+	/* The timeout covers subscribing, not the wait for events */
+	if (qcontrol_subscribe(q, print_event, NULL) == 0)
+		while (qcontrol_wait(q) == 0)
+			;
+	print_log(LOG_ERR, "Error talking to server: %s", strerror(errno));
+	qcontrol_close(q);
+
+	return -1;
+}
+
+static int run_batch_direct(int ncmds, struct batch_cmd *cmds)
+{
+	int i, err, failed = 0;
+
+	for (i = 0; i < ncmds; ++i) {
+		err = run_command(cmds[i].argv[0], cmds[i].argc - 1,
+		                  cmds[i].argv + 1);
+		batch_report(&cmds[i], err,
+		             err < 0 ? help_command(cmds[i].argv[0]) : NULL);
+		if (err < 0)
+			failed++;
+		run_queued();
+	}
+
+	return failed ? 1 : 0;
+}
+
+static int create_socket(const char *path, int type)
+{
+	int sock, err;
+	struct sockaddr_un name;
+
+	sock = socket(AF_UNIX, type, 0);
+	if (sock < 0) {
+		print_log(LOG_ERR, "Error creating socket: %s",
+		          strerror(errno));
+		return -1;
+	}
+
+	name.sun_family = AF_UNIX;
+	strcpy(name.sun_path, path);
+	err = bind(sock, (struct sockaddr*) &name, sizeof(struct sockaddr_un));
+	if (err != 0) {
+		err = connect(sock, (struct sockaddr*)&name,
+		              sizeof(struct sockaddr_un));
+		if (err < 0) {
+			err = unlink(path);
+			if (err != 0)
+				print_log(LOG_ERR, "Error deleting socket: %s",
+				          strerror(errno));
+			err = bind(sock, (struct sockaddr*) &name,
+			           sizeof(struct sockaddr_un));
+			if (err != 0)
+				print_log(LOG_ERR, "Error creating socket: %s",
+				          strerror(errno));
+		} else {
+			print_log(LOG_ERR, "server already running");
+			close(sock);
+			return -1;
+		}
+	}
+
+	err = listen(sock, 10);
+	if (err < 0) {
+		print_log(LOG_ERR, "Error listening on socket: %s",
+		          strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static int set_nonblock(int fd)
+{
+	int err = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	if (err < 0)
+		print_log(LOG_ERR, "Error setting nonblock: %s",
+		          strerror(errno));
+	return err;
+}
+
+/**
+ * Open the stream and seqpacket sockets into listen_watch and
+ * seqpacket_watch. Only the stream socket is required, its fd is -1 if
+ * systemd only passed a seqpacket one.
+ */
+static int open_sockets(void)
+{
+	listen_watch.fd = -1;
+	seqpacket_watch.fd = -1;
+
+#ifdef HAVE_SYSTEMD
+	int fd, fds;
+	/* When qcontrol gets socket-activated by systemd, fds is > 0 to indicate
+	 * that sockets were inherited which we can just use, i.e. we don’t need
+	 * to create and listen() on new sockets on our own. */
+	fds = sd_listen_fds(0);
+	if (fds < 0) {
+		print_log(LOG_ERR, "Error in sd_listen_fds()");
+		return -1;
+	}
+	if (fds > 0) {
+		socket_activated = true;
+		for (fd = SD_LISTEN_FDS_START;
+		     fd < SD_LISTEN_FDS_START + fds; ++fd) {
+			if (sd_is_socket(fd, AF_UNIX, SOCK_STREAM, 1) > 0)
+				listen_watch.fd = fd;
+			else if (sd_is_socket(fd, AF_UNIX, SOCK_SEQPACKET, 1) > 0)
+				seqpacket_watch.fd = fd;
+			else
+				print_log(LOG_WARNING, "Ignoring socket %d "
+				          "passed by systemd", fd);
+		}
+		if (listen_watch.fd < 0 && seqpacket_watch.fd < 0) {
+			print_log(LOG_ERR, "No usable socket from systemd");
+			return -1;
+		}
+	}
+#endif
+
+	if (!socket_activated) {
+		listen_watch.fd = create_socket(PIC_SOCKET, SOCK_STREAM);
+		if (listen_watch.fd < 0)
+			return -1;
+		/* Every client can fall back to the stream socket */
+		seqpacket_watch.fd = create_socket(PIC_SEQPACKET_SOCKET,
+		                                   SOCK_SEQPACKET);
+	}
+
+	if ((listen_watch.fd >= 0 && set_nonblock(listen_watch.fd) < 0) ||
+	    (seqpacket_watch.fd >= 0 && set_nonblock(seqpacket_watch.fd) < 0))
+		return -1;
+
+	return 0;
+}
+
+/* Bytes of output not yet sent */
+static size_t conn_pending(const struct connection *conn)
+{
+	return conn->out.len + conn->ref_len - conn->sent;
+}
+
+static void conn_drop_output(struct connection *conn)
 {
 	unsigned int i;
 
-	for (i = 0; i < commandcount; ++i)
-		if (strcmp(cmd, commands[i]->name) == 0)
-			return commands[i]->help;
+	for (i = 0; i < conn->nrefs; ++i)
+		prepared_put(conn->refs[i].from);
+	conn->nrefs = 0;
+	conn->ref_len = 0;
+	conn->sent = 0;
+	outbuf_reset(&conn->out);
+}
+
+static struct connection *conn_alloc(void)
+{
+	struct connection *conn = conn_pool;
+
+	if (conn) {
+		conn_pool = conn->next;
+		conn_pool_count--;
+	} else {
+		conn = malloc(sizeof(*conn));
+		if (!conn)
+			return NULL;
+	}
+
+	memset(conn, 0, offsetof(struct connection, in_storage));
+	msgbuf_init(&conn->in, QCONTROL_MAX_MESSAGE,
+	            conn->in_storage, sizeof(conn->in_storage));
+	outbuf_init(&conn->out, conn->out_storage, sizeof(conn->out_storage));
+
+	return conn;
+}
+
+static void conn_close(struct connection *conn)
+{
+	loop_del(&conn->watch);
+	close(conn->watch.fd);
+
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		connections = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+
+	if (conn->sub)
+		events_unsubscribe(conn->sub);
+	__atomic_store_n(&last_activity, monotonic_now(), __ATOMIC_RELAXED);
+	msgbuf_free(&conn->in);
+	conn_drop_output(conn);
+	if (conn_pool_count < CONN_POOL_SIZE) {
+		conn->next = conn_pool;
+		conn_pool = conn;
+		conn_pool_count++;
+	} else {
+		free(conn);
+	}
 
-	return "Command not found\n";
+	/* Resume accepting if we had hit the connection limit */
+	if (conncount-- == MAX_CONNECTIONS) {
+		if (listen_watch.fd >= 0)
+			loop_modify(&listen_watch, EPOLLIN);
+		if (seqpacket_watch.fd >= 0)
+			loop_modify(&seqpacket_watch, EPOLLIN);
+	}
+	if (conncount == 0)
+		timerfd_settime(sweep_watch.fd, 0, &(struct itimerspec){}, NULL);
 }
 
-static void pic_lua_close(void)
+/**
+ * Move events waiting for a subscribed connection into its output, as long
+ * as the client is keeping up.
+ */
+static void conn_pump_events(struct connection *conn)
 {
-	lua_close(lua);
+	struct outbuf *out = &conn->out;
+	struct event_record rec;
+	uint32_t dropped;
+	unsigned int i;
+	size_t start;
+
+	while (conn_pending(conn) < MAX_PENDING_OUT &&
+	       events_pop(conn->sub, &rec, &dropped)) {
+		start = proto_frame_begin(out, conn->sub_id,
+		                          QCONTROL_MSG_EVENT);
+		outbuf_put_u32(out, dropped);
+		outbuf_put_u32(out, rec.time);
+		outbuf_put_string(out, rec.name);
+		outbuf_put_u32(out, rec.nargs);
+		for (i = 0; i < rec.nargs; ++i) {
+			outbuf_put_u32(out, rec.args[i].type);
+			if (rec.args[i].type == QCONTROL_EVENT_INT)
+				outbuf_put_u32(out, rec.args[i].i);
+			else
+				outbuf_put_string(out, rec.args[i].s);
+		}
+		proto_frame_end(out, start);
+	}
 }
 
-static int pic_lua_setup(lua_State **L UNUSED)
+/* Add the part of the n bytes at p which is past *skip and within *len */
+static int iov_add(struct iovec *iov, int niov, const char *p, size_t n,
+                   size_t *skip, size_t *len)
 {
-	int err;
+	if (*skip >= n) {
+		*skip -= n;
+		return niov;
+	}
+	p += *skip;
+	n -= *skip;
+	*skip = 0;
+	if (n > *len)
+		n = *len;
+	if (n == 0)
+		return niov;
+
+	iov[niov].iov_base = (void *)p;
+	iov[niov].iov_len = n;
+	*len -= n;
+	return niov + 1;
+}
 
-	lua = lua_open();
-	atexit(pic_lua_close);
-	luaL_openlibs(lua);
+/**
+ * Fill iov with len bytes of the output of conn from offset pos on, which
+ * is out with the prepared responses of refs[] spliced in. Returns the
+ * number of entries used, at most 2 * CONN_REFS + 1.
+ */
+static int conn_iovec(const struct connection *conn, size_t pos, size_t len,
+                      struct iovec *iov)
+{
+	const struct out_ref *r;
+	unsigned int i;
+	size_t own = 0;
+	int niov = 0;
+
+	for (i = 0; i <= conn->nrefs && len > 0; ++i) {
+		r = i < conn->nrefs ? &conn->refs[i] : NULL;
+		niov = iov_add(iov, niov, conn->out.data + own,
+		               (r ? r->at : conn->out.len) - own, &pos, &len);
+		if (!r)
+			break;
+		own = r->at;
+		niov = iov_add(iov, niov, r->from->out.data + r->off, r->len,
+		               &pos, &len);
+	}
 
-	lua_register(lua, "register", register_module);
-	lua_register(lua, "piccmd", run_command_lua);
-	lua_register(lua, "logprint", script_print);
-	lua_register(lua, "confdir", confdir);
+	return niov;
+}
 
-	err = luaL_dofile(lua, configfilename);
-	if (err != 0) {
-		print_log(LOG_ERR, "%s", lua_tostring(lua, -1));
-		lua_pop(lua, 1);
+/**
+ * As proto_packet_len() for the pending output of conn, whose messages
+ * may be split between out and the prepared responses.
+ */
+static size_t conn_packet_len(const struct connection *conn)
+{
+	struct iovec iov[2 * CONN_REFS + 1];
+	size_t off = 0, msglen, len = conn_pending(conn), hello;
+	char first[sizeof(uint32_t)];
+	size_t got;
+	int i, niov;
+
+	hello = (conn->proto >= 4 ? 3 : 2) * sizeof(uint32_t);
+	while (len - off >= sizeof(first)) {
+		niov = conn_iovec(conn, conn->sent + off, sizeof(first), iov);
+		for (i = 0, got = 0; i < niov; got += iov[i++].iov_len)
+			memcpy(first + got, iov[i].iov_base, iov[i].iov_len);
+		msglen = proto_message_len(proto_get_u32(first), hello);
+		if (msglen > len - off || (off && off + msglen >
+		                           QCONTROL_MAX_MESSAGE))
+			break;
+		off += msglen;
 	}
 
-	return err;
+	return off ? off : len;
 }
 
-static int write_uint32(uint32_t i, char **buf, int off,  unsigned int *maxlen)
+/**
+ * Send as much pending output as possible and decide what to wait for next.
+ * Returns -1 if the connection was closed.
+ */
+static int conn_flush(struct connection *conn)
 {
-	unsigned int ilen = sizeof(uint32_t);
+	struct iovec iov[2 * CONN_REFS + 1];
+	struct msghdr msg = { .msg_iov = iov };
+	uint32_t events = 0;
+	size_t len;
+	ssize_t n;
+
+	if (conn->sub)
+		conn_pump_events(conn);
+
+	if (conn->out.error) {
+		print_log(LOG_ERR, "Out of memory for response");
+		conn_close(conn);
+		return -1;
+	}
+
+	while (conn_pending(conn) > 0) {
+		len = conn_pending(conn);
+		/* A version 1 response is the only message sent */
+		if (conn->seqpacket && conn->proto >= 2)
+			len = conn_packet_len(conn);
+		msg.msg_iovlen = conn_iovec(conn, conn->sent, len, iov);
+		n = sendmsg(conn->watch.fd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n < 0) {
+			print_log(LOG_ERR, "Error during send: %s",
+			          strerror(errno));
+			conn_close(conn);
+			return -1;
+		}
+		conn->sent += n;
+		conn->last_active = monotonic_now();
+	}
 
-	if ((unsigned int)off + ilen > *maxlen) {
-		*maxlen += ilen + MALLOC_SIZE;
-		*buf = realloc(*buf, *maxlen);
-		if (!buf)
+	if (conn_pending(conn) == 0) {
+		conn_drop_output(conn);
+		if (conn->closing) {
+			conn_close(conn);
 			return -1;
+		}
 	}
-	memcpy((*buf)+off, &i, ilen);
-	return off + ilen;
+
+	if (conn_pending(conn) > 0)
+		events |= EPOLLOUT;
+	if (!conn->closing && conn_pending(conn) < MAX_PENDING_OUT)
+		events |= EPOLLIN;
+	loop_modify(&conn->watch, events);
+
+	return 0;
+}
+
+/**
+ * Log how long it took from starting to answering the first request, which
+ * is what the client which socket activated the daemon waits for.
+ */
+static void log_first_response(void)
+{
+	static bool logged;
+	struct timespec now;
+	long ms;
+
+	if (logged)
+		return;
+	logged = true;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - start_time.tv_sec) * 1000 +
+	     (now.tv_nsec - start_time.tv_nsec) / 1000000;
+	print_log(LOG_INFO, "First response %ld ms after start", ms);
 }
 
-static int read_uint32(uint32_t *i, char *buf, int off)
+/**
+ * Whether a request deadline (CLOCK_MONOTONIC) has passed.
+ */
+static bool deadline_passed(const struct timespec *deadline)
 {
-	memcpy(i, buf+off, sizeof(uint32_t));
-	return off + sizeof(uint32_t);
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > deadline->tv_sec ||
+	       (now.tv_sec == deadline->tv_sec &&
+	        now.tv_nsec >= deadline->tv_nsec);
 }
 
-static int write_string(const char *str, char **buf, int off, unsigned int *maxlen)
+/**
+ * Run a request and queue its response. For protocol version 2 the response
+ * is framed and tagged with the request's id. cmd is the index of argv[0]
+ * in commands[] if the client sent it as a CALL, or -1, and option the
+ * option in argv[1] of a CALL_OPTION. A request whose deadline has passed
+ * is answered with -ETIMEDOUT without being run.
+ */
+static void conn_request(struct connection *conn, uint32_t id,
+                         const struct timespec *deadline, int cmd,
+                         const struct picoption *option,
+                         uint32_t argc, const char **argv)
 {
-	int slen = strlen(str) + 1;
+	struct outbuf *out = &conn->out;
+	size_t start = 0, skip;
+	int err;
 
-	if (off + sizeof(int) + slen > *maxlen) {
-		*maxlen += slen + MALLOC_SIZE;
-		*buf = realloc(*buf, *maxlen);
-		if (!buf)
-			return -1;
+	if (conn->proto >= 2)
+		start = proto_frame_begin(out, id, QCONTROL_MSG_RESPONSE);
+
+	if (deadline && deadline_passed(deadline)) {
+		/* The client has given up, don't touch the hardware for it */
+		print_log(LOG_WARNING, "Dropping expired request %s", argv[0]);
+		state_error(argv[0], argc-1, argv+1);
+		outbuf_put_u32(out, -ETIMEDOUT);
+	} else if (cmd < 0 && (strcmp(argv[0], "--help") == 0 ||
+	                       strcmp(argv[0], "-h") == 0)) {
+		/* Return the short helps. Version 1 sends them without a
+		   length */
+		outbuf_put_u32(out, 0);
+		skip = conn->proto >= 2 ? 0 : sizeof(uint32_t);
+		put_response(conn, shorthelp_off + skip, shorthelp_len - skip);
+	} else {
+		/* Run the command, collecting anything it prints */
+		if (cmd < 0)
+			cmd = find_command(argv[0]);
+		outbuf_init(&reply, reply_storage, sizeof(reply_storage));
+		command_out = &reply;
+		err = cmd < 0 ? -1 : call_command(cmd, option, argc-1, argv+1);
+		command_out = NULL;
+		outbuf_put_u32(out, err);
+		if (err < 0 && cmd < 0) {
+			put_response(conn, 0, notfound_len);
+		} else if (err < 0) {
+			put_response(conn, commands[cmd]->help_off,
+			             commands[cmd]->help_len);
+		} else if (reply.len > 0 && conn->proto >= 2) {
+			/* Version 1 clients would take it for the commands
+			   listed by --help */
+			outbuf_put(&reply, "", 1);
+			if (!reply.error)
+				outbuf_put_string(out, reply.data);
+		}
+		outbuf_reset(&reply);
 	}
-	off = write_uint32(slen, buf, off, maxlen);
-	memcpy((*buf)+off, str, slen);
-	return off+slen;
+
+	if (conn->proto >= 2)
+		conn_frame_end(conn, start);
+
+	log_first_response();
 }
 
-static int read_string(char **str, char *buf, int off)
+/**
+ * Send the command table, so that the client can use CALL, with the options
+ * for CALL_OPTION from version 5.
+ */
+static void conn_commands(struct connection *conn, uint32_t id)
 {
-	uint32_t len;
+	size_t start;
 
-	off = read_uint32(&len, buf, off);
-	*str = malloc(len);
-	memcpy(*str, buf+off, len);
-	return off+len;
+	start = proto_frame_begin(&conn->out, id, QCONTROL_MSG_COMMANDS);
+	if (conn->proto >= 5)
+		put_response(conn, options_table_off, options_table_len);
+	else
+		put_response(conn, table_off, table_len);
+	conn_frame_end(conn, start);
 }
 
-static int network_send(int argc, const char **argv)
+static void conn_stale(struct connection *conn, uint32_t id)
 {
-	int sock, err, i, off=0, rlen;
-	struct sockaddr_un remote;
-	unsigned int maxlen = MALLOC_SIZE;
-	char *buf, retbuf[MAX_NET_BUF], *errstr;
+	size_t start;
 
-	sock = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (sock < 0) {
-		print_log(LOG_ERR, "Error opening socket: %s", strerror(errno));
-		return -1;
-	}
+	start = proto_frame_begin(&conn->out, id, QCONTROL_MSG_RESPONSE);
+	outbuf_put_u32(&conn->out, -ESTALE);
+	proto_frame_end(&conn->out, start);
+}
 
-	remote.sun_family = AF_UNIX;
-	strcpy(remote.sun_path, PIC_SOCKET);
-	err = connect(sock, (struct sockaddr*)&remote,
-					sizeof(struct sockaddr_un));
-	if (err < 0) {
-		print_log(LOG_ERR, "Error connecting to socket: %s",
-		          strerror(errno));
+/**
+ * Handle a CALL frame. A call made with the table of another daemon
+ * instance, or for a command which does not exist, gets -ESTALE so that
+ * the client fetches the table again.
+ */
+static int conn_call(struct connection *conn, struct proto_frame *f)
+{
+	const char *argv[QCONTROL_MAX_ARGS];
+	struct timespec deadline;
+	uint32_t inst, cmd, argc;
+	int off;
+
+	off = proto_parse_call(f->payload, f->len, &deadline, &inst, &cmd);
+	if (off < 0 || f->len - off < sizeof(uint32_t))
+		return -1;
+	if (proto_get_u32(f->payload + off) == 0 &&
+	    f->len - off == sizeof(uint32_t))
+		argc = 0;
+	else if (proto_parse_args(f->payload + off, f->len - off, &argc,
+	                          argv + 1, QCONTROL_MAX_ARGS - 1)
+	         != (int)(f->len - off))
 		return -1;
-	}
 
-	buf = malloc(maxlen);
-	off = write_uint32(argc, &buf, off, &maxlen);
-	for (i = 0; i < argc; ++i) {
-		off = write_string(argv[i], &buf, off, &maxlen);
+	if (inst != instance || cmd >= commandcount) {
+		conn_stale(conn, f->id);
+		return 0;
 	}
 
-	send(sock, buf, off, 0);
-	free(buf);
-	rlen = read(sock, retbuf, MAX_NET_BUF);
-	if (rlen < 0) {
-		print_log(LOG_ERR, "Error during read: %s", strerror(errno));
+	argv[0] = commands[cmd]->name;
+	conn_request(conn, f->id, deadline.tv_sec || deadline.tv_nsec ?
+	             &deadline : NULL, cmd, NULL, argc + 1, argv);
+	return 0;
+}
+
+/**
+ * Handle a CALL_OPTION frame, which gets -ESTALE like a CALL when the
+ * command or the option is not there.
+ */
+static int conn_call_option(struct connection *conn, struct proto_frame *f)
+{
+	const struct picoption *o;
+	struct timespec deadline;
+	uint32_t inst, cmd, option, n;
+	const char *argv[2];
+
+	if (proto_parse_call_option(f->payload, f->len, &deadline, &inst,
+	                            &cmd, &option) < 0)
 		return -1;
-	}
 
-	off = 0;
-	off = read_uint32((uint32_t*)&err, retbuf, off);
-	if (err < 0) {
-		off = read_string(&errstr, retbuf, off);
-		print_log(LOG_ERR, "%s", errstr);
-	} else if (err == 0 && rlen > (int)sizeof(int)) {
-		print_log(LOG_ERR, "\nAvailable commands are:\n%s",
-		          retbuf + sizeof(int));
-		err = 1;
-	} else {
-		err = 0;
+	if (inst != instance || cmd >= commandcount ||
+	    !commands[cmd]->options) {
+		conn_stale(conn, f->id);
+		return 0;
+	}
+	for (n = 0; commands[cmd]->options[n].name && n <= option; ++n)
+		;
+	if (n <= option) {
+		conn_stale(conn, f->id);
+		return 0;
 	}
 
-	close(sock);
+	o = &commands[cmd]->options[option];
+	argv[0] = commands[cmd]->name;
+	argv[1] = o->name;
+	conn_request(conn, f->id, deadline.tv_sec || deadline.tv_nsec ?
+	             &deadline : NULL, cmd, o, 2, argv);
+	return 0;
+}
+
+/**
+ * Start sending events to the client, tagged with the id of the subscribe
+ * request. A connection may only subscribe once.
+ */
+static void conn_subscribe(struct connection *conn, uint32_t id)
+{
+	size_t start;
+	int err = -1;
+
+	if (!conn->sub) {
+		conn->sub = events_subscribe();
+		conn->sub_id = id;
+		if (conn->sub)
+			err = 0;
+	}
 
-	return err;
+	start = proto_frame_begin(&conn->out, id, QCONTROL_MSG_RESPONSE);
+	outbuf_put_u32(&conn->out, err);
+	proto_frame_end(&conn->out, start);
 }
 
-static int open_socket(void)
+/**
+ * Handle every complete message in the receive buffer. Returns -1 if the
+ * client sent something malformed.
+ */
+static int conn_parse(struct connection *conn)
 {
-	int sock, err;
-	struct sockaddr_un name;
+	const char *argv[QCONTROL_MAX_ARGS];
+	struct proto_frame frame;
+	struct timespec deadline;
+	uint32_t word, argc;
+	int used, off;
+
+	while (!conn->closing) {
+		const char *p = conn->in.data + conn->in.start;
+		size_t avail = conn->in.end - conn->in.start;
+
+		switch (conn->proto) {
+		case 0:
+			/* A version 1 request starts with argc, which can
+			   never be the magic number */
+			if (avail < sizeof(uint32_t))
+				return 0;
+			if (proto_get_u32(p) != QCONTROL_PROTO_MAGIC) {
+				conn->proto = 1;
+				break;
+			}
+			if (avail < 2 * sizeof(uint32_t))
+				return 0;
+			word = proto_get_u32(p + sizeof(uint32_t));
+			if (word < 2)
+				return -1;
+			conn->proto = word < QCONTROL_PROTO_VERSION ?
+			              word : QCONTROL_PROTO_VERSION;
+			conn->in.start += 2 * sizeof(uint32_t);
+
+			outbuf_put_u32(&conn->out, QCONTROL_PROTO_MAGIC);
+			outbuf_put_u32(&conn->out, conn->proto);
+			if (conn->proto >= 4)
+				outbuf_put_u32(&conn->out, instance);
+			break;
 
-#ifdef HAVE_SYSTEMD
-	int fds;
-	/* When qcontrol gets socket-activated by systemd, fds is > 0 to indicate
-	 * that a socket was inherited which we can just use, i.e. we don’t need to
-	 * create and listen() on a new socket on our own. */
-	fds = sd_listen_fds(0);
-	if (fds < 0) {
-		print_log(LOG_ERR, "Error in sd_listen_fds()");
-		return -1;
-	}
-	return SD_LISTEN_FDS_START;
-#endif
+		case 1:
+			used = proto_parse_args(p, avail, &argc, argv,
+			                        QCONTROL_MAX_ARGS);
+			if (used <= 0)
+				return used;
+			conn_request(conn, 0, NULL, -1, NULL, argc, argv);
+			conn->closing = true;
+			conn->in.start += used;
+			break;
 
-	sock = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (sock < 0) {
-		print_log(LOG_ERR, "Error creating socket: %s",
-		          strerror(errno));
-		return -1;
+		default:
+			used = proto_parse_frame(p, avail, &frame);
+			if (used <= 0)
+				return used;
+			if (frame.type == QCONTROL_MSG_SUBSCRIBE) {
+				conn_subscribe(conn, frame.id);
+			} else if (frame.type == QCONTROL_MSG_REQUEST &&
+			           proto_parse_args(frame.payload, frame.len,
+			                            &argc, argv,
+			                            QCONTROL_MAX_ARGS)
+			           == (int)frame.len) {
+				conn_request(conn, frame.id, NULL, -1, NULL,
+				             argc, argv);
+			} else if (frame.type == QCONTROL_MSG_REQUEST_DEADLINE &&
+			           conn->proto >= 3 &&
+			           (off = proto_parse_deadline(frame.payload,
+			                                       frame.len,
+			                                       &deadline)) > 0 &&
+			           proto_parse_args(frame.payload + off,
+			                            frame.len - off,
+			                            &argc, argv,
+			                            QCONTROL_MAX_ARGS)
+			           == (int)frame.len - off) {
+				conn_request(conn, frame.id, &deadline, -1,
+				             NULL, argc, argv);
+			} else if (frame.type == QCONTROL_MSG_COMMANDS &&
+			           conn->proto >= 4 && frame.len == 0) {
+				conn_commands(conn, frame.id);
+			} else if (frame.type == QCONTROL_MSG_CALL &&
+			           conn->proto >= 4) {
+				if (conn_call(conn, &frame) < 0)
+					return -1;
+			} else if (frame.type == QCONTROL_MSG_CALL_OPTION &&
+			           conn->proto >= 5) {
+				if (conn_call_option(conn, &frame) < 0)
+					return -1;
+			} else {
+				return -1;
+			}
+			conn->in.start += used;
+			break;
+		}
 	}
 
-	name.sun_family = AF_UNIX;
-	strcpy(name.sun_path, PIC_SOCKET);
-	err = bind(sock, (struct sockaddr*) &name, sizeof(struct sockaddr_un));
-	if (err != 0) {
-		err = connect(sock, (struct sockaddr*)&name,
-		              sizeof(struct sockaddr_un));
-		if (err < 0) {
-			err = unlink(PIC_SOCKET);
-			if (err != 0)
-				print_log(LOG_ERR, "Error deleting socket: %s",
-				          strerror(errno));
-			err = bind(sock, (struct sockaddr*) &name,
-			           sizeof(struct sockaddr_un));
-			if (err != 0)
-				print_log(LOG_ERR, "Error creating socket: %s",
-				          strerror(errno));
-		} else {
-			print_log(LOG_ERR, "server already running");
-			close(sock);
-			return -1;
+	return 0;
+}
+
+static void conn_read(struct connection *conn)
+{
+	ssize_t n;
+
+	for (;;) {
+		if (conn->seqpacket)
+			n = msgbuf_recv(&conn->in, conn->watch.fd);
+		else
+			n = msgbuf_read(&conn->in, conn->watch.fd);
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n < 0) {
+			print_log(LOG_ERR, "Error during read: %s",
+			          strerror(errno));
+			conn_close(conn);
+			return;
+		}
+		if (n == 0) {
+			/* The client has finished sending; answer anything it
+			   already asked before closing. A v1 client which
+			   sent nothing is probably just checking we're
+			   alive */
+			conn->closing = true;
+			break;
+		}
+		conn->last_active = monotonic_now();
+
+		if (conn_parse(conn) < 0 ||
+		    (conn->seqpacket && !conn->closing &&
+		     conn->in.start != conn->in.end)) {
+			print_log(LOG_ERR, "Dropping malformed request");
+			conn_close(conn);
+			return;
 		}
-	}
 
-	err = listen(sock, 10);
-	if (err < 0) {
-		print_log(LOG_ERR, "Error listening on socket: %s",
-		          strerror(errno));
-		return -1;
+		if (conn->closing || conn_pending(conn) >= MAX_PENDING_OUT)
+			break;
 	}
 
-	return sock;
+	conn_flush(conn);
 }
 
-static int network_listen(void)
+static void conn_event(struct loop_watch *w, uint32_t revents)
 {
-	int err, con, argc, off=0, i;
-	char **argv;
-	socklen_t remotelen;
-	char buf[MAX_NET_BUF], *rbuf;
-	int maxlen = MALLOC_SIZE;
-	struct sockaddr_un remote;
+	struct connection *conn = (struct connection *)w;
 
-	int sock = open_socket();
+	if (revents & EPOLLIN)
+		conn_read(conn);
+	else if (revents & (EPOLLOUT|EPOLLERR|EPOLLHUP))
+		conn_flush(conn);
+}
 
-	remotelen = sizeof(remote);
-	for (;;) {
-		con = accept(sock, (struct sockaddr*)&remote, &remotelen);
+static void listen_event(struct loop_watch *w, uint32_t revents UNUSED)
+{
+	struct connection *conn;
+	int con;
+
+	while (conncount < MAX_CONNECTIONS) {
+		con = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
 		if (con < 0) {
-			print_log(LOG_ERR, "Error accepting connection: %s",
-			          strerror(errno));
-			break;
+			if (errno != EAGAIN && errno != EINTR)
+				print_log(LOG_ERR,
+				          "Error accepting connection: %s",
+				          strerror(errno));
+			return;
 		}
-		err = read(con, buf, MAX_NET_BUF);
-		if (err < 0) {
-			print_log(LOG_ERR, "Error during read: %s",
-			          strerror(errno));
-			break;
-		} else if (err == 0) {
-			/* read nothing, probably just somebody checking we're
-			   alive */
+
+		conn = conn_alloc();
+		if (!conn) {
+			print_log(LOG_ERR, "Out of memory for connection");
 			close(con);
-			continue;
+			return;
+		}
+		conn->watch.fd = con;
+		conn->watch.events = EPOLLIN;
+		conn->seqpacket = w == &seqpacket_watch;
+		conn->watch.cb = conn_event;
+		conn->last_active = monotonic_now();
+		if (loop_add(&conn->watch) < 0) {
+			close(con);
+			free(conn);
+			return;
 		}
 
-		/* Process the arguments */
-		off = read_uint32((uint32_t*)&argc, buf, off);
-		argv = malloc(argc * sizeof(char*));
-		if (!argv) {
-			print_log(LOG_ERR, "read failed: %s", strerror(errno));
-			return -1;
+		conn->next = connections;
+		if (connections)
+			connections->prev = conn;
+		connections = conn;
+
+		if (conncount++ == 0) {
+			struct itimerspec its = {
+				.it_interval = { .tv_sec = CONN_TIMEOUT },
+				.it_value = { .tv_sec = CONN_TIMEOUT },
+			};
+			timerfd_settime(sweep_watch.fd, 0, &its, NULL);
 		}
-		for (i = 0; i < argc; ++i)
-			off = read_string(&argv[i], buf, off);
-		off = 0;
+	}
 
-		if (argc > 0 && (strcmp(argv[0], "--help") == 0
-		               ||strcmp(argv[0], "-h") == 0)) {
-			/* Return the short helps */
-			shorthelp_commands(&rbuf, &off);
-		} else {
-			/* Run the command */
-			err = run_command(argv[0], argc-1, (const char**)argv+1);
-			rbuf = malloc(maxlen);
-			off = write_uint32(err, &rbuf, off, (uint32_t*)&maxlen);
-			if (err < 0)
-				off = write_string(help_command(argv[0]), &rbuf,
-				                   off, (uint32_t*)&maxlen);
+	/* Leave further clients in the listen backlogs until a slot frees */
+	if (listen_watch.fd >= 0)
+		loop_modify(&listen_watch, 0);
+	if (seqpacket_watch.fd >= 0)
+		loop_modify(&seqpacket_watch, 0);
+}
+
+/**
+ * Events have been posted or published. Run the handlers of posted ones
+ * and pass everything on to subscribers.
+ */
+static void events_event(struct loop_watch *w UNUSED, uint32_t revents UNUSED)
+{
+	struct connection *conn, *next;
+
+	events_clear();
+	run_queued();
+
+	for (conn = connections; conn; conn = next) {
+		next = conn->next;
+		if (conn->sub)
+			conn_flush(conn);
+	}
+}
+
+/**
+ * Drop connections which have made no progress for CONN_TIMEOUT seconds
+ */
+static void sweep_event(struct loop_watch *w, uint32_t revents UNUSED)
+{
+	struct connection *conn, *next;
+	uint64_t expirations;
+	time_t now = monotonic_now();
+
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	for (conn = connections; conn; conn = next) {
+		next = conn->next;
+		/* Idle version 2 connections may stay open indefinitely */
+		if (conn->proto >= 2 && conn->in.start == conn->in.end &&
+		    conn_pending(conn) == 0)
+			continue;
+		if (now - conn->last_active >= CONN_TIMEOUT) {
+			print_log(LOG_WARNING, "Dropping stalled connection");
+			conn_close(conn);
 		}
-		send(con, rbuf, off, 0);
-		off = 0;
+	}
+}
+
+static void idle_arm(time_t seconds)
+{
+	struct itimerspec its = {
+		.it_value = { .tv_sec = seconds > 0 ? seconds : 1 },
+	};
+
+	timerfd_settime(idle_watch.fd, 0, &its, NULL);
+}
+
+/**
+ * Exit once there have been no clients, events or pending writes for
+ * idle_exit seconds. The state is saved in the status page for the next
+ * daemon systemd starts.
+ */
+static void idle_event(struct loop_watch *w, uint32_t revents UNUSED)
+{
+	uint64_t expirations;
+	time_t idle;
+
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	idle = monotonic_now() -
+	       __atomic_load_n(&last_activity, __ATOMIC_RELAXED);
+	/* Timers would not run again until the next daemon */
+	if (conncount > 0 || !wqueue_idle() || timers_active()) {
+		idle_arm(idle_exit);
+	} else if (idle < (time_t)idle_exit) {
+		idle_arm(idle_exit - idle);
+	} else {
+		print_log(LOG_INFO, "Idle for %u seconds, exiting", idle_exit);
+		idle_exited = true;
+		loop_exit();
+	}
+}
+
+static int network_listen(void)
+{
+	sigset_t mask;
+	int err;
 
+	err = open_sockets();
+	if (err < 0)
+		return -1;
 
-		for (i = 0; i < argc; ++i) {
-			free(argv[i]);
-			argv[i] = NULL;
+	sweep_watch.fd = timerfd_create(CLOCK_MONOTONIC,
+	                                TFD_NONBLOCK|TFD_CLOEXEC);
+	if (sweep_watch.fd < 0) {
+		print_log(LOG_ERR, "Error creating timer: %s",
+		          strerror(errno));
+		return -1;
+	}
+	sweep_watch.events = EPOLLIN;
+	sweep_watch.cb = sweep_event;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	reload_watch.fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (reload_watch.fd < 0) {
+		print_log(LOG_ERR, "Error creating signalfd: %s",
+		          strerror(errno));
+		return -1;
+	}
+	reload_watch.events = EPOLLIN;
+	reload_watch.cb = reload_event;
+
+	timer_watch.fd = timers_fd();
+	timer_watch.events = EPOLLIN;
+	timer_watch.cb = timer_event;
+
+	listen_watch.events = EPOLLIN;
+	listen_watch.cb = listen_event;
+	seqpacket_watch.events = EPOLLIN;
+	seqpacket_watch.cb = listen_event;
+
+	events_watch.fd = events_fd();
+	events_watch.events = EPOLLIN;
+	events_watch.cb = events_event;
+
+	/* Without the page the state can still be queried with "status" */
+	state_publish(STATUS_PAGE_PATH);
+
+	/* Only systemd can start us again once we have exited */
+	if (idle_exit && !socket_activated) {
+		print_log(LOG_WARNING,
+		          "Not socket activated, ignoring --idle-exit");
+		idle_exit = 0;
+	}
+	idle_watch.fd = -1;
+	if (idle_exit) {
+		idle_watch.fd = timerfd_create(CLOCK_MONOTONIC,
+		                               TFD_NONBLOCK|TFD_CLOEXEC);
+		if (idle_watch.fd < 0) {
+			print_log(LOG_ERR, "Error creating timer: %s",
+			          strerror(errno));
+			return -1;
 		}
-		free(argv);
-		argv = NULL;
-		free(rbuf);
-		rbuf = NULL;
-		close(con);
+		idle_watch.events = EPOLLIN;
+		idle_watch.cb = idle_event;
+		last_activity = monotonic_now();
+		idle_arm(idle_exit);
 	}
 
-	close(sock);
-	unlink(PIC_SOCKET);
+	err = loop_init();
+	if (err == 0)
+		err = loop_add(&events_watch);
+	if (err == 0)
+		err = loop_add(&sweep_watch);
+	if (err == 0)
+		err = loop_add(&reload_watch);
+	if (err == 0)
+		err = loop_add(&timer_watch);
+	if (err == 0 && listen_watch.fd >= 0)
+		err = loop_add(&listen_watch);
+	if (err == 0 && seqpacket_watch.fd >= 0)
+		err = loop_add(&seqpacket_watch);
+	if (err == 0 && idle_exit)
+		err = loop_add(&idle_watch);
+	if (err == 0)
+		err = wqueue_start();
+	loop_idle(collect_idle);
+	if (err == 0)
+		err = loop_run();
+	wqueue_stop();
+
+	while (connections)
+		conn_close(connections);
+	while (conn_pool) {
+		struct connection *conn = conn_pool;
+
+		conn_pool = conn->next;
+		free(conn);
+	}
+	state_unpublish(idle_exited);
+	if (idle_watch.fd >= 0)
+		close(idle_watch.fd);
+	close(sweep_watch.fd);
+	close(reload_watch.fd);
+	if (listen_watch.fd >= 0)
+		close(listen_watch.fd);
+	if (seqpacket_watch.fd >= 0)
+		close(seqpacket_watch.fd);
+	/* Sockets from systemd stay to start the next daemon */
+	if (!socket_activated) {
+		unlink(PIC_SOCKET);
+		if (seqpacket_watch.fd >= 0)
+			unlink(PIC_SEQPACKET_SOCKET);
+	}
 
-	return 0;
+	return err;
 }
 
 static int start_daemon(bool daemon_mode)
 {
+	sigset_t mask;
 	int err;
 	pid_t pid, sid;
 
@@ -682,9 +3114,24 @@ static int start_daemon(bool daemon_mode)
 	}
 
 	print_log(LOG_INFO, "qcontrol " QCONTROL_VERSION " daemon starting.");
+	if (state_restore(STATUS_PAGE_PATH) > 0) {
+		print_log(LOG_INFO, "Restored the state of the previous daemon");
+		restoring = true;
+	}
+	/* SIGHUP reloads the config through reload_watch. Blocked before
+	   the modules start their threads, which inherit the mask */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
 	err = pic_lua_setup(&lua);
 	if (err != 0)
 		return -1;
+
+	/* Differs between daemons, so clients notice the command table may
+	   have changed */
+	new_instance();
+
 	err = network_listen();
 
 	if (daemon_mode == true)
@@ -701,20 +3148,28 @@ int main(int argc, char **argv)
 		MODE_CLIENT,
 		MODE_DIRECT,
 	} mode = MODE_CLIENT;
-	bool help = false;
+	bool help = false, batch = false, events = false;
+	struct batch_cmd *cmds = NULL;
+	int ncmds = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
 
 	while (1) {
 		struct option long_options[] = {
+			{"batch",       no_argument,       0, 'b' },
 			{"config",      required_argument, 0, 'c' },
 			{"daemon",      no_argument,       0, 'd' },
 			{"foreground",  no_argument,       0, 'f' },
 			{"direct",      no_argument,       0, 1  },
+			{"events",      no_argument,       0, 2  },
 			{"help",        no_argument,       0, 'h' },
+			{"idle-exit",   required_argument, 0, 3  },
+			{"timeout",     required_argument, 0, 't' },
 			{"version",     no_argument,       0, 'V' },
 			{0, 0, 0, 0}
 		};
 
-		int opt = getopt_long(argc, argv, "c:dfhV",
+		int opt = getopt_long(argc, argv, "bc:dfht:V",
 				      long_options, NULL);
 
 		if (opt == -1)
@@ -722,10 +3177,14 @@ int main(int argc, char **argv)
 
 		switch (opt) {
 		case 1:   mode = MODE_DIRECT;            break;
+		case 2:   events = true;                 break;
+		case 3:   idle_exit = atoi(optarg);      break;
+		case 'b': batch = true;                  break;
 		case 'c': configfilename = optarg;       break;
 		case 'd': mode = MODE_SERVER_DAEMON;     break;
 		case 'f': mode = MODE_SERVER_FOREGROUND; break;
 		case 'h': help = 1;                      break;
+		case 't': client_timeout = atoi(optarg); break;
 		case 'V': printf("%s", version);         return 0;
 		case '?':                                break;
 		}
@@ -735,6 +3194,31 @@ int main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (mode == MODE_CLIENT && events && !help) {
+		if (argc > 0 || batch) {
+			print_log(LOG_ERR, "--events does not take a command");
+			return -1;
+		}
+		return network_events();
+	}
+
+	if (mode == MODE_CLIENT || mode == MODE_DIRECT) {
+		if (batch && argc > 0) {
+			print_log(LOG_ERR, "--batch does not take a command");
+			return -1;
+		}
+		if (batch)
+			ncmds = batch_read(stdin, &cmds);
+		else
+			ncmds = batch_split(argc, (const char **)argv, &cmds);
+		if (ncmds < 0) {
+			print_log(LOG_ERR, "Error reading commands");
+			return -1;
+		}
+		if (!batch && ncmds == 0)
+			help = true;
+	}
+
 	switch (mode) {
 	case MODE_SERVER_DAEMON:
 	case MODE_SERVER_FOREGROUND:
@@ -747,22 +3231,28 @@ int main(int argc, char **argv)
 
 	case MODE_CLIENT:
 		/* Send the command to the server */
-		if (help || argc == 0) {
+		if (help) {
 			printf("%s", usage);
 			return network_send(1, &help_arg);
+		} else if (batch || ncmds > 1) {
+			return network_send_batch(ncmds, cmds);
 		} else {
-			return network_send(argc, (const char **)argv);
+			return network_send(cmds[0].argc, cmds[0].argv);
 		}
 
 	case MODE_DIRECT:
 		pic_lua_setup(&lua);
-		if (help || argc == 0) {
+		if (help) {
 			printf("%s", usage);
 			shorthelp_commands_direct();
 			return 0;
+		} else if (batch || ncmds > 1) {
+			return run_batch_direct(ncmds, cmds);
 		} else {
 			/* Execute a single command and terminate */
-			return run_command_direct(argv[0], argc - 1, (const char **)(argv + 1));
+			return run_command_direct(cmds[0].argv[0],
+			                          cmds[0].argc - 1,
+			                          cmds[0].argv + 1);
 		}
 	}
 
@@ -21,6 +21,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <termios.h>
 #include <string.h>
 #include <syslog.h>
@@ -30,8 +31,21 @@
 
 #include "picmodule.h"
 #include "qnap-pic.h"
+#include "wqueue.h"
+
+/* Write queue classes, a later write replaces a queued one of its class */
+enum {
+	QNAP_WQ_POWERLED = WQUEUE_BARRIER + 1,
+	QNAP_WQ_STATUSLED,
+	QNAP_WQ_USBLED,
+	QNAP_WQ_AUTOPOWER,
+	QNAP_WQ_FANSPEED,
+	QNAP_WQ_EUP,
+	QNAP_WQ_RTC,
+};
 
 static int serial;
+static struct wqueue *wqueue;
 static struct termios oldtio, newtio;
 static pthread_t qnap_thread;
 
@@ -55,13 +69,9 @@ int qnap_serial_read(unsigned char *buf, int len)
 	return err;
 }
 
-int qnap_serial_write(unsigned char *buf, int len)
+int qnap_serial_write(int class, const unsigned char *buf, int len)
 {
-	int err;
-
-	err = write(serial, buf, len);
-
-	return err;
+	return wqueue_write(wqueue, class, buf, len);
 }
 
 static void *serial_poll(void *data)
@@ -73,8 +83,12 @@ static void *serial_poll(void *data)
 	FD_ZERO(&rset);
 	FD_SET(serial, &rset);
 
+	/* Only cancelled by qnap_serial_close() while waiting in select() */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 		err = select(serial + 1, &rset, NULL, NULL, NULL);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 		if (err <= 0) {
 			FD_SET(serial, &rset);
 			continue;
@@ -133,261 +147,336 @@ int qnap_serial_open(char *device)
 		return -1;
 	}
 
+	wqueue = wqueue_new("qnap-pic", serial);
+	if (!wqueue)
+		return -1;
+
 	return 0;
 }
 
 void qnap_serial_close(void)
 {
+	pthread_cancel(qnap_thread);
+	pthread_join(qnap_thread, NULL);
+	wqueue_free(wqueue);
+	wqueue = NULL;
 	tcsetattr(serial, TCSANOW, &oldtio);
 	close(serial);
 }
 
-static int qnap_cmd_powerled(int argc, const char **argv)
+static const struct picoption qnap_powerled_options[] = {
+	{ "on",		QNAP_PICCMD_POWER_LED_ON },
+	{ "off",	QNAP_PICCMD_POWER_LED_OFF },
+	{ "1hz",	QNAP_PICCMD_POWER_LED_1HZ },
+	{ "2hz",	QNAP_PICCMD_POWER_LED_2HZ },
+	{ NULL }
+};
+
+static const struct picoption qnap_statusled_options[] = {
+	{ "red2hz",	QNAP_PICCMD_STATUS_RED_2HZ },
+	{ "green2hz",	QNAP_PICCMD_STATUS_GREEN_2HZ },
+	{ "greenon",	QNAP_PICCMD_STATUS_GREEN_ON },
+	{ "redon",	QNAP_PICCMD_STATUS_RED_ON },
+	{ "greenred2hz", QNAP_PICCMD_STATUS_BOTH_2HZ },
+	{ "off",	QNAP_PICCMD_STATUS_OFF },
+	{ "green1hz",	QNAP_PICCMD_STATUS_GREEN_1HZ },
+	{ "red1hz",	QNAP_PICCMD_STATUS_RED_1HZ },
+	{ "greenred1hz", QNAP_PICCMD_STATUS_BOTH_1HZ },
+	{ NULL }
+};
+
+static const struct picoption qnap_usbled_options[] = {
+	{ "on",		QNAP_PICCMD_USB_LED_ON },
+	{ "8hz",	QNAP_PICCMD_USB_LED_8HZ },
+	{ "off",	QNAP_PICCMD_USB_LED_OFF },
+	{ NULL }
+};
+
+static const struct picoption qnap_autopower_options[] = {
+	{ "on",		QNAP_PICCMD_AUTOPOWER_ON },
+	{ "off",	QNAP_PICCMD_AUTOPOWER_OFF },
+	{ NULL }
+};
+
+static const struct picoption qnap_buzzer_options[] = {
+	{ "short",	QNAP_PICCMD_BUZZER_SHORT },
+	{ "long",	QNAP_PICCMD_BUZZER_LONG },
+	{ NULL }
+};
+
+static const struct picoption qnap_fanspeed_options[] = {
+	{ "stop",	QNAP_PICCMD_FAN_STOP },
+	{ "silence",	QNAP_PICCMD_FAN_SILENCE },
+	{ "low",	QNAP_PICCMD_FAN_LOW },
+	{ "medium",	QNAP_PICCMD_FAN_MEDIUM },
+	{ "high",	QNAP_PICCMD_FAN_HIGH },
+	{ "full",	QNAP_PICCMD_FAN_FULL },
+	{ NULL }
+};
+
+static const struct picoption qnap_watchdog_options[] = {
+	{ "off",	QNAP_PICCMD_WDT_OFF },
+	{ NULL }
+};
+
+static const struct picoption qnap_wol_options[] = {
+	{ "on",		QNAP_PICCMD_WOL_ENABLE },
+	{ "off",	QNAP_PICCMD_WOL_DISABLE },
+	{ NULL }
+};
+
+static const struct picoption qnap_eup_options[] = {
+	{ "on",		QNAP_PICCMD_EUP_ENABLE },
+	{ "off",	QNAP_PICCMD_EUP_DISABLE },
+	{ NULL }
+};
+
+static const struct picoption qnap_rtc_options[] = {
+	{ "on",		QNAP_PICCMD_RTC_ENABLE },
+	{ "off",	QNAP_PICCMD_RTC_DISABLE },
+	{ NULL }
+};
+
+static int qnap_cmd_powerled(const struct picoption *option)
 {
-	unsigned char code = 0;
-
-	if (argc != 1)
-		return -1;
-
-	if (strcmp(argv[0], "on") == 0)
-		code = QNAP_PICCMD_POWER_LED_ON;
-	else if (strcmp(argv[0], "1hz") == 0)
-		code = QNAP_PICCMD_POWER_LED_1HZ;
-	else if (strcmp(argv[0], "2hz") == 0)
-		code = QNAP_PICCMD_POWER_LED_2HZ;
-	else if (strcmp(argv[0], "off") == 0)
-		code = QNAP_PICCMD_POWER_LED_OFF;
-	else
-		return -1;
-
-	return qnap_serial_write(&code, 1);
+	return qnap_serial_write(QNAP_WQ_POWERLED, &option->code, 1);
 }
 
-static int qnap_cmd_statusled(int argc, const char **argv)
+static int qnap_cmd_statusled(const struct picoption *option)
 {
-	unsigned char code = 0;
-
-	if (argc != 1)
-		return -1;
-
-	if (strcmp(argv[0], "red2hz") == 0)
-		code = QNAP_PICCMD_STATUS_RED_2HZ;
-	else if (strcmp(argv[0], "green2hz") == 0)
-		code = QNAP_PICCMD_STATUS_GREEN_2HZ;
-	else if (strcmp(argv[0], "greenon") == 0)
-		code = QNAP_PICCMD_STATUS_GREEN_ON;
-	else if (strcmp(argv[0], "redon") == 0)
-		code = QNAP_PICCMD_STATUS_RED_ON;
-	else if (strcmp(argv[0], "greenred2hz") == 0)
-		code = QNAP_PICCMD_STATUS_BOTH_2HZ;
-	else if (strcmp(argv[0], "off") == 0)
-		code = QNAP_PICCMD_STATUS_OFF;
-	else if (strcmp(argv[0], "green1hz") == 0)
-		code = QNAP_PICCMD_STATUS_GREEN_1HZ;
-	else if (strcmp(argv[0], "red1hz") == 0)
-		code = QNAP_PICCMD_STATUS_RED_1HZ;
-	else if (strcmp(argv[0], "greenred1hz") == 0)
-		code = QNAP_PICCMD_STATUS_BOTH_1HZ;
-	else
-		return -1;
-
-	return qnap_serial_write(&code, 1);
+	return qnap_serial_write(QNAP_WQ_STATUSLED, &option->code, 1);
 }
 
-static int qnap_cmd_usbled(int argc, const char **argv)
+static int qnap_cmd_usbled(const struct picoption *option)
 {
-	unsigned char code = 0;
-
-	if (argc != 1)
-		return -1;
-
-	if (strcmp(argv[0], "on") == 0)
-		code = QNAP_PICCMD_USB_LED_ON;
-	else if (strcmp(argv[0], "8hz") == 0)
-		code = QNAP_PICCMD_USB_LED_8HZ;
-	else if (strcmp(argv[0], "off") == 0)
-		code = QNAP_PICCMD_USB_LED_OFF;
-	else
-		return -1;
-
-	return qnap_serial_write(&code, 1);
+	return qnap_serial_write(QNAP_WQ_USBLED, &option->code, 1);
 }
 
-static int qnap_cmd_autopower(int argc, const char **argv)
+static int qnap_cmd_autopower(const struct picoption *option)
 {
-	unsigned char code = 0;
-
-	if (argc != 1)
-		return -1;
-
-	if (strcmp(argv[0], "on") == 0)
-		code = QNAP_PICCMD_AUTOPOWER_ON;
-	else if (strcmp(argv[0], "off") == 0)
-		code = QNAP_PICCMD_AUTOPOWER_OFF;
-	else
-		return -1;
-
-	return qnap_serial_write(&code, 1);
+	return qnap_serial_write(QNAP_WQ_AUTOPOWER, &option->code, 1);
 }
 
-static int qnap_cmd_buzzer(int argc, const char **argv)
+static int qnap_cmd_buzzer(const struct picoption *option)
 {
-	unsigned char code = 0;
-
-	if (argc != 1)
-		return -1;
-
-	if (strcmp(argv[0], "short") == 0)
-		code = QNAP_PICCMD_BUZZER_SHORT;
-	else if (strcmp(argv[0], "long") == 0)
-		code = QNAP_PICCMD_BUZZER_LONG;
-	else
-		return -1;
-
-	return qnap_serial_write(&code, 1);
+	return qnap_serial_write(WQUEUE_BARRIER, &option->code, 1);
 }
 
-static int qnap_cmd_fanspeed(int argc, const char **argv)
+static int qnap_cmd_fanspeed(const struct picoption *option)
 {
-	unsigned char code = 0;
-
-	if (argc != 1)
-		return -1;
-
-	if (strcmp(argv[0], "stop") == 0)
-		code = QNAP_PICCMD_FAN_STOP;
-	else if (strcmp(argv[0], "silence") == 0)
-		code = QNAP_PICCMD_FAN_SILENCE;
-	else if (strcmp(argv[0], "low") == 0)
-		code = QNAP_PICCMD_FAN_LOW;
-	else if (strcmp(argv[0], "medium") == 0)
-		code = QNAP_PICCMD_FAN_MEDIUM;
-	else if (strcmp(argv[0], "high") == 0)
-		code = QNAP_PICCMD_FAN_HIGH;
-	else if (strcmp(argv[0], "full") == 0)
-		code = QNAP_PICCMD_FAN_FULL;
-	else
-		return -1;
-
-	return qnap_serial_write(&code, 1);
+	return qnap_serial_write(QNAP_WQ_FANSPEED, &option->code, 1);
 }
 
-static int qnap_cmd_watchdog(int argc, const char **argv)
+static int qnap_cmd_watchdog(const struct picoption *option)
 {
-	unsigned char code = 0;
+	return qnap_serial_write(WQUEUE_BARRIER, &option->code, 1);
+}
 
-	if (argc != 1)
-		return -1;
-	if (strcmp(argv[0], "off") == 0)
-		code = QNAP_PICCMD_WDT_OFF;
-	else
-		return -1;
+static int qnap_cmd_eup(const struct picoption *option)
+{
+	return qnap_serial_write(QNAP_WQ_EUP, &option->code, 1);
+}
 
-	return qnap_serial_write(&code, 1);
+static int qnap_cmd_rtc(const struct picoption *option)
+{
+	return qnap_serial_write(QNAP_WQ_RTC, &option->code, 1);
 }
 
-static int qnap_cmd_eup(int argc, const char **argv)
+static int qnap_cmd_wol(const struct picoption *option)
 {
-	unsigned char code = 0;
+	unsigned char code[2] = { option->code, QNAP_PICCMD_EUP_DISABLE };
 
-	if (argc != 1)
-		return -1;
+	/* EUP turns the device in such a deep power-saving
+	 * mode that WOL does not work. Therefore, in order
+	 * to have WOL turned on, we also disable EUP. */
+	if (option->code == QNAP_PICCMD_WOL_ENABLE)
+		return qnap_serial_write(WQUEUE_BARRIER, code, 2);
 
-	if (strcmp(argv[0], "on") == 0)
-		code = QNAP_PICCMD_EUP_ENABLE;
-	else if (strcmp(argv[0], "off") == 0)
-		code = QNAP_PICCMD_EUP_DISABLE;
-	else
-		return -1;
-
-	return qnap_serial_write(&code, 1);
+	return qnap_serial_write(WQUEUE_BARRIER, code, 1);
 }
 
-static int qnap_cmd_rtc(int argc, const char **argv)
+/* Fan curve set by the "fancurve" command. Level i runs the fan at
+   fan_speed[i], the next level is chosen above fan_up[i] and the previous
+   one below fan_down[i - 1]. The curve is used by the serial thread and
+   changed by the main loop */
+#define QNAP_FAN_LEVELS 6
+
+static pthread_mutex_t fan_lock = PTHREAD_MUTEX_INITIALIZER;
+static const struct picoption *fan_speed[QNAP_FAN_LEVELS];
+static int fan_down[QNAP_FAN_LEVELS - 1], fan_up[QNAP_FAN_LEVELS - 1];
+static int fan_levels;		/* 0 while Lua's temp() decides */
+static int fan_level = -1;	/* -1 until the first temperature */
+static int fan_temp = -1;
+static int level_handler;	/* fan_level(), told of new levels */
+
+int qnap_fan_temp(int handler, int temp)
 {
-	unsigned char code = 0;
+	const struct picoption *speed = NULL;
+	const char *arg;
+	int level;
+
+	pthread_mutex_lock(&fan_lock);
+	fan_temp = temp;
+	if (!fan_levels) {
+		pthread_mutex_unlock(&fan_lock);
+		return call_handler(handler, temp);
+	}
+	level = fan_level < 0 ? 0 : fan_level;
+	while (level < fan_levels - 1 && temp > fan_up[level])
+		level++;
+	while (level > 0 && temp < fan_down[level - 1])
+		level--;
+	if (level != fan_level) {
+		speed = fan_speed[level];
+		arg = speed->name;
+		/* As piccmd("fanspeed"), so that the state cache follows */
+		if (queue_command("fanspeed", 1, &arg) < 0) {
+			print_log(LOG_ERR, "Failed to set the fan to %s",
+			          speed->name);
+			/* Try again with the next temperature */
+			speed = NULL;
+		} else {
+			fan_level = level;
+		}
+	}
+	pthread_mutex_unlock(&fan_lock);
 
-	if (argc != 1)
-		return -1;
+	/* The curve takes the place of temp(), not of the reading */
+	record_handler(handler, temp);
+	if (speed)
+		return call_handler(level_handler, temp, speed->name);
+	return 0;
+}
 
-	if (strcmp(argv[0], "on") == 0)
-		code = QNAP_PICCMD_RTC_ENABLE;
-	else if (strcmp(argv[0], "off") == 0)
-		code = QNAP_PICCMD_RTC_DISABLE;
-	else
-		return -1;
+static const struct picoption *fan_find_speed(const char *name)
+{
+	const struct picoption *o;
 
-	return qnap_serial_write(&code, 1);
+	for (o = qnap_fanspeed_options; o->name; o++)
+		if (!strcmp(o->name, name))
+			return o;
+	return NULL;
 }
 
-static int qnap_cmd_wol(int argc, const char **argv)
+static int fan_show(void)
 {
-	unsigned char code[2];
-	int len;
-
-	if (argc != 1)
-		return -1;
+	int i;
+
+	command_printf("curve");
+	if (!fan_levels)
+		command_printf(" off");
+	for (i = 0; i < fan_levels; i++) {
+		if (i > 0)
+			command_printf(" %d:%d", fan_down[i - 1], fan_up[i - 1]);
+		command_printf(" %s", fan_speed[i]->name);
+	}
+	command_printf("\nspeed %s\ntemperature %d\n",
+		       fan_level < 0 ? "-" : fan_speed[fan_level]->name,
+		       fan_temp);
+	return 0;
+}
 
-	if (strcmp(argv[0], "on") == 0) {
-		/* EUP turns the device in such a deep power-saving
-		 * mode that WOL does not work. Therefore, in order
-		 * to have WOL turned on, we also disable EUP. */
-		code[0] = QNAP_PICCMD_WOL_ENABLE;
-		code[1] = QNAP_PICCMD_EUP_DISABLE;
-		len = 2;
-	} else if (strcmp(argv[0], "off") == 0) {
-		code[0] = QNAP_PICCMD_WOL_DISABLE;
-		len = 1;
-	} else
-		return -1;
+static int qnap_cmd_fancurve(int argc, const char **argv)
+{
+	const struct picoption *speed[QNAP_FAN_LEVELS];
+	int down[QNAP_FAN_LEVELS - 1], up[QNAP_FAN_LEVELS - 1];
+	int i, n, end;
+
+	if (argc == 0) {
+		pthread_mutex_lock(&fan_lock);
+		fan_show();
+		pthread_mutex_unlock(&fan_lock);
+		return 0;
+	}
+	if (argc == 1 && !strcmp(argv[0], "off")) {
+		n = 0;
+	} else {
+		if (argc % 2 == 0 || argc > 2 * QNAP_FAN_LEVELS - 1)
+			return -1;
+		n = argc / 2 + 1;
+		for (i = 0; i < n; i++) {
+			speed[i] = fan_find_speed(argv[2 * i]);
+			if (!speed[i])
+				return -1;
+			if (i == n - 1)
+				break;
+			end = 0;
+			if (sscanf(argv[2 * i + 1], "%d:%d%n",
+				   &down[i], &up[i], &end) != 2 ||
+			    argv[2 * i + 1][end] || down[i] > up[i])
+				return -1;
+			/* Otherwise a temperature could match several
+			   levels */
+			if (i > 0 && (down[i] <= down[i - 1] ||
+			              up[i] <= up[i - 1]))
+				return -1;
+		}
+	}
 
-	return qnap_serial_write(code, len);
+	pthread_mutex_lock(&fan_lock);
+	memcpy(fan_speed, speed, n * sizeof(*speed));
+	if (n > 1) {
+		memcpy(fan_down, down, (n - 1) * sizeof(*down));
+		memcpy(fan_up, up, (n - 1) * sizeof(*up));
+	}
+	fan_levels = n;
+	fan_level = -1;
+	pthread_mutex_unlock(&fan_lock);
+	return 0;
 }
 
-
 int qnap_register_commands(unsigned long features)
 {
-#define REGISTER1(feat,name,shorthelp,longhelp) do { \
+#define REGISTER1(feat,name,shorthelp,help) do { \
 	if (features & QNAP_PIC_FEATURE_##feat) { \
-		int err = register_command(#name, shorthelp, longhelp, qnap_cmd_##name); \
+		int err = register_option_command(#name, shorthelp, help, \
+		                                  qnap_##name##_options, \
+		                                  qnap_cmd_##name); \
 		if (err < 0) return err; \
 	} \
 } while(0)
 
 	REGISTER1(POWERLED, powerled, "Change the power LED",
-		  "Change the power LED, options are:\n"
-		  "\ton\n\toff\n\t1hz\n\t2hz\n");
+		  "Change the power LED");
 	REGISTER1(STATUSLED, statusled, "Change the status LED",
-		  "Change the status LED, options are:\n"
-		  "\tred2hz\n\tgreen2hz\n\tgreenon\n\tredon\n"
-		  "\tgreenred2hz\n\toff\n\tgreen1hz\n\tred1hz\n");
+		  "Change the status LED");
 	REGISTER1(USBLED, usbled, "Set the usbled",
-		  "Set the usbled, options are:\n"
-		  "\ton\n\t8hz\n\toff\n");
+		  "Set the usbled");
 	REGISTER1(AUTOPOWER, autopower, "Control the automatic power mechanism",
-		  "Control the automatic power mechanism, options are:\n"
-		  "\ton\n\toff\n");
+		  "Control the automatic power mechanism");
 	REGISTER1(BUZZER, buzzer, "Buzz",
-		  "Buzz, options are:\n"
-		  "\tshort\n\tlong\n");
+		  "Buzz");
 	REGISTER1(FANSPEED, fanspeed, "Set the fanspeed",
-		  "Set the fanspeed, options are:\n"
-		  "\tstop\n\tsilence\n\tlow\n\tmedium\n"
-		  "\thigh\n\tfull\n");
+		  "Set the fanspeed");
 	REGISTER1(WATCHDOG, watchdog, "Disable the PIC watchdog",
-		  "Watchdog options are:\n"
-		  "\toff");
+		  "Control the PIC watchdog");
 	REGISTER1(WOL, wol, "Control Wake on LAN",
-		 "Control Wake on LAN, options are:\n"
-		  "\ton\n\toff");
+		  "Control Wake on LAN");
 	REGISTER1(EUP, eup, "Control EUP (Energy-using Products) power saving",
-		  "Control EUP, options are:\n"
-		  "\ton\n\toff");
+		  "Control EUP");
 	REGISTER1(RTC, rtc, "Control RTC (real time clock)",
-		  "Control RTC, options are:\n"
-		  "\ton\n\toff");
+		  "Control RTC");
 
 #undef REGISTER1
+
+	if (features & QNAP_PIC_FEATURE_FANSPEED) {
+		int err = register_local_command("fancurve",
+			"Set the fan speed from the temperature",
+			"Set the fan speed from the temperature:\n"
+			"\tfancurve SPEED [DOWN:UP SPEED]...\n"
+			"Above UP the fan is set to the next SPEED, below DOWN\n"
+			"back to the previous one. Both DOWN and UP must rise\n"
+			"from one pair to the next. fan_level(temp, speed) is\n"
+			"called on each change instead of temp(temp) for each\n"
+			"temperature. \"fancurve off\" calls temp() again,\n"
+			"\"fancurve\" shows the curve, speed and temperature.\n",
+			qnap_cmd_fancurve);
+		if (err < 0)
+			return err;
+		level_handler = register_handler("fan_level", "%d%s");
+		if (level_handler < 0)
+			return -1;
+	}
 	return 0;
 }
 
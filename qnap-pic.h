@@ -23,7 +23,7 @@ typedef int (*qnap_serial_cb)(void);
 void qnap_serial_close(void);
 int qnap_serial_open(char *device);
 int qnap_serial_poll(qnap_serial_cb cb);
-int qnap_serial_write(unsigned char *buf, int len);
+int qnap_serial_write(int class, const unsigned char *buf, int len);
 int qnap_serial_read(unsigned char *buf, int len);
 
 enum {
@@ -44,6 +44,8 @@ enum {
 };
 
 int qnap_register_commands(unsigned long features);
+/* Passes a temperature to the fan curve, or to handler while there is none */
+int qnap_fan_temp(int handler, int temp);
 
 /*
  * QNAP_PICCMD_* -- Command codes sent to PIC
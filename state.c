@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "picmodule.h"
+#include "state.h"
+
+#define STATE_COMMAND_NAME	"status"
+
+/*
+ * The last value written by every command and reported by every event, so
+ * that the state of the device can be queried without asking the PIC or
+ * running Lua. Only the main loop updates it, device threads post their
+ * events to it.
+ */
+static struct state_entry entries[STATE_MAX_ENTRIES];
+static unsigned int nentries;
+static uint32_t ncommands, nevents, nerrors, nunhandled;
+static time_t error_time;
+static char last_error[STATE_VALUE_LEN];
+
+/* The status page, if the daemon is publishing one */
+static struct status_page *page;
+static char *page_path;
+
+static const char *kind_names[] = {
+	[STATE_COMMAND] = "command",
+	[STATE_EVENT]   = "event",
+};
+
+/**
+ * Find the entry for name, adding it if there is room.
+ */
+static struct state_entry *state_lookup(enum state_kind kind, const char *name)
+{
+	struct state_entry *e;
+	unsigned int i;
+
+	for (i = 0; i < nentries; ++i) {
+		e = &entries[i];
+		if (e->kind == kind && strcmp(e->name, name) == 0)
+			return e;
+	}
+
+	if (nentries == STATE_MAX_ENTRIES)
+		return NULL;
+	e = &entries[nentries++];
+	e->kind = kind;
+	snprintf(e->name, sizeof(e->name), "%s", name);
+
+	return e;
+}
+
+/**
+ * Copy the counters and, if e is given, that entry to the status page.
+ */
+static void page_update(struct state_entry *e)
+{
+	struct status_page_header *h = &page->header;
+	struct status_page_entry *pe;
+
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (e) {
+		pe = &page->entries[e - entries];
+		pe->kind = e->kind;
+		pe->count = e->count;
+		pe->time = e->time;
+		memcpy(pe->name, e->name, sizeof(pe->name));
+		memcpy(pe->value, e->value, sizeof(pe->value));
+	}
+	h->nentries = nentries;
+	h->commands = ncommands;
+	h->events = nevents;
+	h->errors = nerrors;
+	h->unhandled = nunhandled;
+	h->error_time = error_time;
+	memcpy(h->last_error, last_error, sizeof(h->last_error));
+
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void state_update(enum state_kind kind, const char *name,
+                         const char *value)
+{
+	struct state_entry *e;
+
+	if (kind == STATE_COMMAND)
+		ncommands++;
+	else
+		nevents++;
+	e = state_lookup(kind, name);
+	if (e) {
+		snprintf(e->value, sizeof(e->value), "%s", value);
+		e->time = time(NULL);
+		e->count++;
+		e->restored = false;
+	}
+	if (page)
+		page_update(e);
+}
+
+/**
+ * Append the arguments to the string in buf, separated by spaces.
+ */
+static void format_args(char *buf, size_t size, int argc, const char **argv)
+{
+	int i, off = strlen(buf);
+
+	for (i = 0; i < argc && off < (int)size; ++i)
+		off += snprintf(buf + off, size - off, "%s%s",
+		                off ? " " : "", argv[i]);
+}
+
+/**
+ * Record the arguments of a command which has been carried out.
+ */
+void state_command(const char *name, int argc, const char **argv)
+{
+	char value[STATE_VALUE_LEN] = "";
+
+	/* Querying the state is not part of it */
+	if (strcmp(name, STATE_COMMAND_NAME) == 0)
+		return;
+
+	format_args(value, sizeof(value), argc, argv);
+	state_update(STATE_COMMAND, name, value);
+}
+
+/**
+ * Record a command which failed.
+ */
+void state_error(const char *name, int argc, const char **argv)
+{
+	nerrors++;
+	error_time = time(NULL);
+	snprintf(last_error, sizeof(last_error), "%s", name);
+	format_args(last_error, sizeof(last_error), argc, argv);
+	if (page)
+		page_update(NULL);
+}
+
+/**
+ * Record the arguments of an event.
+ */
+void state_event(const struct event_record *rec)
+{
+	char value[STATE_VALUE_LEN] = "";
+	unsigned int i;
+	int off = 0;
+
+	for (i = 0; i < rec->nargs && off < (int)sizeof(value); ++i) {
+		if (rec->args[i].type == QCONTROL_EVENT_INT)
+			off += snprintf(value + off, sizeof(value) - off,
+			                "%s%d", i ? " " : "", rec->args[i].i);
+		else
+			off += snprintf(value + off, sizeof(value) - off,
+			                "%s%s", i ? " " : "", rec->args[i].s);
+	}
+
+	state_update(STATE_EVENT, rec->name, value);
+}
+
+/**
+ * Count an event which was dropped as the config has no function for it.
+ */
+void state_unhandled(void)
+{
+	nunhandled++;
+	if (page)
+		page_update(NULL);
+}
+
+/**
+ * Copy up to max entries into entries. Returns the number copied.
+ */
+unsigned int state_snapshot(struct state_entry *dst, unsigned int max)
+{
+	unsigned int n;
+
+	n = nentries < max ? nentries : max;
+	memcpy(dst, entries, n * sizeof(*dst));
+
+	return n;
+}
+
+/**
+ * Start mirroring the state into a status page at path. The page is
+ * built under a temporary name so readers never see it half initialised.
+ */
+int state_publish(const char *path)
+{
+	struct status_page *p;
+	char tmp[256];
+	unsigned int i;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+	fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0) {
+		print_log(LOG_ERR, "Error creating %s: %s", tmp,
+		          strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(*p)) < 0) {
+		print_log(LOG_ERR, "Error sizing %s: %s", tmp, strerror(errno));
+		goto err;
+	}
+	p = mmap(NULL, sizeof(*p), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		print_log(LOG_ERR, "Error mapping %s: %s", tmp,
+		          strerror(errno));
+		goto err;
+	}
+	close(fd);
+
+	p->header.magic = STATUS_PAGE_MAGIC;
+	p->header.version = STATUS_PAGE_VERSION;
+	p->header.size = sizeof(*p);
+	p->header.entry_offset = offsetof(struct status_page, entries);
+	p->header.entry_size = sizeof(p->entries[0]);
+	p->header.max_entries = STATUS_PAGE_ENTRIES;
+	p->header.pid = getpid();
+
+	page = p;
+	for (i = 0; i < nentries; ++i)
+		page_update(&entries[i]);
+	page_update(NULL);
+
+	if (rename(tmp, path) < 0) {
+		print_log(LOG_ERR, "Error renaming %s: %s", tmp,
+		          strerror(errno));
+		state_unpublish(false);
+		unlink(tmp);
+		return -1;
+	}
+	page_path = strdup(path);
+
+	return 0;
+
+err:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+/**
+ * Stop updating the status page. If keep is set the page is left behind,
+ * marked with a pid of 0, for state_restore() in the next daemon.
+ */
+void state_unpublish(bool keep)
+{
+	struct status_page *p;
+
+	p = page;
+	page = NULL;
+	if (p && keep) {
+		__atomic_store_n(&p->header.seq, p->header.seq + 1,
+		                 __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		p->header.pid = 0;
+		__atomic_store_n(&p->header.seq, p->header.seq + 1,
+		                 __ATOMIC_RELEASE);
+	}
+
+	if (p)
+		munmap(p, sizeof(*p));
+	if (page_path) {
+		if (!keep)
+			unlink(page_path);
+		free(page_path);
+		page_path = NULL;
+	}
+}
+
+/**
+ * Load the state saved by a daemon which exited with state_unpublish(true).
+ * Pages of running or killed daemons are ignored, as writes may have been
+ * lost. Returns the number of entries restored or -1.
+ */
+int state_restore(const char *path)
+{
+	struct status_page saved;
+	struct status_page_header *h = &saved.header;
+	struct status_page_entry *pe;
+	struct state_entry *e;
+	unsigned int i;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = read(fd, &saved, sizeof(saved));
+	close(fd);
+	if (n != sizeof(saved) || h->magic != STATUS_PAGE_MAGIC ||
+	    h->version != STATUS_PAGE_VERSION || h->size != sizeof(saved) ||
+	    h->pid != 0 || h->nentries > STATE_MAX_ENTRIES)
+		return -1;
+	/* kind indexes kind_names[] and name is looked up as a string */
+	for (i = 0; i < h->nentries; ++i) {
+		pe = &saved.entries[i];
+		if ((pe->kind != STATE_COMMAND && pe->kind != STATE_EVENT) ||
+		    !memchr(pe->name, '\0', sizeof(pe->name)))
+			return -1;
+	}
+
+	for (i = 0; i < h->nentries; ++i) {
+		pe = &saved.entries[i];
+		e = &entries[i];
+		e->kind = pe->kind;
+		e->count = pe->count;
+		e->time = pe->time;
+		snprintf(e->name, sizeof(e->name), "%.*s",
+		         (int)sizeof(pe->name) - 1, pe->name);
+		snprintf(e->value, sizeof(e->value), "%.*s",
+		         (int)sizeof(pe->value) - 1, pe->value);
+		e->restored = true;
+	}
+	nentries = h->nentries;
+	ncommands = h->commands;
+	nevents = h->events;
+	nerrors = h->errors;
+	nunhandled = h->unhandled;
+	error_time = h->error_time;
+	snprintf(last_error, sizeof(last_error), "%.*s",
+	         (int)sizeof(h->last_error) - 1, h->last_error);
+
+	return nentries;
+}
+
+/**
+ * Whether value holds exactly the arguments as format_args() joins them.
+ * A value filling its buffer may have been cut short, and empty arguments
+ * or ones holding spaces don't split back the same way, so none of those
+ * match.
+ */
+static bool args_match(const char *value, int argc, const char **argv)
+{
+	size_t len;
+	int i;
+
+	if (strlen(value) >= STATE_VALUE_LEN - 1)
+		return false;
+	for (i = 0; i < argc; ++i) {
+		if (!argv[i][0] || strchr(argv[i], ' '))
+			return false;
+		if (i > 0 && *value++ != ' ')
+			return false;
+		len = strlen(argv[i]);
+		if (strncmp(value, argv[i], len) != 0)
+			return false;
+		value += len;
+	}
+
+	return *value == '\0';
+}
+
+/**
+ * Whether a command with these arguments would only repeat what the device
+ * was left in by the previous daemon.
+ */
+bool state_is_current(const char *name, int argc, const char **argv)
+{
+	struct state_entry *e;
+	bool current = false;
+	unsigned int i;
+
+	for (i = 0; i < nentries; ++i) {
+		e = &entries[i];
+		if (e->kind == STATE_COMMAND && strcmp(e->name, name) == 0) {
+			current = e->restored &&
+			          args_match(e->value, argc, argv);
+			break;
+		}
+	}
+
+	return current;
+}
+
+static int state_status(int argc, const char **argv UNUSED)
+{
+	struct state_entry snap[STATE_MAX_ENTRIES];
+	unsigned int i, n;
+
+	if (argc != 0)
+		return -1;
+
+	n = state_snapshot(snap, STATE_MAX_ENTRIES);
+	for (i = 0; i < n; ++i)
+		command_printf("%s %s %ld %u %s\n", kind_names[snap[i].kind],
+		               snap[i].name, (long)snap[i].time,
+		               snap[i].count, snap[i].value);
+
+	return 0;
+}
+
+int state_init(void)
+{
+	return register_command(STATE_COMMAND_NAME,
+	                        "Show the last known state of the device",
+	                        "Show the last arguments of every command and "
+	                        "event, one per line:\n"
+	                        "\tcommand|event NAME TIME COUNT VALUE...\n",
+	                        state_status);
+}
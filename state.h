@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "events.h"
+#include "statuspage.h"
+
+#define STATE_MAX_ENTRIES	STATUS_PAGE_ENTRIES
+#define STATE_NAME_LEN		STATUS_NAME_LEN
+#define STATE_VALUE_LEN		STATUS_VALUE_LEN
+
+/* The values match those used in the status page */
+enum state_kind {
+	STATE_COMMAND = STATUS_KIND_COMMAND,
+	STATE_EVENT = STATUS_KIND_EVENT,
+};
+
+struct state_entry {
+	enum state_kind kind;
+	char name[STATE_NAME_LEN];
+	char value[STATE_VALUE_LEN];
+	time_t time;
+	uint32_t count;
+	bool restored;		/* Loaded by state_restore(), not yet updated */
+};
+
+int state_init(void);
+int state_publish(const char *path);
+void state_unpublish(bool keep);
+int state_restore(const char *path);
+bool state_is_current(const char *name, int argc, const char **argv);
+void state_command(const char *name, int argc, const char **argv);
+void state_error(const char *name, int argc, const char **argv);
+void state_event(const struct event_record *rec);
+void state_unhandled(void);
+unsigned int state_snapshot(struct state_entry *entries, unsigned int max);
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATUSPAGE_H
+#define STATUSPAGE_H
+
+/*
+ * Layout of the status page the daemon keeps in STATUS_PAGE_PATH. The file
+ * is mapped shared by the daemon and read-only by anyone else, so the
+ * state can be read without talking to the daemon.
+ *
+ * The page is protected by a sequence counter which is odd while the
+ * daemon is updating it. Readers copy the page and retry if the counter
+ * was odd or changed meanwhile, see status_page_read().
+ *
+ * Fields are only ever added at the end of the header, increasing
+ * STATUS_PAGE_VERSION. Readers must use header.entry_offset and
+ * header.entry_size rather than sizeof() to find the entries.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+#define STATUS_PAGE_PATH	"/run/qcontrol.status"
+#define STATUS_PAGE_MAGIC	0x71637374	/* "qcst" */
+#define STATUS_PAGE_VERSION	2
+#define STATUS_PAGE_ENTRIES	32
+#define STATUS_NAME_LEN		32
+#define STATUS_VALUE_LEN	64
+#define STATUS_PAGE_RETRIES	1000
+
+/* Values of status_page_entry.kind */
+#define STATUS_KIND_COMMAND	0	/* Last arguments of a command */
+#define STATUS_KIND_EVENT	1	/* Last arguments of a Lua handler */
+
+struct status_page_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t size;		/* Of the whole page */
+	uint32_t entry_offset;
+	uint32_t entry_size;
+	uint32_t max_entries;
+	uint32_t nentries;
+	uint32_t commands;	/* Commands carried out */
+	uint32_t events;	/* Events received */
+	uint32_t errors;	/* Commands which failed */
+	uint32_t pid;		/* Of the daemon */
+	int64_t error_time;
+	char last_error[STATUS_VALUE_LEN];
+	uint32_t unhandled;	/* Events without a Lua function, version 2 */
+};
+
+struct status_page_entry {
+	uint32_t kind;
+	uint32_t count;
+	int64_t time;
+	char name[STATUS_NAME_LEN];
+	char value[STATUS_VALUE_LEN];
+};
+
+struct status_page {
+	struct status_page_header header;
+	struct status_page_entry entries[STATUS_PAGE_ENTRIES];
+};
+
+/**
+ * Copy a consistent snapshot of a mapped status page into dst, which has
+ * room for size bytes; size must not exceed the mapping. Returns the number
+ * of bytes copied, or -1 with errno set to EAGAIN if the daemon was still
+ * updating the page after STATUS_PAGE_RETRIES attempts, as it is forever
+ * if it died in the middle.
+ */
+static inline int status_page_read(const struct status_page *page,
+                                   void *dst, uint32_t size)
+{
+	uint32_t seq, len;
+	int i;
+
+	for (i = 0; i < STATUS_PAGE_RETRIES; ++i) {
+		seq = __atomic_load_n(&page->header.seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		len = page->header.size < size ? page->header.size : size;
+		memcpy(dst, page, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->header.seq, __ATOMIC_RELAXED) == seq)
+			return len;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+#endif
@@ -31,8 +31,19 @@
 
 #include "picmodule.h"
 #include "synology.h"
+#include "wqueue.h"
+
+/* Write queue classes, a later write replaces a queued one of its class */
+enum {
+	SYNOLOGY_WQ_POWERLED = WQUEUE_BARRIER + 1,
+	SYNOLOGY_WQ_STATUSLED,
+	SYNOLOGY_WQ_USBLED,
+	SYNOLOGY_WQ_AUTOPOWER,
+	SYNOLOGY_WQ_RTC,
+};
 
 static int serial;
+static struct wqueue *wqueue;
 static struct termios oldtio, newtio;
 static pthread_t synology_thread;
 
@@ -56,15 +67,15 @@ static int synology_serial_read(unsigned char *buf, int len)
 	return err;
 }
 
-static int synology_serial_write(unsigned char *buf, int len)
+static int synology_serial_write(int class, const unsigned char *buf,
+                                 int len)
 {
-	int err;
-
-	err = write(serial, buf, len);
-
-	return err;
+	return wqueue_write(wqueue, class, buf, len);
 }
 
+/* Lua functions called for PIC events */
+static int power_button, media_button, restart_button;
+
 static int synology_read_serial_events(void)
 {
 	unsigned char buf[100];
@@ -73,13 +84,13 @@ static int synology_read_serial_events(void)
 		return err;
 	switch (buf[0]) {
 	case SYNOLOGY_PICSTS_POWER_BUTTON:
-		call_function("power_button", "%d", 3);
+		call_handler(power_button, 3);
 		break;
 	case SYNOLOGY_PICSTS_MEDIA_BUTTON:
-		call_function("media_button", "%d", 3);
+		call_handler(media_button, 3);
 		break;
 	case SYNOLOGY_PICSTS_RESET_BUTTON:
-		call_function("restart_button", "%d", 3);
+		call_handler(restart_button, 3);
 		break;
 	default:
 		print_log(LOG_WARNING, "(PIC 0x%x) unknown command from PIC",
@@ -97,8 +108,12 @@ static void *serial_poll(void *data UNUSED)
 	FD_ZERO(&rset);
 	FD_SET(serial, &rset);
 
+	/* Cancellation is only allowed during select() */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 		err = select(serial + 1, &rset, NULL, NULL, NULL);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 		if (err <= 0) {
 			FD_SET(serial, &rset);
 			continue;
@@ -157,125 +172,92 @@ static int synology_serial_open(char *device)
 		return -1;
 	}
 
+	wqueue = wqueue_new("synology", serial);
+	if (!wqueue)
+		return -1;
+
 	return 0;
 }
 
 static void synology_serial_close(void)
 {
+	pthread_cancel(synology_thread);
+	pthread_join(synology_thread, NULL);
+	wqueue_free(wqueue);
+	wqueue = NULL;
 	tcsetattr(serial, TCSANOW, &oldtio);
 	close(serial);
 }
 
-static int synology_cmd_powerled(int argc, const char **argv)
-{
-	unsigned char code = 0;
-
-	if (argc != 1)
-		return -1;
+static const struct picoption synology_powerled_options[] = {
+	{ "on",		SYNOLOGY_PICCMD_POWER_LED_ON },
+	{ "off",	SYNOLOGY_PICCMD_POWER_LED_OFF },
+	{ "2hz",	SYNOLOGY_PICCMD_POWER_LED_2HZ },
+	{ NULL }
+};
 
-	if (strcmp(argv[0], "on") == 0)
-		code = SYNOLOGY_PICCMD_POWER_LED_ON;
-	else if (strcmp(argv[0], "2hz") == 0)
-		code = SYNOLOGY_PICCMD_POWER_LED_2HZ;
-	else if (strcmp(argv[0], "off") == 0)
-		code = SYNOLOGY_PICCMD_POWER_LED_OFF;
-	else
-		return -1;
+static const struct picoption synology_statusled_options[] = {
+	{ "orange2hz",	SYNOLOGY_PICCMD_STATUS_ORANGE_2HZ },
+	{ "green2hz",	SYNOLOGY_PICCMD_STATUS_GREEN_2HZ },
+	{ "orangeon",	SYNOLOGY_PICCMD_STATUS_ORANGE_ON },
+	{ "greenon",	SYNOLOGY_PICCMD_STATUS_GREEN_ON },
+	{ "off",	SYNOLOGY_PICCMD_STATUS_OFF },
+	{ NULL }
+};
 
-	return synology_serial_write(&code, 1);
-}
+static const struct picoption synology_usbled_options[] = {
+	{ "on",		SYNOLOGY_PICCMD_USB_LED_ON },
+	{ "2hz",	SYNOLOGY_PICCMD_USB_LED_2HZ },
+	{ "off",	SYNOLOGY_PICCMD_USB_LED_OFF },
+	{ NULL }
+};
 
-static int synology_cmd_statusled(int argc, const char **argv)
-{
-	unsigned char code = 0;
+static const struct picoption synology_autopower_options[] = {
+	{ "on",		SYNOLOGY_PICCMD_AUTOPOWER_ON },
+	{ "off",	SYNOLOGY_PICCMD_AUTOPOWER_OFF },
+	{ NULL }
+};
 
-	if (argc != 1)
-		return -1;
+static const struct picoption synology_buzzer_options[] = {
+	{ "short",	SYNOLOGY_PICCMD_BUZZER_SHORT },
+	{ "long",	SYNOLOGY_PICCMD_BUZZER_LONG },
+	{ NULL }
+};
 
-	if (strcmp(argv[0], "orange2hz") == 0)
-		code = SYNOLOGY_PICCMD_STATUS_ORANGE_2HZ;
-	else if (strcmp(argv[0], "green2hz") == 0)
-		code = SYNOLOGY_PICCMD_STATUS_GREEN_2HZ;
-	else if (strcmp(argv[0], "orangeon") == 0)
-		code = SYNOLOGY_PICCMD_STATUS_ORANGE_ON;
-	else if (strcmp(argv[0], "greenon") == 0)
-		code = SYNOLOGY_PICCMD_STATUS_GREEN_ON;
-	else if (strcmp(argv[0], "off") == 0)
-		code = SYNOLOGY_PICCMD_STATUS_OFF;
-	else
-		return -1;
+static const struct picoption synology_rtc_options[] = {
+	{ "on",		SYNOLOGY_PICCMD_RTC_ENABLE },
+	{ "off",	SYNOLOGY_PICCMD_RTC_DISABLE },
+	{ NULL }
+};
 
-	return synology_serial_write(&code, 1);
+static int synology_cmd_powerled(const struct picoption *option)
+{
+	return synology_serial_write(SYNOLOGY_WQ_POWERLED, &option->code, 1);
 }
 
-static int synology_cmd_usbled(int argc, const char **argv)
+static int synology_cmd_statusled(const struct picoption *option)
 {
-	unsigned char code = 0;
-
-	if (argc != 1)
-		return -1;
-
-	if (strcmp(argv[0], "on") == 0)
-		code = SYNOLOGY_PICCMD_USB_LED_ON;
-	else if (strcmp(argv[0], "2hz") == 0)
-		code = SYNOLOGY_PICCMD_USB_LED_2HZ;
-	else if (strcmp(argv[0], "off") == 0)
-		code = SYNOLOGY_PICCMD_USB_LED_OFF;
-	else
-		return -1;
-
-	return synology_serial_write(&code, 1);
+	return synology_serial_write(SYNOLOGY_WQ_STATUSLED, &option->code, 1);
 }
 
-static int synology_cmd_autopower(int argc, const char **argv)
+static int synology_cmd_usbled(const struct picoption *option)
 {
-	unsigned char code = 0;
-
-	if (argc != 1)
-		return -1;
-
-	if (strcmp(argv[0], "on") == 0)
-		code = SYNOLOGY_PICCMD_AUTOPOWER_ON;
-	else if (strcmp(argv[0], "off") == 0)
-		code = SYNOLOGY_PICCMD_AUTOPOWER_OFF;
-	else
-		return -1;
-
-	return synology_serial_write(&code, 1);
+	return synology_serial_write(SYNOLOGY_WQ_USBLED, &option->code, 1);
 }
 
-static int synology_cmd_buzzer(int argc, const char **argv)
+static int synology_cmd_autopower(const struct picoption *option)
 {
-	unsigned char code = 0;
-
-	if (argc != 1)
-		return -1;
-
-	if (strcmp(argv[0], "short") == 0)
-		code = SYNOLOGY_PICCMD_BUZZER_SHORT;
-	else if (strcmp(argv[0], "long") == 0)
-		code = SYNOLOGY_PICCMD_BUZZER_LONG;
-	else
-		return -1;
-
-	return synology_serial_write(&code, 1);
+	return synology_serial_write(SYNOLOGY_WQ_AUTOPOWER, &option->code, 1);
 }
 
-static int synology_cmd_rtc(int argc, const char **argv)
+static int synology_cmd_buzzer(const struct picoption *option)
 {
-	unsigned char code = 0;
-
-	if (argc != 1)
-		return -1;
-
-	if (strcmp(argv[0], "on") == 0)
-		code = SYNOLOGY_PICCMD_RTC_ENABLE;
-	else if (strcmp(argv[0], "off") == 0)
-		code = SYNOLOGY_PICCMD_RTC_DISABLE;
-	else
-		return -1;
+	return synology_serial_write(WQUEUE_BARRIER, &option->code, 1);
+}
 
-	return synology_serial_write(&code, 1);
+static int synology_cmd_rtc(const struct picoption *option)
+{
+	return synology_serial_write(SYNOLOGY_WQ_RTC, &option->code, 1);
 }
 
 static int synology_init(int argc, const char **argv UNUSED)
@@ -287,34 +269,35 @@ static int synology_init(int argc, const char **argv UNUSED)
 		return -1;
 	}
 
+	power_button = register_handler("power_button", "%d");
+	media_button = register_handler("media_button", "%d");
+	restart_button = register_handler("restart_button", "%d");
+	if (power_button < 0 || media_button < 0 || restart_button < 0)
+		return -1;
+
 	err = synology_serial_open("/dev/ttyS1");
 	if (err < 0)
 		return err;
 
-#define REGISTER1(name,shorthelp,longhelp) do { \
-	int err = register_command(#name, shorthelp, longhelp, synology_cmd_##name); \
+#define REGISTER1(name,shorthelp,help) do { \
+	int err = register_option_command(#name, shorthelp, help, \
+	                                  synology_##name##_options, \
+	                                  synology_cmd_##name); \
 	if (err < 0) return err; \
 } while(0)
 
 	REGISTER1(powerled, "Change the power LED",
-		  "Change the power LED, options are:\n"
-		  "\ton\n\toff\n\t2hz\n");
+		  "Change the power LED");
 	REGISTER1(statusled, "Change the status LED",
-		  "Change the status LED, options are:\n"
-		  "\torange2hz\n\tgreen2hz\n"
-		  "\torangeon\n\tgreenon\n\toff\n");
+		  "Change the status LED");
 	REGISTER1(usbled, "Set the usbled",
-		  "Set the usbled, options are:\n"
-		  "\ton\n\t2hz\n\toff\n");
+		  "Set the usbled");
 	REGISTER1(autopower, "Control the automatic power mechanism",
-		  "Control the automatic power mechanism, options are:\n"
-		  "\ton\n\toff\n");
+		  "Control the automatic power mechanism");
 	REGISTER1(buzzer, "Buzz",
-		  "Buzz, options are:\n"
-		  "\tshort\n\tlong\n");
+		  "Buzz");
 	REGISTER1(rtc, "Control RTC (real time clock)",
-		  "Control RTC, options are:\n"
-		  "\ton\n\toff");
+		  "Control RTC");
 
 #undef REGISTER1
 	return synology_serial_poll();
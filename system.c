@@ -18,12 +18,14 @@
 #include <syslog.h>
 #include "picmodule.h"
 
+static int status_handler;
+
 static int system_status(int argc, const char **argv)
 {
 	if (argc != 1)
 		return -1;
 	
-	call_function("system_status", "%s", argv[0]);
+	call_handler(status_handler, argv[0]);
 	return 0;
 }
 
@@ -35,6 +37,9 @@ static int system_init(int argc, const char **argv UNUSED)
 		return -1;
 	}
 
+	status_handler = register_handler("system_status", "%s");
+	if (status_handler < 0)
+		return -1;
 	register_command("system-status",
 			 "Signal system status",
 			 "Signal system status, options are:\n"
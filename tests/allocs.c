@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Counts the daemon's heap allocations with tests/malloccount.so and checks
+ * that, once warmed up, requests are served without any: by name and by
+ * number, with and without output, through Lua, on both sockets and from
+ * version 1 clients connecting for each one.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libqcontrol.h"
+#include "tests/daemon.h"
+
+#define COUNT_PATH	"/run/qcontrol-test.mallocs"
+#define WARMUP		1000	/* Long enough for LuaJIT to compile the handler */
+#define REQUESTS	1000
+
+static const char config[] =
+	"register(\"system-status\")\n"
+	"ticks = 0\n"
+	"function system_status(status)\n"
+	"	ticks = ticks + 1\n"
+	"end\n";
+
+static const char *requests[][2] = {
+	{ "system-status", "tick" },	/* Runs Lua */
+	{ "status", NULL },		/* Has output */
+	{ "lua-memory", NULL },
+	{ "no-such-command", NULL },	/* Fails */
+};
+#define NREQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+static volatile uint64_t *count;
+
+static uint64_t allocations(void)
+{
+	return __atomic_load_n(count, __ATOMIC_RELAXED);
+}
+
+static int run(struct qcontrol *q, int n)
+{
+	const char **argv;
+	char *message;
+	int i, result, err = 0;
+
+	for (i = 0; i < n; i++) {
+		argv = requests[i % NREQUESTS];
+		if (qcontrol_command(q, argv[1] ? 2 : 1, argv, &result,
+		                     &message) < 0)
+			err = -1;
+		free(message);
+	}
+	return err;
+}
+
+/* One connection per request, as the qcontrol client of old */
+static int run_v1(int n)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	static const unsigned char req[] =
+		"\x01\x00\x00\x00" "\x07\x00\x00\x00" "status";
+	char buf[256];
+	int i, fd, err = 0;
+
+	strcpy(addr.sun_path, QCONTROL_SOCKET);
+	for (i = 0; i < n && err == 0; i++) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 ||
+		    connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		    write(fd, req, sizeof(req)) != sizeof(req))
+			err = -1;
+		while (err == 0 && read(fd, buf, sizeof(buf)) > 0)
+			;
+		if (fd >= 0)
+			close(fd);
+	}
+	return err;
+}
+
+static void none(const char *what, uint64_t n)
+{
+	if (n == 0)
+		return;
+	fprintf(stderr, "%s: %llu allocations in %d requests\n", what,
+	        (unsigned long long)n, REQUESTS);
+	test_failures++;
+}
+
+/* Allocations made by REQUESTS requests on q after warming up */
+static uint64_t steady(struct qcontrol *q)
+{
+	uint64_t before;
+
+	check(run(q, WARMUP) == 0);
+	before = allocations();
+	check(run(q, REQUESTS) == 0);
+	return allocations() - before;
+}
+
+int main(void)
+{
+	char preload[PATH_MAX];
+	struct qcontrol *q;
+	uint64_t before;
+	pid_t pid;
+	void *p;
+	int fd;
+
+	if (test_sandbox() < 0)
+		return TEST_SKIP;
+	signal(SIGPIPE, SIG_IGN);
+
+	fd = open(COUNT_PATH, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0 || ftruncate(fd, sizeof(*count)) < 0 ||
+	    !realpath("tests/malloccount.so", preload))
+		return 1;
+	p = mmap(NULL, sizeof(*count), PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return 1;
+	count = p;
+
+	/* Only the daemon is counted */
+	setenv("QCONTROL_MALLOC_COUNT", COUNT_PATH, 1);
+	setenv("LD_PRELOAD", preload, 1);
+	pid = test_daemon(config);
+	unsetenv("LD_PRELOAD");
+	if (pid < 0)
+		return 1;
+	/* A count which never moves would prove nothing */
+	check(allocations() > 0);
+
+	q = qcontrol_connect(QCONTROL_SOCKET);
+	check(q != NULL);
+	if (q) {
+		none("stream, by name", steady(q));
+
+		check(qcontrol_sync_commands(q) >= 0);
+		none("stream, by number", steady(q));
+		qcontrol_close(q);
+	}
+
+	q = qcontrol_connect(QCONTROL_SEQPACKET_SOCKET);
+	check(q != NULL);
+	if (q) {
+		none("seqpacket", steady(q));
+		qcontrol_close(q);
+	}
+
+	check(run_v1(WARMUP) == 0);
+	before = allocations();
+	check(run_v1(REQUESTS) == 0);
+	none("version 1", allocations() - before);
+
+	check(test_stop(pid) == 0);
+	if (test_failures)
+		test_log_dump();
+	return test_failures ? 1 : 0;
+}
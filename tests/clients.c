@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs many clients against the daemon's sockets at once: libqcontrol
+ * connections on both sockets which stay open, and version 1 clients
+ * which connect for each command. Two clients meanwhile stall, one in the
+ * middle of a request and one never reading its responses, and must not
+ * hold up anybody else. Every command must be answered in time and reach
+ * Lua.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libqcontrol.h"
+#include "protocol.h"
+#include "tests/daemon.h"
+
+#define CLIENTS		40	/* Half on each socket */
+#define CLIENT_COMMANDS	200
+#define V1_CLIENTS	16
+#define V1_COMMANDS	50
+#define TIMEOUT		5000	/* ms, well below the daemon's CONN_TIMEOUT */
+
+static const char config[] =
+	"register(\"system-status\")\n"
+	"ticks = 0\n"
+	"function system_status(status)\n"
+	"	ticks = ticks + 1\n"
+	"end\n";
+
+static pthread_barrier_t ready;
+static int failures;
+
+static void failed(void)
+{
+	__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+}
+
+static int connect_to(const char *path, int type)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, type, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static size_t put_uint32(unsigned char *buf, uint32_t v)
+{
+	memcpy(buf, &v, sizeof(v));
+	return sizeof(v);
+}
+
+static size_t put_string(unsigned char *buf, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	put_uint32(buf, len);
+	memcpy(buf + sizeof(uint32_t), s, len);
+	return sizeof(uint32_t) + len;
+}
+
+static void *client(void *arg)
+{
+	long n = (long)arg;
+	const char *tick[] = { "system-status", "tick" };
+	const char *status[] = { "status" };
+	const char *help[] = { "--help" };
+	const char *missing[] = { "no-such-command" };
+	struct qcontrol *q;
+	char *message;
+	int i, result;
+
+	q = qcontrol_connect_timeout(n % 2 ? QCONTROL_SEQPACKET_SOCKET :
+	                             QCONTROL_SOCKET, TIMEOUT);
+	pthread_barrier_wait(&ready);
+	if (!q) {
+		failed();
+		return NULL;
+	}
+	for (i = 0; i < CLIENT_COMMANDS; i++) {
+		if (qcontrol_command(q, 2, tick, &result, NULL) < 0 ||
+		    result < 0)
+			failed();
+		/* Now and then something with output */
+		if (i % 20 == 0) {
+			if (qcontrol_command(q, 1, status, &result,
+			                     &message) < 0 || result < 0 ||
+			    !message || !strstr(message, "system_status"))
+				failed();
+			free(message);
+		}
+		/* And the prepared responses, sent from the daemon's copy */
+		if (i % 20 == 10) {
+			if (qcontrol_command(q, 1, help, &result,
+			                     &message) < 0 || result < 0 ||
+			    !message || !strstr(message, "lua-memory"))
+				failed();
+			free(message);
+			if (qcontrol_command(q, 1, missing, &result,
+			                     &message) < 0 || result >= 0 ||
+			    !message || strcmp(message, "Command not found\n"))
+				failed();
+			free(message);
+		}
+	}
+	qcontrol_close(q);
+	return NULL;
+}
+
+/* A version 1 client, one connection per command. got is set to the
+   length of the response */
+static int v1_command(int argc, const char **argv, size_t *got)
+{
+	struct timeval tv = { TIMEOUT / 1000, 0 };
+	unsigned char buf[64];
+	size_t len = 0;
+	int32_t result;
+	ssize_t n;
+	int fd, i;
+
+	fd = connect_to(QCONTROL_SOCKET, SOCK_STREAM);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	len += put_uint32(buf, argc);
+	for (i = 0; i < argc; i++)
+		len += put_string(buf + len, argv[i]);
+	if (write(fd, buf, len) != (ssize_t)len)
+		goto err;
+	/* The response ends with the connection */
+	len = 0;
+	while (len < sizeof(buf) &&
+	       (n = read(fd, buf + len, sizeof(buf) - len)) > 0)
+		len += n;
+	if (n < 0 || len < sizeof(result))
+		goto err;
+	close(fd);
+	memcpy(&result, buf, sizeof(result));
+	*got = len;
+	return result;
+
+err:
+	close(fd);
+	return -1;
+}
+
+static void *v1_client(void *arg UNUSED)
+{
+	const char *tick[] = { "system-status", "tick" };
+	size_t len;
+	int i;
+
+	pthread_barrier_wait(&ready);
+	for (i = 0; i < V1_COMMANDS; i++)
+		if (v1_command(2, tick, &len) < 0)
+			failed();
+	return NULL;
+}
+
+/* Half an INTEGER, then nothing */
+static int stall_request(void)
+{
+	unsigned char buf[4];
+	int fd;
+
+	fd = connect_to(QCONTROL_SOCKET, SOCK_STREAM);
+	put_uint32(buf, 1);
+	if (fd < 0 || write(fd, buf, 2) != 2)
+		return -1;
+	return fd;
+}
+
+/* A version 2 client sending requests until the daemon stops taking them,
+   without ever reading a response */
+static int stall_responses(void)
+{
+	unsigned char buf[64];
+	size_t len;
+	int fd, i;
+
+	fd = connect_to(QCONTROL_SOCKET, SOCK_STREAM);
+	if (fd < 0)
+		return -1;
+	len = put_uint32(buf, QCONTROL_PROTO_MAGIC);
+	len += put_uint32(buf + len, 2);
+	if (write(fd, buf, len) != (ssize_t)len)
+		return -1;
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	for (i = 1; ; i++) {
+		len = put_uint32(buf, 0);
+		len += put_uint32(buf + len, i);
+		len += put_uint32(buf + len, QCONTROL_MSG_REQUEST);
+		len += put_uint32(buf + len, 1);
+		len += put_string(buf + len, "status");
+		put_uint32(buf, len - sizeof(uint32_t));
+		if (write(fd, buf, len) != (ssize_t)len)
+			break;
+	}
+	return fd;
+}
+
+int main(void)
+{
+	pthread_t clients[CLIENTS], v1_clients[V1_CLIENTS];
+	const char *argv[] = { "status" };
+	struct qcontrol *q;
+	char *message = NULL;
+	int stalled, flooding, result;
+	unsigned int ticks = 0;
+	const char *line;
+	size_t len = 0;
+	pid_t pid;
+	long i;
+
+	if (test_sandbox() < 0)
+		return TEST_SKIP;
+	signal(SIGPIPE, SIG_IGN);
+
+	pid = test_daemon(config);
+	if (pid < 0)
+		return 1;
+
+	stalled = stall_request();
+	flooding = stall_responses();
+	check(stalled >= 0 && flooding >= 0);
+
+	pthread_barrier_init(&ready, NULL, CLIENTS + V1_CLIENTS);
+	for (i = 0; i < CLIENTS; i++)
+		pthread_create(&clients[i], NULL, client, (void *)i);
+	for (i = 0; i < V1_CLIENTS; i++)
+		pthread_create(&v1_clients[i], NULL, v1_client, NULL);
+	for (i = 0; i < CLIENTS; i++)
+		pthread_join(clients[i], NULL);
+	for (i = 0; i < V1_CLIENTS; i++)
+		pthread_join(v1_clients[i], NULL);
+	check(failures == 0);
+
+	/* Version 1 clients take anything after $result for the commands
+	   listed by --help, so they don't get the output of status */
+	check(v1_command(1, argv, &len) == 0 && len == sizeof(int32_t));
+
+	/* Every tick made it to the state, once */
+	q = qcontrol_connect_timeout(NULL, TIMEOUT);
+	check(q != NULL);
+	if (q && qcontrol_command(q, 1, argv, &result, &message) == 0 &&
+	    message) {
+		line = strstr(message, "event system_status ");
+		if (line)
+			sscanf(line, "event system_status %*d %u", &ticks);
+	}
+	check(ticks == CLIENTS * CLIENT_COMMANDS + V1_CLIENTS * V1_COMMANDS);
+	free(message);
+	if (q)
+		qcontrol_close(q);
+
+	close(stalled);
+	close(flooding);
+	check(test_stop(pid) == 0);
+	if (test_failures) {
+		fprintf(stderr, "%d commands failed, %u ticks\n", failures,
+		        ticks);
+		test_log_dump();
+	}
+	return test_failures ? 1 : 0;
+}
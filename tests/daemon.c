@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "libqcontrol.h"
+#include "tests/daemon.h"
+
+int test_failures;
+
+/* What the daemon and the test need of the real /dev */
+static const char *dev_nodes[] = {
+	"null", "zero", "random", "urandom", "tty", NULL
+};
+
+static int bind_dev(int olddev, const char *name)
+{
+	char from[64], to[64];
+	int fd;
+
+	snprintf(from, sizeof(from), "/proc/self/fd/%d/%s", olddev, name);
+	snprintf(to, sizeof(to), "/dev/%s", name);
+	fd = open(to, O_WRONLY|O_CREAT, 0666);
+	if (fd < 0)
+		return -1;
+	close(fd);
+	return mount(from, to, NULL, MS_BIND, NULL);
+}
+
+/* Put a tmpfs over /dev holding only what we need, so /dev/ttyS1 can be
+   ours whatever the machine has. The ptys come from a devpts of our own */
+static int sandbox_dev(void)
+{
+	const char **n;
+	int olddev, err = 0;
+
+	olddev = open("/dev", O_PATH|O_DIRECTORY);
+	if (olddev < 0)
+		return -1;
+	if (mount("tmpfs", "/dev", "tmpfs", 0, "mode=755") < 0) {
+		close(olddev);
+		return -1;
+	}
+	for (n = dev_nodes; *n && err == 0; n++)
+		err = bind_dev(olddev, *n);
+	if (err == 0)
+		err = mkdir("/dev/pts", 0755);
+	if (err == 0)
+		err = mount("devpts", "/dev/pts", "devpts", 0,
+		            "newinstance,ptmxmode=0666");
+	if (err == 0)
+		err = symlink("pts/ptmx", "/dev/ptmx");
+	if (err == 0)
+		err = symlink("/proc/self/fd", "/dev/fd");
+	close(olddev);
+	return err;
+}
+
+/**
+ * Move the test into a mount namespace with empty /run, /var/cache and
+ * /dev. Returns -1 with a message if the test can't run here, whereupon it
+ * should exit with TEST_SKIP.
+ */
+int test_sandbox(void)
+{
+	if (geteuid() != 0) {
+		fprintf(stderr, "skipped: needs root\n");
+		return -1;
+	}
+	if (unshare(CLONE_NEWNS) < 0 ||
+	    mount(NULL, "/", NULL, MS_REC|MS_PRIVATE, NULL) < 0) {
+		fprintf(stderr, "skipped: no mount namespace: %s\n",
+		        strerror(errno));
+		return -1;
+	}
+	if (mount("tmpfs", "/run", "tmpfs", 0, "mode=755") < 0 ||
+	    mount("tmpfs", "/var/cache", "tmpfs", 0, "mode=755") < 0 ||
+	    sandbox_dev() < 0) {
+		fprintf(stderr, "skipped: can't mount: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Throw away what the daemon sends the PIC */
+static void *serial_drain(void *arg)
+{
+	int fd = (int)(long)arg;
+	char buf[256];
+
+	while (read(fd, buf, sizeof(buf)) > 0 || errno == EINTR)
+		;
+	return NULL;
+}
+
+/**
+ * Make /dev/ttyS1 a pty, returning the master side for the test to play
+ * the PIC on. What the daemon writes to it is read and dropped.
+ */
+int test_serial(void)
+{
+	pthread_t thread;
+	const char *slave;
+	int fd;
+
+	fd = posix_openpt(O_RDWR|O_NOCTTY);
+	if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0)
+		return -1;
+	slave = ptsname(fd);
+	if (!slave || symlink(slave, "/dev/ttyS1") < 0)
+		return -1;
+	if (pthread_create(&thread, NULL, serial_drain, (void *)(long)fd))
+		return -1;
+	pthread_detach(thread);
+	return fd;
+}
+
+/**
+ * Start ./qcontrol in the foreground on the given configuration, with its
+ * output going to TEST_LOG, and wait until it takes connections.
+ */
+pid_t test_daemon(const char *config)
+{
+	struct timespec pause = { 0, 10 * 1000 * 1000 };
+	struct qcontrol *q;
+	FILE *f;
+	pid_t pid;
+	int fd, i;
+
+	f = fopen(TEST_CONFIG, "w");
+	if (!f)
+		return -1;
+	fputs(config, f);
+	if (fclose(f) != 0)
+		return -1;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		fd = open(TEST_LOG, O_WRONLY|O_CREAT|O_APPEND, 0644);
+		if (fd < 0)
+			_exit(127);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		execl("./qcontrol", "qcontrol", "-f", "-c", TEST_CONFIG,
+		      (char *)NULL);
+		_exit(127);
+	}
+
+	for (i = 0; i < 1000; i++) {
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			break;
+		q = qcontrol_connect(NULL);
+		if (q) {
+			qcontrol_close(q);
+			return pid;
+		}
+		nanosleep(&pause, NULL);
+	}
+	fprintf(stderr, "The daemon did not start\n");
+	test_log_dump();
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+/**
+ * Stop the daemon, returning -1 if it had died on its own.
+ */
+int test_stop(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, WNOHANG) == pid)
+		return -1;
+	kill(pid, SIGTERM);
+	if (waitpid(pid, &status, 0) != pid)
+		return -1;
+	if (WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM)
+		return 0;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/**
+ * Find the last line of the daemon's output containing pattern.
+ */
+int test_log_grep(const char *pattern, char *line, size_t size)
+{
+	char buf[1024];
+	int found = -1;
+	FILE *f;
+
+	f = fopen(TEST_LOG, "r");
+	if (!f)
+		return -1;
+	while (fgets(buf, sizeof(buf), f)) {
+		if (strstr(buf, pattern)) {
+			snprintf(line, size, "%s", buf);
+			found = 0;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+void test_log_dump(void)
+{
+	char buf[1024];
+	FILE *f;
+
+	f = fopen(TEST_LOG, "r");
+	if (!f)
+		return;
+	fprintf(stderr, "--- %s\n", TEST_LOG);
+	while (fgets(buf, sizeof(buf), f))
+		fputs(buf, stderr);
+	fclose(f);
+}
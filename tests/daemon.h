@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TESTS_DAEMON_H
+#define TESTS_DAEMON_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Tests which run the daemon built in the tree against its real sockets.
+ * They need root: test_sandbox() moves the test into a mount namespace of
+ * its own with tmpfs over /run, /var/cache and /dev, so that the sockets,
+ * status page and caches never meet those of an installed daemon, and
+ * test_serial() can put a pty where the serial modules look for the PIC.
+ */
+
+#define UNUSED __attribute__ ((unused))
+
+#define TEST_SKIP	77	/* Exit status of a test which can't run */
+#define TEST_CONFIG	"/run/qcontrol-test.conf"
+#define TEST_LOG	"/run/qcontrol-test.log"
+
+#define check(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, \
+		        #cond); \
+		test_failures++; \
+	} \
+} while (0)
+
+extern int test_failures;
+
+int test_sandbox(void);
+int test_serial(void);
+pid_t test_daemon(const char *config);
+int test_stop(pid_t pid);
+int test_log_grep(const char *pattern, char *line, size_t size);
+void test_log_dump(void);
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Drives the QNAP fan curve of qnap-pic.c with temperature sequences,
+ * standing in for the daemon functions it calls.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "picmodule.h"
+#include "qnap-pic.h"
+#include "wqueue.h"
+
+#define TEMP_HANDLER	1
+#define LEVEL_HANDLER	2
+
+static int (*fancurve)(int argc, const char **argv);
+static char speed_set[16];	/* Last "fanspeed" queued */
+static int queue_fails;		/* queue_command() calls which fail */
+static char level_seen[16];	/* Last fan_level() speed */
+static int level_temp;
+static int temp_seen;		/* Last temp(), -1 for none */
+static int recorded;		/* Readings passed to record_handler() */
+static char output[256];
+static int failures;
+
+/* The daemon, as far as qnap-pic.c uses it */
+
+int print_log(int priority UNUSED, const char *format UNUSED, ...)
+{
+	return 0;
+}
+
+int command_printf(const char *format, ...)
+{
+	size_t len = strlen(output);
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(output + len, sizeof(output) - len, format, ap);
+	va_end(ap);
+	return 0;
+}
+
+int register_option_command(const char *cmd UNUSED,
+                            const char *shorthelp UNUSED,
+                            const char *help UNUSED,
+                            const struct picoption *options UNUSED,
+                            int (*call)(const struct picoption *) UNUSED)
+{
+	return 0;
+}
+
+int register_local_command(const char *cmd, const char *shorthelp UNUSED,
+                           const char *help UNUSED,
+                           int (*call)(int argc, const char **argv))
+{
+	if (strcmp(cmd, "fancurve") == 0)
+		fancurve = call;
+	return 0;
+}
+
+int register_handler(const char *fname, const char *fmt UNUSED)
+{
+	return strcmp(fname, "fan_level") == 0 ? LEVEL_HANDLER : TEMP_HANDLER;
+}
+
+int call_handler(int handler, ...)
+{
+	va_list ap;
+
+	va_start(ap, handler);
+	if (handler == LEVEL_HANDLER) {
+		level_temp = va_arg(ap, int);
+		snprintf(level_seen, sizeof(level_seen), "%s",
+		         va_arg(ap, char *));
+	} else {
+		temp_seen = va_arg(ap, int);
+	}
+	va_end(ap);
+	return 0;
+}
+
+int record_handler(int handler UNUSED, ...)
+{
+	recorded++;
+	return 0;
+}
+
+int queue_command(const char *cmd, int argc, const char **argv)
+{
+	if (queue_fails > 0) {
+		queue_fails--;
+		return -1;
+	}
+	if (strcmp(cmd, "fanspeed") != 0 || argc != 1)
+		return -1;
+	snprintf(speed_set, sizeof(speed_set), "%s", argv[0]);
+	return 0;
+}
+
+struct wqueue *wqueue_new(const char *name UNUSED, int fd UNUSED)
+{
+	return NULL;
+}
+
+void wqueue_free(struct wqueue *q UNUSED)
+{
+}
+
+int wqueue_write(struct wqueue *q UNUSED, int class UNUSED,
+                 const unsigned char *buf UNUSED, int len)
+{
+	return len;
+}
+
+/* The tests */
+
+#define check(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, \
+		        #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* Run "fancurve" with the space separated arguments in line */
+static int set_curve(const char *line)
+{
+	const char *argv[16];
+	char buf[256], *p;
+	int argc = 0;
+
+	snprintf(buf, sizeof(buf), "%s", line);
+	for (p = strtok(buf, " "); p && argc < 16; p = strtok(NULL, " "))
+		argv[argc++] = p;
+	output[0] = '\0';
+	return fancurve(argc, argv);
+}
+
+/* Pass temp to the curve, returning the speed set for it, "" if none */
+static const char *reading(int temp)
+{
+	speed_set[0] = '\0';
+	level_seen[0] = '\0';
+	temp_seen = -1;
+	qnap_fan_temp(TEMP_HANDLER, temp);
+	return speed_set;
+}
+
+static void test_parse(void)
+{
+	/* The curve of the ts219, ts409 and ts41x examples */
+	check(set_curve("silence 32:35 low 35:40 medium 45:50 high "
+	                "55:65 full") == 0);
+	check(set_curve("high") == 0);
+	check(set_curve("off") == 0);
+
+	check(set_curve("loud") < 0);
+	check(set_curve("silence 32:35") < 0);
+	check(set_curve("silence 32-35 low") < 0);
+	check(set_curve("silence 32:35x low") < 0);
+	check(set_curve("silence 35:32 low") < 0);
+	check(set_curve("silence 32:35 low 35:40 medium 45:50 high "
+	                "55:65 full 70:75 full 80:85 full") < 0);
+
+	/* Neither edge may stand still or go back between levels */
+	check(set_curve("silence 40:45 low 30:35 medium") < 0);
+	check(set_curve("silence 32:35 low 32:40 medium") < 0);
+	check(set_curve("silence 32:40 low 35:40 medium") < 0);
+	check(set_curve("silence 32:45 low 35:40 medium") < 0);
+}
+
+static void test_levels(void)
+{
+	check(set_curve("silence 32:35 low 35:40 medium 45:50 high "
+	                "55:65 full") == 0);
+
+	/* The first reading picks its level straight away */
+	check(strcmp(reading(45), "medium") == 0);
+	check(strcmp(level_seen, "medium") == 0 && level_temp == 45);
+	check(temp_seen == -1);
+
+	/* Nothing changes inside the band */
+	check(strcmp(reading(50), "") == 0);
+	check(strcmp(reading(45), "") == 0);
+	check(level_seen[0] == '\0');
+
+	check(strcmp(reading(35), "") == 0);
+	check(strcmp(reading(34), "low") == 0);
+	check(strcmp(reading(40), "") == 0);
+	check(strcmp(reading(41), "medium") == 0);
+
+	/* A jump crosses several levels at once, either way */
+	check(strcmp(reading(70), "full") == 0);
+	check(strcmp(reading(55), "") == 0);
+	check(strcmp(reading(54), "high") == 0);
+	check(strcmp(reading(20), "silence") == 0);
+	check(strcmp(reading(35), "") == 0);
+	check(strcmp(reading(36), "low") == 0);
+
+	output[0] = '\0';
+	check(fancurve(0, NULL) == 0);
+	check(strstr(output, "speed low\ntemperature 36\n") != NULL);
+}
+
+static void test_queue_full(void)
+{
+	check(set_curve("silence 32:35 low") == 0);
+	check(strcmp(reading(30), "silence") == 0);
+
+	/* The level isn't taken until the speed could be queued */
+	queue_fails = 1;
+	check(strcmp(reading(40), "") == 0);
+	check(level_seen[0] == '\0');
+	check(strcmp(reading(40), "low") == 0);
+	check(strcmp(level_seen, "low") == 0);
+}
+
+static void test_off(void)
+{
+	int before;
+
+	check(set_curve("silence 32:35 low") == 0);
+	before = recorded;
+	reading(40);
+	check(recorded == before + 1);
+
+	/* Every reading goes to temp() again */
+	check(set_curve("off") == 0);
+	check(strcmp(reading(40), "") == 0);
+	check(temp_seen == 40);
+	check(recorded == before + 1);
+}
+
+int main(void)
+{
+	if (qnap_register_commands(QNAP_PIC_FEATURE_FANSPEED) < 0 ||
+	    !fancurve) {
+		fprintf(stderr, "fancurve was not registered\n");
+		return 1;
+	}
+
+	test_parse();
+	test_levels();
+	test_queue_full();
+	test_off();
+
+	return failures ? 1 : 0;
+}
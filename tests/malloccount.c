@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Preloaded into the daemon by tests/allocs to count its heap allocations.
+ * The count is kept in the file named by $QCONTROL_MALLOC_COUNT, mapped
+ * shared so that the test can read it while the daemon runs. glibc calls
+ * these for its own allocations too.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+
+static uint64_t *count;
+
+__attribute__((constructor))
+static void count_init(void)
+{
+	const char *path = getenv("QCONTROL_MALLOC_COUNT");
+	void *p;
+	int fd;
+
+	if (!path)
+		return;
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return;
+	p = mmap(NULL, sizeof(*count), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p != MAP_FAILED)
+		count = p;
+}
+
+static void counted(void)
+{
+	if (count)
+		__atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	counted();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	counted();
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+	counted();
+	return __libc_realloc(p, size);
+}
+
+int posix_memalign(void **p, size_t align, size_t size)
+{
+	counted();
+	*p = __libc_memalign(align, size);
+	return *p ? 0 : ENOMEM;
+}
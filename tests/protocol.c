@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the limits the frame decoder of protocol.c enforces.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "protocol.h"
+
+static int failures;
+
+#define check(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, \
+		        #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* Parse a frame whose length field is framelen, with all of it present */
+static int frame(uint32_t framelen, struct proto_frame *f)
+{
+	static char buf[QCONTROL_MAX_MESSAGE + 2 * sizeof(uint32_t)];
+
+	memcpy(buf, &framelen, sizeof(framelen));
+	return proto_parse_frame(buf, sizeof(uint32_t) + framelen, f);
+}
+
+static void test_frame_limits(void)
+{
+	const size_t max = QCONTROL_MAX_MESSAGE - sizeof(uint32_t);
+	struct proto_frame f;
+
+	/* The whole frame, length included, must fit in the limit */
+	check(frame(max, &f) == QCONTROL_MAX_MESSAGE);
+	check(f.len == QCONTROL_MAX_MESSAGE - QCONTROL_FRAME_HEADER);
+	check(frame(max + 1, &f) < 0);
+	check(frame(QCONTROL_MAX_MESSAGE, &f) < 0);
+	check(frame(UINT32_MAX, &f) < 0);
+
+	/* An id and a type at least */
+	check(frame(QCONTROL_FRAME_HEADER - sizeof(uint32_t), &f) ==
+	      QCONTROL_FRAME_HEADER);
+	check(f.len == 0);
+	check(frame(QCONTROL_FRAME_HEADER - sizeof(uint32_t) - 1, &f) < 0);
+}
+
+static void test_partial(void)
+{
+	struct proto_frame f;
+	struct outbuf o;
+	const char *argv[] = { "statusled", "greenon" };
+	uint32_t id = 7;
+	size_t len;
+
+	outbuf_init(&o, NULL, 0);
+	proto_put_request(&o, &id, NULL, 2, argv);
+	check(!o.error);
+
+	/* More is needed until the last byte is there */
+	for (len = 0; len < o.len; len++)
+		check(proto_parse_frame(o.data, len, &f) == 0);
+	check(proto_parse_frame(o.data, o.len, &f) == (int)o.len);
+	check(f.id == 7 && f.type == QCONTROL_MSG_REQUEST);
+	outbuf_reset(&o);
+}
+
+/* A version 5 table: a command without options and one with two */
+static void test_options(void)
+{
+	struct proto_command *cmds;
+	struct proto_frame f;
+	struct timespec dl;
+	struct outbuf o;
+	uint32_t instance, cmd, option;
+	unsigned int count;
+
+	outbuf_init(&o, NULL, 0);
+	outbuf_put_u32(&o, 42);
+	outbuf_put_u32(&o, 2);
+	outbuf_put_u32(&o, 0);
+	outbuf_put_u32(&o, 0);
+	outbuf_put_string(&o, "status");
+	outbuf_put_u32(&o, 0);
+	outbuf_put_u32(&o, 1);
+	outbuf_put_u32(&o, 0);
+	outbuf_put_string(&o, "usbled");
+	outbuf_put_u32(&o, 2);
+	outbuf_put_string(&o, "on");
+	outbuf_put_string(&o, "off");
+	check(!o.error);
+
+	check(proto_parse_commands(o.data, o.len, true, &instance, &cmds,
+	                           &count) == 0);
+	check(instance == 42 && count == 2);
+	check(cmds && cmds[0].noptions == 0 && cmds[1].noptions == 2);
+	if (cmds) {
+		check(proto_find_option(&cmds[1], "on") == 0);
+		check(proto_find_option(&cmds[1], "off") == 1);
+		check(proto_find_option(&cmds[1], "of") == -1);
+	}
+	free(cmds);
+	/* Neither read as version 4 nor cut short */
+	check(proto_parse_commands(o.data, o.len, false, &instance, &cmds,
+	                           &count) < 0);
+	free(cmds);
+	check(proto_parse_commands(o.data, o.len - 1, true, &instance, &cmds,
+	                           &count) < 0);
+	free(cmds);
+	outbuf_reset(&o);
+
+	proto_put_call_option(&o, 3, NULL, 42, 1, 1);
+	check(proto_parse_frame(o.data, o.len, &f) == (int)o.len);
+	check(f.type == QCONTROL_MSG_CALL_OPTION);
+	check(proto_parse_call_option(f.payload, f.len, &dl, &instance, &cmd,
+	                              &option) == 0);
+	check(instance == 42 && cmd == 1 && option == 1);
+	check(proto_parse_call_option(f.payload, f.len - 1, &dl, &instance,
+	                              &cmd, &option) < 0);
+	outbuf_reset(&o);
+}
+
+int main(void)
+{
+	test_frame_limits();
+	test_partial();
+	test_options();
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the daemon with the ts41x and evdev modules and has their threads
+ * post events as fast as they can, while clients run commands and Lua
+ * sends the PIC commands of its own. Every event the main loop takes must
+ * reach Lua, the status page and the subscribers alike, and every command
+ * must succeed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "libqcontrol.h"
+#include "tests/daemon.h"
+
+#define EVDEV_PATH	"/run/qcontrol-test.evdev"
+#define SERIAL_BYTES	20000
+#define EVDEV_EVENTS	5000
+#define CLIENTS		8
+#define CLIENT_COMMANDS	500
+
+static const char config[] =
+	"register(\"ts41x\")\n"
+	"register(\"evdev\", \"" EVDEV_PATH "\", 1, \"button\")\n"
+	"register(\"system-status\")\n"
+	"seen = { temp = 0, power_button = 0, button = 0 }\n"
+	"function temp(t)\n"
+	"	seen.temp = seen.temp + 1\n"
+	"	piccmd(\"usbled\", t % 2 == 0 and \"on\" or \"off\")\n"
+	"end\n"
+	"function power_button(time)\n"
+	"	seen.power_button = seen.power_button + 1\n"
+	"end\n"
+	"function button(time)\n"
+	"	seen.button = seen.button + 1\n"
+	"end\n"
+	"function system_status(status)\n"
+	"	logprint(string.format(\"seen temp %d power_button %d button %d\",\n"
+	"	         seen.temp, seen.power_button, seen.button))\n"
+	"end\n";
+
+static const char *client_commands[][2] = {
+	{ "statusled", "greenon" },
+	{ "status", NULL },
+	{ "lua-memory", NULL },
+	{ "usbled", "8hz" },
+};
+#define NCOMMANDS (sizeof(client_commands) / sizeof(client_commands[0]))
+
+static int serial;
+static int evdev;
+static int command_failures;	/* Commands which did not return >= 0 */
+static volatile int subscribed, stopping;
+static unsigned long received, dropped;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void pause_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000 * 1000 };
+
+	nanosleep(&ts, NULL);
+}
+
+/* Play the PIC: temperatures with the odd power button among them */
+static void *serial_producer(void *arg UNUSED)
+{
+	unsigned char c;
+	int i;
+
+	for (i = 0; i < SERIAL_BYTES; i++) {
+		c = i % 7 == 0 ? 0x40 : 0x80 + i % 60;
+		if (write(serial, &c, 1) != 1)
+			break;
+		if (i % 64 == 0)
+			pause_ms(1);
+	}
+	return NULL;
+}
+
+/* Button releases, each on its own as evdev reads them from a real device,
+   so that none is lost */
+static void *evdev_producer(void *arg UNUSED)
+{
+	struct input_event ie;
+	int i, left;
+
+	memset(&ie, 0, sizeof(ie));
+	ie.type = EV_KEY;
+	ie.code = 1;
+	for (i = 0; i < EVDEV_EVENTS; i++) {
+		if (write(evdev, &ie, sizeof(ie)) != sizeof(ie))
+			break;
+		while (ioctl(evdev, FIONREAD, &left) == 0 && left > 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void *client(void *arg)
+{
+	long n = (long)arg;
+	struct qcontrol *q;
+	const char **cmd;
+	char *message;
+	int i, result, failed = 0;
+
+	q = qcontrol_connect(NULL);
+	/* Half of them send the PIC commands as option numbers */
+	if (!q || (n % 2 && qcontrol_sync_commands(q) < 0)) {
+		__atomic_add_fetch(&command_failures, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	for (i = 0; i < CLIENT_COMMANDS; i++) {
+		cmd = client_commands[(i + n) % NCOMMANDS];
+		if (qcontrol_command(q, cmd[1] ? 2 : 1, cmd, &result,
+		                     &message) < 0 || result < 0)
+			failed++;
+		free(message);
+	}
+	qcontrol_close(q);
+	__atomic_add_fetch(&command_failures, failed, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void count_event(void *data UNUSED, const struct qcontrol_event *ev)
+{
+	pthread_mutex_lock(&lock);
+	received++;
+	dropped += ev->dropped;
+	pthread_mutex_unlock(&lock);
+}
+
+static void *subscriber(void *arg UNUSED)
+{
+	struct qcontrol *q;
+
+	q = qcontrol_connect(NULL);
+	if (!q || qcontrol_subscribe(q, count_event, NULL) < 0) {
+		fprintf(stderr, "Can't subscribe: %s\n", strerror(errno));
+		subscribed = -1;
+		return NULL;
+	}
+	subscribed = 1;
+	while (!stopping)
+		if (qcontrol_wait_timeout(q, 100) < 0 && errno != ETIMEDOUT)
+			break;
+	qcontrol_close(q);
+	return NULL;
+}
+
+/* The count of an entry of "status", -1 if it isn't there */
+static long status_count(const char *status, const char *kind,
+                         const char *name)
+{
+	char k[16], n[64];
+	const char *line;
+	unsigned int count;
+	long t;
+
+	for (line = status; line && *line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (sscanf(line, "%15s %63s %ld %u", k, n, &t, &count) == 4 &&
+		    !strcmp(k, kind) && !strcmp(n, name))
+			return count;
+	}
+	return -1;
+}
+
+/* Events the daemon reported lost to a full queue */
+static long lost_events(void)
+{
+	char buf[256];
+	long lost = 0;
+	unsigned int n;
+	FILE *f;
+
+	f = fopen(TEST_LOG, "r");
+	if (!f)
+		return -1;
+	while (fgets(buf, sizeof(buf), f))
+		if (sscanf(buf, "%u events lost", &n) == 1)
+			lost += n;
+	fclose(f);
+	return lost;
+}
+
+static char *get_status(void)
+{
+	const char *argv[] = { "status" };
+	struct qcontrol *q;
+	char *message = NULL;
+	int result;
+
+	q = qcontrol_connect(NULL);
+	if (!q)
+		return NULL;
+	if (qcontrol_command(q, 1, argv, &result, &message) < 0 ||
+	    result != 0) {
+		free(message);
+		message = NULL;
+	}
+	qcontrol_close(q);
+	return message;
+}
+
+/* Wait for the queue to drain, that is the counts to stop moving */
+static char *settled_status(void)
+{
+	char *last = NULL, *status;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		pause_ms(200);
+		status = get_status();
+		if (!status)
+			break;
+		if (last && !strcmp(last, status)) {
+			free(last);
+			return status;
+		}
+		free(last);
+		last = status;
+	}
+	free(last);
+	return NULL;
+}
+
+static int report(void)
+{
+	const char *argv[] = { "system-status", "report" };
+	struct qcontrol *q;
+	int result = -1;
+
+	q = qcontrol_connect(NULL);
+	if (!q)
+		return -1;
+	if (qcontrol_command(q, 2, argv, &result, NULL) < 0)
+		result = -1;
+	qcontrol_close(q);
+	return result;
+}
+
+int main(void)
+{
+	pthread_t serial_thread, evdev_thread, sub_thread;
+	pthread_t clients[CLIENTS];
+	long temp = -1, power = -1, button = -1, status_events = -1;
+	long seen[3] = { -1, -1, -1 }, lost = -1;
+	unsigned long total;
+	char line[256], *status;
+	pid_t pid;
+	long i;
+
+	if (test_sandbox() < 0)
+		return TEST_SKIP;
+	signal(SIGPIPE, SIG_IGN);
+
+	serial = test_serial();
+	/* Opened read-write so that neither side waits for the other */
+	if (serial < 0 || mkfifo(EVDEV_PATH, 0600) < 0 ||
+	    (evdev = open(EVDEV_PATH, O_RDWR)) < 0) {
+		fprintf(stderr, "Can't set up the devices: %s\n",
+		        strerror(errno));
+		return 1;
+	}
+	pid = test_daemon(config);
+	if (pid < 0)
+		return 1;
+
+	pthread_create(&sub_thread, NULL, subscriber, NULL);
+	while (!subscribed)
+		pause_ms(10);
+	check(subscribed == 1);
+
+	pthread_create(&serial_thread, NULL, serial_producer, NULL);
+	pthread_create(&evdev_thread, NULL, evdev_producer, NULL);
+	for (i = 0; i < CLIENTS; i++)
+		pthread_create(&clients[i], NULL, client, (void *)i);
+
+	pthread_join(serial_thread, NULL);
+	pthread_join(evdev_thread, NULL);
+	for (i = 0; i < CLIENTS; i++)
+		pthread_join(clients[i], NULL);
+	check(command_failures == 0);
+
+	status = settled_status();
+	check(status != NULL);
+	free(status);
+	check(report() == 0);
+	status = get_status();
+	check(status != NULL);
+	if (!status)
+		goto out;
+
+	temp = status_count(status, "event", "temp");
+	power = status_count(status, "event", "power_button");
+	button = status_count(status, "event", "button");
+	status_events = status_count(status, "event", "system_status");
+	check(temp > 0 && power > 0 && button > 0 && status_events == 1);
+	/* Serial reads drop what comes with the first byte, but evdev gets
+	   each event alone so only a full queue loses any */
+	lost = lost_events();
+	check(temp + power <= SERIAL_BYTES && button <= EVDEV_EVENTS);
+	check(button + lost >= EVDEV_EVENTS);
+
+	/* Lua saw exactly what the status page counted */
+	check(test_log_grep("seen temp", line, sizeof(line)) == 0);
+	check(sscanf(line, "seen temp %ld power_button %ld button %ld",
+	             &seen[0], &seen[1], &seen[2]) == 3);
+	check(seen[0] == temp && seen[1] == power && seen[2] == button);
+	/* temp() runs piccmd(), through the FFI with LuaJIT */
+	check(test_log_grep("Error calling", line, sizeof(line)) < 0);
+
+	/* And the subscriber got or was told it missed each of them */
+	total = temp + power + button + status_events;
+	for (i = 0; i < 50; i++) {
+		pthread_mutex_lock(&lock);
+		if (received + dropped >= total)
+			i = 50;
+		pthread_mutex_unlock(&lock);
+		if (i < 50)
+			pause_ms(100);
+	}
+	check(received + dropped == total);
+	free(status);
+
+out:
+	stopping = 1;
+	pthread_join(sub_thread, NULL);
+	check(test_stop(pid) == 0);
+	if (test_failures) {
+		fprintf(stderr, "temp %ld power_button %ld button %ld, "
+		        "%ld lost, Lua %ld %ld %ld, subscriber %lu + %lu "
+		        "dropped\n", temp, power, button, lost, seen[0],
+		        seen[1], seen[2], received, dropped);
+		test_log_dump();
+	}
+	return test_failures ? 1 : 0;
+}
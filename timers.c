@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "timers.h"
+
+struct timer {
+	int id;			/* 0 for a free slot */
+	int data;
+	uint64_t due;		/* CLOCK_MONOTONIC, in ms */
+	unsigned int period;	/* ms, 0 to run once */
+	unsigned int slack;
+};
+
+/* Configs have a handful of timers, scanning them is cheaper than
+   keeping them sorted */
+static struct timer timers[MAX_TIMERS];
+static struct timer suspended[MAX_TIMERS];
+static int timer_fd = -1;
+static int last_id;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct timer *find_timer(int id)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_TIMERS; ++i)
+		if (timers[i].id == id)
+			return &timers[i];
+	return NULL;
+}
+
+/**
+ * Wake up as late as the timer whose slack ends first allows, everything
+ * due by then runs in the same wakeup.
+ */
+static void arm(void)
+{
+	struct itimerspec its;
+	uint64_t at = UINT64_MAX;
+	unsigned int i;
+
+	memset(&its, 0, sizeof(its));
+	for (i = 0; i < MAX_TIMERS; ++i)
+		if (timers[i].id && timers[i].due + timers[i].slack < at)
+			at = timers[i].due + timers[i].slack;
+	if (at != UINT64_MAX) {
+		its.it_value.tv_sec = at / 1000;
+		its.it_value.tv_nsec = at % 1000 * 1000000;
+	}
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int timers_init(void)
+{
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	return timer_fd < 0 ? -1 : 0;
+}
+
+int timers_fd(void)
+{
+	return timer_fd;
+}
+
+/**
+ * Start a timer running after ms, and every ms after that if repeat.
+ * Returns its id, which is never 0, or -1 if all timers are in use.
+ */
+int timer_add(unsigned int ms, bool repeat, int data)
+{
+	struct timer *t = find_timer(0);
+
+	if (!t || timer_fd < 0)
+		return -1;
+	if (++last_id <= 0)
+		last_id = 1;
+
+	t->id = last_id;
+	t->data = data;
+	t->due = now_ms() + ms;
+	t->period = repeat ? ms : 0;
+	t->slack = ms / 8 < TIMER_MAX_SLACK ? ms / 8 : TIMER_MAX_SLACK;
+	arm();
+
+	return t->id;
+}
+
+/**
+ * Stop a timer, giving back its data. Returns -1 if there is no such
+ * timer, e.g. because it ran once already.
+ */
+int timer_cancel(int id, int *data)
+{
+	struct timer *t;
+
+	if (id <= 0)
+		return -1;
+	t = find_timer(id);
+	if (!t)
+		return -1;
+	*data = t->data;
+	t->id = 0;
+	arm();
+
+	return 0;
+}
+
+/**
+ * Put all timers aside while a reload runs the config. Unless
+ * timers_resume() brings them back they are forgotten, their data goes
+ * with the Lua state being replaced.
+ */
+void timers_suspend(void)
+{
+	memcpy(suspended, timers, sizeof(timers));
+	memset(timers, 0, sizeof(timers));
+	arm();
+}
+
+/**
+ * Bring back the suspended timers, dropping those started since.
+ */
+void timers_resume(void)
+{
+	memcpy(timers, suspended, sizeof(timers));
+	arm();
+}
+
+bool timers_active(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_TIMERS; ++i)
+		if (timers[i].id)
+			return true;
+	return false;
+}
+
+/**
+ * Run the timers which are due. last tells run that the timer is done
+ * with its data. Timers started by run wait for the next wakeup.
+ */
+void timers_expire(void (*run)(int data, bool last))
+{
+	int due[MAX_TIMERS];
+	unsigned int i, n = 0;
+	uint64_t expirations, now;
+	struct timer *t;
+	bool last;
+
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	now = now_ms();
+	for (i = 0; i < MAX_TIMERS; ++i)
+		if (timers[i].id && timers[i].due <= now)
+			due[n++] = timers[i].id;
+
+	for (i = 0; i < n; ++i) {
+		/* An earlier one may have cancelled it */
+		t = find_timer(due[i]);
+		if (!t)
+			continue;
+		last = t->period == 0;
+		if (last)
+			t->id = 0;
+		else
+			/* Skip the periods which have been missed */
+			t->due += ((now - t->due) / t->period + 1) * t->period;
+		run(t->data, last);
+	}
+
+	arm();
+}
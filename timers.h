@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include <stdbool.h>
+
+#define MAX_TIMERS		64
+#define TIMER_MAX_SLACK		1000	/* ms a timer may run late, at most */
+
+/*
+ * Timers of the config, all behind one timerfd watched by the main loop.
+ * A timer may run up to an eighth of its period late, so that timers due
+ * at about the same time share a wakeup. Each timer carries an int for
+ * its owner, the Lua function's reference.
+ */
+
+int timers_init(void);
+int timers_fd(void);
+int timer_add(unsigned int ms, bool repeat, int data);
+int timer_cancel(int id, int *data);
+void timers_suspend(void);
+void timers_resume(void);
+bool timers_active(void);
+void timers_expire(void (*run)(int data, bool last));
+
+#endif
@@ -26,6 +26,9 @@
 #include "picmodule.h"
 #include "qnap-pic.h"
 
+/* Lua functions called for PIC events */
+static int power_button, fan_error, fan_normal, temp_low, temp_high;
+
 static int ts209_read_serial_events(void)
 {
 	unsigned char buf[100];
@@ -34,24 +37,24 @@ static int ts209_read_serial_events(void)
 		return err;
 	switch (buf[0]) {
 	case QNAP_PICSTS_POWER_BUTTON:
-		call_function("power_button", "%d", 3);
+		call_handler(power_button, 3);
 		break;
 	case QNAP_PICSTS_POWER_LOSS_POWER_OFF:
 		/* RTC Wake-Up (ignored) */
 		break;
 	case QNAP_PICSTS_FAN1_ERROR:
-		call_function("fan_error", "");
+		call_handler(fan_error);
 		break;
 	case QNAP_PICSTS_FAN1_NORMAL:
-		call_function("fan_normal", "");
+		call_handler(fan_normal);
 		break;
 	case QNAP_PICSTS_TEMP_WARM_TO_HOT:
 	case QNAP_PICSTS_TEMP_COLD_TO_WARM:
-		call_function("temp_low", "");
+		call_handler(temp_low);
 		break;
 	case QNAP_PICSTS_TEMP_HOT_TO_WARM:
 	case QNAP_PICSTS_TEMP_WARM_TO_COLD:
-		call_function("temp_high", "");
+		call_handler(temp_high);
 		break;
 	default:
 		print_log(LOG_WARNING, "(PIC 0x%x) unknown command from PIC",
@@ -70,6 +73,15 @@ static int ts209_init(int argc, const char **argv UNUSED)
 		return -1;
 	}
 
+	power_button = register_handler("power_button", "%d");
+	fan_error = register_handler("fan_error", "");
+	fan_normal = register_handler("fan_normal", "");
+	temp_low = register_handler("temp_low", "");
+	temp_high = register_handler("temp_high", "");
+	if (power_button < 0 || fan_error < 0 || fan_normal < 0 ||
+	    temp_low < 0 || temp_high < 0)
+		return -1;
+
 	err = qnap_serial_open("/dev/ttyS1");
 	if (err < 0)
 		return err;
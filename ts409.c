@@ -27,6 +27,9 @@
 #include "picmodule.h"
 #include "qnap-pic.h"
 
+/* Lua functions called for PIC events */
+static int power_button, fan_error, fan_normal, temp;
+
 static int ts409_read_serial_events(void)
 {
 	unsigned char buf[100];
@@ -35,7 +38,7 @@ static int ts409_read_serial_events(void)
 		return err;
 	switch (buf[0]) {
 	case QNAP_PICSTS_POWER_BUTTON:
-		call_function("power_button", "%d", 3);
+		call_handler(power_button, 3);
 		break;
 	case QNAP_PICSTS_POWER_LOSS_POWER_OFF:
 		/* RTC Wake-Up (ignored) */
@@ -44,22 +47,22 @@ static int ts409_read_serial_events(void)
 	case QNAP_PICSTS_FAN2_ERROR:
 	case QNAP_PICSTS_FAN3_ERROR:
 	case QNAP_PICSTS_FAN4_ERROR:
-		call_function("fan_error", "");
+		call_handler(fan_error);
 		break;
 	case QNAP_PICSTS_FAN1_NORMAL:
 	case QNAP_PICSTS_FAN2_NORMAL:
 	case QNAP_PICSTS_FAN3_NORMAL:
 	case QNAP_PICSTS_FAN4_NORMAL:
-		call_function("fan_normal", "");
+		call_handler(fan_normal);
 		break;
 	case QNAP_PICSTS_SYS_TEMP_0 ... QNAP_PICSTS_SYS_TEMP_70:
-		call_function("temp", "%d", buf[0] - QNAP_PICSTS_SYS_TEMP_0);
+		qnap_fan_temp(temp, buf[0] - QNAP_PICSTS_SYS_TEMP_0);
 		break;
 	case QNAP_PICSTS_SYS_TEMP_71_79:
-		call_function("temp", "%d", 75);
+		qnap_fan_temp(temp, 75);
 		break;
 	case QNAP_PICSTS_SYS_TEMP_80:
-		call_function("temp", "%d", 80);
+		qnap_fan_temp(temp, 80);
 		break;
 	default:
 		print_log(LOG_WARNING, "(PIC 0x%x) unknown command from PIC",
@@ -78,6 +81,13 @@ static int ts409_init(int argc, const char **argv UNUSED)
 		return -1;
 	}
 
+	power_button = register_handler("power_button", "%d");
+	fan_error = register_handler("fan_error", "");
+	fan_normal = register_handler("fan_normal", "");
+	temp = register_handler("temp", "%d");
+	if (power_button < 0 || fan_error < 0 || fan_normal < 0 || temp < 0)
+		return -1;
+
 	err = qnap_serial_open("/dev/ttyS1");
 	if (err < 0)
 		return err;
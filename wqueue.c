@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "picmodule.h"
+#include "loop.h"
+#include "wqueue.h"
+
+struct wqueue_entry {
+	int class;
+	int len;
+	unsigned char data[WQUEUE_MAX_WRITE];
+};
+
+/*
+ * Commands are queued from the main loop and from Lua handlers running on
+ * the serial threads, so everything including the watch is protected by
+ * the lock.
+ */
+struct wqueue {
+	struct loop_watch watch;	/* Must be first */
+	const char *name;
+	pthread_mutex_t lock;
+	bool started;			/* Drained by the loop */
+	struct wqueue_entry ring[WQUEUE_SIZE];
+	unsigned int head, tail;
+	int sent;			/* Bytes of the oldest entry written */
+	unsigned long coalesced;
+	struct wqueue *next;
+};
+
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct wqueue *queues;
+static bool loop_running;		/* Between wqueue_start() and _stop() */
+
+static void wqueue_event(struct loop_watch *w, uint32_t revents);
+static void wqueue_drain(struct wqueue *q);
+
+struct wqueue *wqueue_new(const char *name, int fd)
+{
+	struct wqueue *q = calloc(1, sizeof(*q));
+
+	if (!q) {
+		print_log(LOG_ERR, "%s: out of memory for write queue", name);
+		return NULL;
+	}
+	q->watch.fd = fd;
+	q->watch.cb = wqueue_event;
+	q->name = name;
+	pthread_mutex_init(&q->lock, NULL);
+
+	pthread_mutex_lock(&list_lock);
+	/* A module registered by a reload joins the running loop */
+	if (loop_running && loop_add(&q->watch) == 0)
+		q->started = true;
+	q->next = queues;
+	queues = q;
+	pthread_mutex_unlock(&list_lock);
+
+	return q;
+}
+
+void wqueue_free(struct wqueue *q)
+{
+	struct wqueue **p;
+
+	if (!q)
+		return;
+
+	pthread_mutex_lock(&list_lock);
+	for (p = &queues; *p; p = &(*p)->next) {
+		if (*p == q) {
+			*p = q->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&list_lock);
+
+	/* Best effort at what is left, the device is going away */
+	pthread_mutex_lock(&q->lock);
+	if (q->started) {
+		wqueue_drain(q);
+		loop_del(&q->watch);
+	}
+	pthread_mutex_unlock(&q->lock);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+/**
+ * Write as much of the queue as the device accepts. Called with the lock
+ * held.
+ */
+static void wqueue_drain(struct wqueue *q)
+{
+	struct wqueue_entry *e;
+	ssize_t n;
+
+	while (q->head != q->tail) {
+		e = &q->ring[q->tail & (WQUEUE_SIZE - 1)];
+		n = write(q->watch.fd, e->data + q->sent, e->len - q->sent);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n < 0) {
+			print_log(LOG_ERR, "%s: error writing: %s", q->name,
+			          strerror(errno));
+			n = e->len - q->sent;
+		}
+		q->sent += n;
+		if (q->sent < e->len)
+			break;
+		q->sent = 0;
+		q->tail++;
+	}
+}
+
+static void wqueue_event(struct loop_watch *w, uint32_t revents)
+{
+	struct wqueue *q = (struct wqueue *)w;
+
+	pthread_mutex_lock(&q->lock);
+	if (revents & (EPOLLERR|EPOLLHUP)) {
+		/* Stop the loop spinning on a dead device */
+		print_log(LOG_ERR, "%s: device error, dropping %u writes",
+		          q->name, q->head - q->tail);
+		loop_del(w);
+		q->started = false;
+		q->head = q->tail = 0;
+		q->sent = 0;
+	} else {
+		wqueue_drain(q);
+		loop_modify(w, q->head != q->tail ? EPOLLOUT : 0);
+	}
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Find a queued write which a write of class supersedes. Called with the
+ * lock held.
+ */
+static struct wqueue_entry *wqueue_find(struct wqueue *q, int class)
+{
+	struct wqueue_entry *e;
+	unsigned int i, oldest = q->tail;
+
+	/* The oldest entry may be half way onto the wire */
+	if (q->sent)
+		oldest++;
+
+	for (i = q->head; i != oldest; --i) {
+		e = &q->ring[(i - 1) & (WQUEUE_SIZE - 1)];
+		if (e->class == WQUEUE_BARRIER)
+			break;
+		if (e->class == class)
+			return e;
+	}
+
+	return NULL;
+}
+
+/**
+ * Queue len bytes for the device. Until the event loop is running, and
+ * with --direct, the bytes are written straight away as before. Returns
+ * len once the write is queued or -1 if the queue is full.
+ */
+int wqueue_write(struct wqueue *q, int class, const unsigned char *buf,
+                 int len)
+{
+	struct wqueue_entry *e = NULL;
+	int err = len;
+
+	if (len > WQUEUE_MAX_WRITE)
+		return -1;
+
+	pthread_mutex_lock(&q->lock);
+	if (!q->started) {
+		err = write(q->watch.fd, buf, len);
+		pthread_mutex_unlock(&q->lock);
+		return err;
+	}
+
+	if (class != WQUEUE_BARRIER)
+		e = wqueue_find(q, class);
+	if (e) {
+		q->coalesced++;
+	} else if (q->head - q->tail == WQUEUE_SIZE) {
+		print_log(LOG_WARNING, "%s: write queue full", q->name);
+		err = -1;
+	} else {
+		e = &q->ring[q->head++ & (WQUEUE_SIZE - 1)];
+	}
+	if (e) {
+		e->class = class;
+		e->len = len;
+		memcpy(e->data, buf, len);
+		loop_modify(&q->watch, EPOLLOUT);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return err;
+}
+
+/**
+ * Hand every queue to the event loop, and those created until
+ * wqueue_stop() as they come.
+ */
+int wqueue_start(void)
+{
+	struct wqueue *q;
+	int err = 0;
+
+	pthread_mutex_lock(&list_lock);
+	for (q = queues; q && err == 0; q = q->next) {
+		pthread_mutex_lock(&q->lock);
+		q->watch.events = 0;
+		err = loop_add(&q->watch);
+		if (err == 0)
+			q->started = true;
+		pthread_mutex_unlock(&q->lock);
+	}
+	loop_running = err == 0;
+	pthread_mutex_unlock(&list_lock);
+
+	return err;
+}
+
+/**
+ * Whether every queue has been written out.
+ */
+bool wqueue_idle(void)
+{
+	struct wqueue *q;
+	bool idle = true;
+
+	pthread_mutex_lock(&list_lock);
+	for (q = queues; q && idle; q = q->next) {
+		pthread_mutex_lock(&q->lock);
+		idle = q->head == q->tail;
+		pthread_mutex_unlock(&q->lock);
+	}
+	pthread_mutex_unlock(&list_lock);
+
+	return idle;
+}
+
+/**
+ * Take the queues back from the event loop, writing out what is left.
+ */
+void wqueue_stop(void)
+{
+	struct wqueue *q;
+
+	pthread_mutex_lock(&list_lock);
+	loop_running = false;
+	for (q = queues; q; q = q->next) {
+		pthread_mutex_lock(&q->lock);
+		if (q->started) {
+			wqueue_drain(q);
+			loop_del(&q->watch);
+			q->started = false;
+			if (q->coalesced)
+				print_log(LOG_DEBUG, "%s: %lu writes coalesced",
+				          q->name, q->coalesced);
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+	pthread_mutex_unlock(&list_lock);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2026  qcontrol contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WQUEUE_H
+#define WQUEUE_H
+
+#include <stdbool.h>
+
+/*
+ * Queue of writes to a serial device, drained by the event loop so that
+ * commands never wait for the tty.
+ *
+ * Each write has a class. A queued write is replaced by a later one of the
+ * same class, since only the last fan speed, LED state etc matters. Writes
+ * of class WQUEUE_BARRIER (a beep, a reset) are never replaced and nothing
+ * is coalesced across them.
+ */
+
+#define WQUEUE_BARRIER	0
+#define WQUEUE_SIZE	16	/* Must be a power of two */
+#define WQUEUE_MAX_WRITE	32
+
+struct wqueue;
+
+struct wqueue *wqueue_new(const char *name, int fd);
+void wqueue_free(struct wqueue *q);
+int wqueue_write(struct wqueue *q, int class, const unsigned char *buf,
+                 int len);
+int wqueue_start(void);
+void wqueue_stop(void);
+bool wqueue_idle(void);
+
+#endif